@@ -6,9 +6,12 @@
  */
 
 #include <chrono>
+#include <cstring>
 
 #include "core/libcamera_encoder.hpp"
 #include "encoder/null_encoder.hpp"
+#include "encoder/rice_encoder.hpp"
+#include "output/dng_writer.hpp"
 #include "output/output.hpp"
 
 using namespace std::placeholders;
@@ -19,8 +22,14 @@ public:
 	LibcameraRaw() : LibcameraEncoder() {}
 
 protected:
-	// Force the use of "null" encoder.
-	void createEncoder() { encoder_ = std::unique_ptr<Encoder>(new NullEncoder(GetOptions())); }
+	// Use the "null" encoder, unless the raw frames are to be compressed.
+	void createEncoder()
+	{
+		if (GetOptions()->codec == "rice")
+			encoder_ = std::unique_ptr<Encoder>(new RiceEncoder(GetOptions(), RawStream()->configuration().pixelFormat));
+		else
+			encoder_ = std::unique_ptr<Encoder>(new NullEncoder(GetOptions()));
+	}
 };
 
 // The main even loop for the application.
@@ -28,13 +37,25 @@ protected:
 static void event_loop(LibcameraRaw &app)
 {
 	VideoOptions const *options = app.GetOptions();
-	std::unique_ptr<Output> output = std::unique_ptr<Output>(Output::Create(options));
-	app.SetEncodeBufferDoneCallback(std::bind(&LibcameraRaw::QueueRequest, &app, _1));
-	app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, output.get(), _1, _2, _3, _4));
-	app.StartEncoder();
+	std::string const &filename = options->output;
+	bool dng = filename.size() >= 4 && strcasecmp(filename.c_str() + filename.size() - 4, ".dng") == 0;
+	std::unique_ptr<Output> output;
+	if (!dng)
+	{
+		output = std::unique_ptr<Output>(Output::Create(options));
+		app.SetEncodeBufferDoneCallback(std::bind(&LibcameraRaw::QueueRequest, &app, _1));
+		app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, output.get(), _1, _2, _3, _4));
+	}
 
 	app.OpenCamera();
 	app.ConfigureVideo(LibcameraRaw::FLAG_VIDEO_RAW);
+	// The encoder is started once we know the raw format, which the rice encoder needs.
+	if (!dng)
+		app.StartEncoder();
+	// With a ".dng" output name each frame goes to its own DNG file instead, with its own metadata.
+	std::unique_ptr<DngWriter> dng_writer;
+	if (dng)
+		dng_writer = std::make_unique<DngWriter>(options, filename, app.RawStream()->configuration(), app.CameraId());
 	app.StartCamera();
 	auto start_time = std::chrono::high_resolution_clock::now();
 
@@ -61,7 +82,16 @@ static void event_loop(LibcameraRaw &app)
 			return;
 		}
 
-		app.EncodeBuffer(std::get<CompletedRequest>(msg.payload), app.RawStream());
+		CompletedRequest &completed_request = std::get<CompletedRequest>(msg.payload);
+		if (dng_writer)
+		{
+			// The writer copies the frame, so the request can go straight back to the camera.
+			libcamera::FrameBuffer *buffer = completed_request.buffers[app.RawStream()];
+			dng_writer->Write(app.Mmap(buffer)[0], completed_request.sequence, completed_request.metadata);
+			app.QueueRequest(completed_request);
+		}
+		else
+			app.EncodeBuffer(completed_request, app.RawStream());
 	}
 }
 
@@ -10,11 +10,23 @@
 #include <sys/signalfd.h>
 #include <sys/stat.h>
 
+#include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <thread>
 
+#include "core/exposure_bracket.hpp"
 #include "core/libcamera_app.hpp"
 #include "core/still_options.hpp"
 
+#include "image/exposure_fusion.hpp"
+#include "image/raw_stack.hpp"
+#include "image/saver.hpp"
+
 using namespace std::placeholders;
 using libcamera::Stream;
 
@@ -26,28 +38,6 @@ public:
 	StillOptions *GetOptions() const { return static_cast<StillOptions *>(options_.get()); }
 };
 
-// In jpeg.cpp:
-void jpeg_save(std::vector<void *> const &mem, int w, int h, int stride, libcamera::PixelFormat const &pixel_format,
-			   libcamera::ControlList const &metadata, std::string const &filename, std::string const &cam_name,
-			   StillOptions const *options);
-
-// In yuv.cpp:
-void yuv_save(std::vector<void *> const &mem, int w, int h, int stride, libcamera::PixelFormat const &pixel_format,
-			  std::string const &filename, StillOptions const *options);
-
-// In dng.cpp:
-void dng_save(std::vector<void *> const &mem, int w, int h, int stride, libcamera::PixelFormat const &pixel_format,
-			  libcamera::ControlList const &metadata, std::string const &filename, std::string const &cam_name,
-			  StillOptions const *options);
-
-// In png.cpp:
-void png_save(std::vector<void *> const &mem, int w, int h, int stride, libcamera::PixelFormat const &pixel_format,
-			  std::string const &filename, StillOptions const *options);
-
-// In bmp.cpp:
-void bmp_save(std::vector<void *> const &mem, int w, int h, int stride, libcamera::PixelFormat const &pixel_format,
-			  std::string const &filename, StillOptions const *options);
-
 static std::string generate_filename(StillOptions const *options)
 {
 	char filename[128];
@@ -93,34 +83,226 @@ static void save_image(LibcameraStillApp &app, CompletedRequest &payload, Stream
 	app.StreamDimensions(stream, &w, &h, &stride);
 	libcamera::PixelFormat const &pixel_format = stream->configuration().pixelFormat;
 	std::vector<void *> mem = app.Mmap(payload.buffers[stream]);
-	if (stream == app.RawStream())
-		dng_save(mem, w, h, stride, pixel_format, payload.metadata, filename, app.CameraId(), options);
-	else if (options->encoding == "jpg")
-		jpeg_save(mem, w, h, stride, pixel_format, payload.metadata, filename, app.CameraId(), options);
-	else if (options->encoding == "png")
-		png_save(mem, w, h, stride, pixel_format, filename, options);
-	else if (options->encoding == "bmp")
-		bmp_save(mem, w, h, stride, pixel_format, filename, options);
-	else
-		yuv_save(mem, w, h, stride, pixel_format, filename, options);
+	std::string encoding = stream == app.RawStream() ? "dng" : options->encoding;
+	ImageSaver saver = find_image_saver(pixel_format, encoding);
+	saver(mem, w, h, stride, pixel_format, payload.metadata, filename, app.CameraId(), options);
 	if (options->verbose)
 		std::cout << "Saved image " << w << " x " << h << " to file " << filename << std::endl;
 }
 
+static void save_images(LibcameraStillApp &app, CompletedRequest &payload, std::string const &filename)
+{
+	save_image(app, payload, app.StillStream(), filename);
+	if (app.GetOptions()->raw)
+	{
+		std::string raw_filename = filename.substr(0, filename.rfind('.')) + ".dng";
+		save_image(app, payload, app.RawStream(), raw_filename);
+	}
+}
+
 static void save_images(LibcameraStillApp &app, CompletedRequest &payload)
+{
+	StillOptions *options = app.GetOptions();
+	std::string filename = generate_filename(options);
+	save_images(app, payload, filename);
+	update_latest_link(filename, options);
+	options->framestart++;
+}
+
+// The mean of a frame's black levels, in 16-bit units.
+static unsigned int get_black_level(libcamera::ControlList const &metadata)
+{
+	unsigned int black_level = 4096; // the same default that dng_save uses
+	if (metadata.contains(libcamera::controls::SensorBlackLevels))
+	{
+		libcamera::Span<const int32_t> levels = metadata.get(libcamera::controls::SensorBlackLevels);
+		if (levels.size())
+		{
+			int64_t total = 0;
+			for (int32_t level : levels)
+				total += level;
+			black_level = total / levels.size();
+		}
+	}
+	return black_level;
+}
+
+// In stack mode, the raw frames have been summed into a RawStack. We save the final
+// frame's processed image as usual, and the stacked raw image as the DNG.
+
+static void save_stack(LibcameraStillApp &app, CompletedRequest &payload, RawStack const &stack)
 {
 	StillOptions *options = app.GetOptions();
 	std::string filename = generate_filename(options);
 	save_image(app, payload, app.StillStream(), filename);
+
+	bool sum = options->stack_mode == "sum";
+	libcamera::ControlList metadata = payload.metadata;
+	unsigned int black_level = get_black_level(metadata);
+	// Summed frames look like one much longer exposure, so record it that way.
+	if (sum && metadata.contains(libcamera::controls::ExposureTime))
+		metadata.set(libcamera::controls::ExposureTime,
+					 metadata.get(libcamera::controls::ExposureTime) * (int32_t)stack.Count());
+
+	int w, h, stride;
+	app.StreamDimensions(app.RawStream(), &w, &h, &stride);
+	std::vector<uint16_t> image(w * h);
+	stack.Result(&image[0], sum, black_level);
+	std::vector<void *> mem = { &image[0] };
+	std::string raw_filename = filename.substr(0, filename.rfind('.')) + ".dng";
+	ImageSaver saver = find_image_saver(stack.OutputFormat(), "dng");
+	saver(mem, w, h, w * sizeof(uint16_t), stack.OutputFormat(), metadata, raw_filename, app.CameraId(), options);
+	if (options->verbose)
+		std::cout << "Saved stack of " << stack.Count() << " raw images to file " << raw_filename << std::endl;
+
 	update_latest_link(filename, options);
+	options->framestart++;
+}
+
+// In bracket mode we have one frame for each of the bracket's exposures. The processed
+// images are fused and saved with the metadata of the one nearest the metered exposure.
+// The raw images are merged into a DNG with the brightness of the shortest exposure.
+
+static void save_bracket(LibcameraStillApp &app, std::vector<CompletedRequest> &frames)
+{
+	StillOptions *options = app.GetOptions();
+	std::string filename = generate_filename(options);
+	auto fusion_start = std::chrono::high_resolution_clock::now();
+
+	std::vector<float> const &bracket_ev = options->bracket_ev;
+	unsigned int reference = 0;
+	for (unsigned int i = 1; i < frames.size(); i++)
+	{
+		if (std::abs(bracket_ev[i]) < std::abs(bracket_ev[reference]))
+			reference = i;
+	}
+	int w, h, stride;
+	Stream *stream = app.StillStream(&w, &h, &stride);
+	libcamera::PixelFormat const &pixel_format = stream->configuration().pixelFormat;
+	if (pixel_format != libcamera::formats::YUV420)
+		throw std::runtime_error("bracketed frames must be YUV420");
+	std::vector<uint8_t const *> images;
+	for (CompletedRequest &frame : frames)
+		images.push_back((uint8_t *)app.Mmap(frame.buffers[stream])[0]);
+	std::vector<uint8_t> fused(stride * h * 3 / 2);
+	fuse_yuv420(images, w, h, stride, &fused[0]);
+	std::vector<void *> mem = { &fused[0] };
+	ImageSaver saver = find_image_saver(pixel_format, options->encoding);
+	saver(mem, w, h, stride, pixel_format, frames[reference].metadata, filename, app.CameraId(), options);
+
 	if (options->raw)
 	{
-		filename = filename.substr(0, filename.rfind('.')) + ".dng";
-		save_image(app, payload, app.RawStream(), filename);
+		Stream *raw_stream = app.RawStream(&w, &h, &stride);
+		libcamera::PixelFormat const &raw_format = raw_stream->configuration().pixelFormat;
+		std::vector<float> exposures;
+		images.clear();
+		for (CompletedRequest &frame : frames)
+		{
+			images.push_back((uint8_t *)app.Mmap(frame.buffers[raw_stream])[0]);
+			exposures.push_back(frame.metadata.get(libcamera::controls::ExposureTime) *
+								frame.metadata.get(libcamera::controls::AnalogueGain));
+		}
+		unsigned int shortest = std::min_element(exposures.begin(), exposures.end()) - exposures.begin();
+		std::vector<float> ratios;
+		for (float exposure : exposures)
+			ratios.push_back(exposure / exposures[shortest]);
+		std::vector<uint16_t> merged(w * h);
+		merge_raw(images, ratios, raw_format, w, h, stride, get_black_level(frames[shortest].metadata), &merged[0]);
+		unsigned int bits;
+		libcamera::PixelFormat const &merged_format = unpacked_bayer_format(raw_format, &bits);
+		mem = { &merged[0] };
+		std::string raw_filename = filename.substr(0, filename.rfind('.')) + ".dng";
+		saver = find_image_saver(merged_format, "dng");
+		saver(mem, w, h, w * sizeof(uint16_t), merged_format, frames[shortest].metadata, raw_filename, app.CameraId(),
+			  options);
 	}
+
+	std::chrono::duration<double> fusion_time = std::chrono::high_resolution_clock::now() - fusion_start;
+	if (options->verbose)
+		std::cout << "Fused and saved " << frames.size() << " bracketed images in " << fusion_time.count() * 1000
+				  << "ms" << std::endl;
+	update_latest_link(filename, options);
 	options->framestart++;
 }
 
+// In burst mode, frames are handed to a pool of threads that encode and save them
+// in parallel. Each buffer is returned to the camera as soon as its image has been
+// written, so the capture keeps running at sensor rate while there are free buffers.
+
+class BurstSaver
+{
+public:
+	BurstSaver(LibcameraStillApp &app) : app_(app), abort_(false), busy_(0)
+	{
+		unsigned int num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+		for (unsigned int i = 0; i < num_threads; i++)
+			threads_.emplace_back(&BurstSaver::saveThread, this);
+	}
+	~BurstSaver()
+	{
+		Drain();
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			abort_ = true;
+			cond_var_.notify_all();
+		}
+		for (auto &t : threads_)
+			t.join();
+	}
+	void Save(CompletedRequest &payload, std::string const &filename)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		queue_.push({ std::move(payload), filename });
+		cond_var_.notify_one();
+	}
+	// Wait until every frame we were given has been saved.
+	void Drain()
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		done_cond_var_.wait(lock, [this] { return queue_.empty() && busy_ == 0; });
+	}
+
+private:
+	struct SaveItem
+	{
+		CompletedRequest payload;
+		std::string filename;
+	};
+	void saveThread()
+	{
+		while (true)
+		{
+			SaveItem item;
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				cond_var_.wait(lock, [this] { return abort_ || !queue_.empty(); });
+				if (queue_.empty())
+					return;
+				item = std::move(queue_.front());
+				queue_.pop();
+				busy_++;
+			}
+			save_images(app_, item.payload, item.filename);
+			// This does nothing once the burst is complete and the camera has stopped.
+			app_.QueueRequest(item.payload);
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				busy_--;
+				done_cond_var_.notify_all();
+			}
+		}
+	}
+
+	LibcameraStillApp &app_;
+	std::vector<std::thread> threads_;
+	std::queue<SaveItem> queue_;
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	std::condition_variable done_cond_var_;
+	bool abort_;
+	unsigned int busy_;
+};
+
 // Some keypress/signal handling.
 
 static int signal_received;
@@ -157,16 +339,20 @@ static int get_key_or_signal(StillOptions const *options, pollfd p[1])
 
 static void event_loop(LibcameraStillApp &app)
 {
-	StillOptions const *options = app.GetOptions();
+	// Don't hold all the frames of a long burst in camera buffers at once (they are large!).
+	static constexpr unsigned int MAX_BURST_BUFFERS = 8;
+	StillOptions *options = app.GetOptions();
 	bool output = !options->output.empty() || options->datetime || options->timestamp; // output requested?
 	bool keypress = options->keypress || options->signal; // "signal" mode is much like "keypress" mode
+	// All the encodings can be saved from the YUV420 still stream, the RGB ones being
+	// converted as they are written.
 	unsigned int still_flags = LibcameraApp::FLAG_STILL_NONE;
-	if (options->encoding == "rgb" || options->encoding == "png")
-		still_flags |= LibcameraApp::FLAG_STILL_BGR;
-	else if (options->encoding == "bmp")
-		still_flags |= LibcameraApp::FLAG_STILL_RGB;
-	if (options->raw)
+	if (options->raw || options->stack)
 		still_flags |= LibcameraApp::FLAG_STILL_RAW;
+	unsigned int still_buffers = std::max(options->burst, options->stack);
+	if (!options->bracket_ev.empty())
+		still_buffers = options->bracket_ev.size() + 2; // the frames we keep, and some for the camera to fill
+	still_buffers = std::min(still_buffers, MAX_BURST_BUFFERS);
 
 	app.OpenCamera();
 	app.ConfigureViewfinder();
@@ -174,6 +360,17 @@ static void event_loop(LibcameraStillApp &app)
 	app.SetPreviewDoneCallback(std::bind(&LibcameraApp::QueueRequest, &app, _1));
 	auto start_time = std::chrono::high_resolution_clock::now();
 	auto timelapse_time = start_time;
+	std::unique_ptr<BurstSaver> burst_saver;
+	unsigned int burst_count = 0;
+	uint64_t burst_start_ns = 0, burst_end_ns = 0;
+	std::string burst_filename;
+	std::unique_ptr<RawStack> raw_stack;
+	int raw_stride = 0;
+	// The exposure that the AGC has settled on in the viewfinder is the centre of any bracket.
+	ExposureBracket::Exposure metered = { 10000, 1.0 };
+	std::unique_ptr<ExposureBracket> bracket;
+	std::map<int, CompletedRequest> bracket_frames;
+	unsigned int bracket_count = 0;
 
 	// Monitoring for keypresses and signals.
 	signal(SIGUSR1, default_signal_handler);
@@ -217,13 +414,27 @@ static void event_loop(LibcameraStillApp &app)
 					timelapse_time = std::chrono::high_resolution_clock::now();
 					app.StopCamera();
 					app.Teardown();
-					app.ConfigureStill(still_flags);
+					app.ConfigureStill(still_flags, still_buffers);
+					if (!options->bracket_ev.empty())
+					{
+						std::vector<ExposureBracket::Exposure> exposures;
+						for (float ev : options->bracket_ev)
+							exposures.push_back({ (int32_t)(metered.exposure_time * std::exp2(ev)),
+												  metered.analogue_gain });
+						bracket = std::make_unique<ExposureBracket>(exposures, app.CameraControls());
+						app.SetRequestControlsCallback(std::bind(&ExposureBracket::NextControls, bracket.get(), _1));
+					}
 					app.StartCamera();
 				}
 			}
 			else
 			{
 				CompletedRequest &completed_request = std::get<CompletedRequest>(msg.payload);
+				libcamera::ControlList const &metadata = completed_request.metadata;
+				if (metadata.contains(libcamera::controls::ExposureTime))
+					metered.exposure_time = metadata.get(libcamera::controls::ExposureTime);
+				if (metadata.contains(libcamera::controls::AnalogueGain))
+					metered.analogue_gain = metadata.get(libcamera::controls::AnalogueGain);
 				app.ShowPreview(completed_request, app.ViewfinderStream());
 			}
 		}
@@ -231,9 +442,101 @@ static void event_loop(LibcameraStillApp &app)
 		// otherwise quit.
 		else if (app.StillStream())
 		{
-			app.StopCamera();
-			std::cout << "Still capture image received" << std::endl;
-			save_images(app, std::get<CompletedRequest>(msg.payload));
+			if (options->burst)
+			{
+				// Hand each frame to the burst saver until we have as many as we want.
+				CompletedRequest &payload = std::get<CompletedRequest>(msg.payload);
+				uint64_t timestamp_ns = payload.buffers[app.StillStream()]->metadata().timestamp;
+				if (burst_count == 0)
+					burst_start_ns = timestamp_ns;
+				burst_end_ns = timestamp_ns;
+				if (!burst_saver)
+					burst_saver = std::make_unique<BurstSaver>(app);
+				burst_filename = generate_filename(options);
+				options->framestart++;
+				burst_saver->Save(payload, burst_filename);
+				if (++burst_count < options->burst)
+					continue;
+
+				app.StopCamera();
+				auto drain_start = std::chrono::high_resolution_clock::now();
+				burst_saver->Drain();
+				std::chrono::duration<double> drain_time = std::chrono::high_resolution_clock::now() - drain_start;
+				double fps = burst_count > 1 ? (burst_count - 1) * 1e9 / (burst_end_ns - burst_start_ns) : 0;
+				std::cout << "Burst of " << burst_count << " frames captured at " << fps << " fps, encode drain time "
+						  << drain_time.count() * 1000 << "ms" << std::endl;
+				update_latest_link(burst_filename, options);
+				burst_count = 0;
+			}
+			else if (bracket)
+			{
+				// Keep the first frame we get with each of the bracket's exposures, and give
+				// any others straight back to the camera.
+				static constexpr unsigned int MAX_BRACKET_FRAMES = 30;
+				CompletedRequest &payload = std::get<CompletedRequest>(msg.payload);
+				uint64_t timestamp_ns = payload.buffers[app.StillStream()]->metadata().timestamp;
+				if (bracket_count++ == 0)
+					burst_start_ns = timestamp_ns;
+				int index = bracket->Match(payload.metadata);
+				if (index < 0)
+				{
+					if (bracket_count >= MAX_BRACKET_FRAMES)
+						throw std::runtime_error("failed to capture all the bracketed exposures");
+					app.QueueRequest(payload);
+					continue;
+				}
+				bracket_frames[index] = std::move(payload);
+				if (bracket_frames.size() < bracket->Exposures().size())
+					continue;
+
+				app.StopCamera();
+				app.SetRequestControlsCallback(nullptr);
+				std::cout << "Bracket of " << bracket_frames.size() << " exposures captured in "
+						  << (timestamp_ns - burst_start_ns) / 1000000 << "ms (" << bracket_count << " frames)"
+						  << std::endl;
+				std::vector<CompletedRequest> frames;
+				for (auto &frame : bracket_frames)
+					frames.push_back(std::move(frame.second));
+				save_bracket(app, frames);
+				bracket_frames.clear();
+				bracket_count = 0;
+				bracket.reset();
+			}
+			else if (options->stack)
+			{
+				// Add each raw frame to the stack and give the buffers straight back to the
+				// camera, so that the frames keep arriving at sensor rate.
+				CompletedRequest &payload = std::get<CompletedRequest>(msg.payload);
+				Stream *raw_stream = app.RawStream();
+				uint64_t timestamp_ns = payload.buffers[raw_stream]->metadata().timestamp;
+				if (!raw_stack)
+				{
+					int w, h;
+					app.StreamDimensions(raw_stream, &w, &h, &raw_stride);
+					raw_stack = std::make_unique<RawStack>(raw_stream->configuration().pixelFormat, w, h);
+					burst_start_ns = timestamp_ns;
+				}
+				burst_end_ns = timestamp_ns;
+				raw_stack->Add((uint8_t *)app.Mmap(payload.buffers[raw_stream])[0], raw_stride);
+				if (raw_stack->Count() < options->stack)
+				{
+					app.QueueRequest(payload);
+					continue;
+				}
+
+				app.StopCamera();
+				unsigned int n = raw_stack->Count();
+				double fps = n > 1 ? (n - 1) * 1e9 / (burst_end_ns - burst_start_ns) : 0;
+				std::cout << "Stack of " << n << " raw frames captured at " << fps << " fps" << std::endl;
+				save_stack(app, payload, *raw_stack);
+				raw_stack.reset();
+			}
+			else
+			{
+				app.StopCamera();
+				std::cout << "Still capture image received" << std::endl;
+				save_images(app, std::get<CompletedRequest>(msg.payload));
+			}
 			if (options->timelapse)
 			{
 				app.Teardown();
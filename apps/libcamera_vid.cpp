@@ -12,10 +12,102 @@
 #include <sys/stat.h>
 
 #include "core/libcamera_encoder.hpp"
+#include "image/jpeg.hpp"
+#include "output/dmabuf_server.hpp"
 #include "output/output.hpp"
+#include "output/raw_writer.hpp"
 
 using namespace std::placeholders;
 
+// Snapshots are copied out of the camera buffer at once, so the frame carries on to
+// the encoder as usual, and are then saved as JPEGs on a thread of their own.
+
+class SnapshotSaver
+{
+public:
+	SnapshotSaver(VideoOptions const *options) : options_(options), count_(0), abort_(false)
+	{
+		// Snapshots get the usual thumbnail, only the quality is up to the user.
+		jpeg_params_.verbose = options->verbose;
+		jpeg_params_.quality = options->snapshot_quality;
+		thread_ = std::thread(&SnapshotSaver::saveThread, this);
+	}
+	~SnapshotSaver()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			abort_ = true;
+			cond_var_.notify_one();
+		}
+		thread_.join();
+	}
+	void Save(LibcameraEncoder &app, CompletedRequest &payload, libcamera::Stream *stream)
+	{
+		Snapshot snapshot;
+		app.StreamDimensions(stream, &snapshot.w, &snapshot.h, &snapshot.stride);
+		snapshot.pixel_format = stream->configuration().pixelFormat;
+		uint8_t const *mem = (uint8_t const *)app.Mmap(payload.buffers[stream])[0];
+		snapshot.image.assign(mem, mem + snapshot.stride * snapshot.h * 3 / 2);
+		snapshot.metadata = payload.metadata;
+		snapshot.cam_name = app.CameraId();
+		char filename[256];
+		snprintf(filename, sizeof(filename), options_->snapshot.c_str(), count_++);
+		filename[sizeof(filename) - 1] = 0;
+		snapshot.filename = filename;
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		queue_.push(std::move(snapshot));
+		cond_var_.notify_one();
+	}
+
+private:
+	struct Snapshot
+	{
+		std::vector<uint8_t> image;
+		int w, h, stride;
+		libcamera::PixelFormat pixel_format;
+		libcamera::ControlList metadata;
+		std::string cam_name;
+		std::string filename;
+	};
+	void saveThread()
+	{
+		while (true)
+		{
+			Snapshot snapshot;
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				cond_var_.wait(lock, [this] { return abort_ || !queue_.empty(); });
+				if (queue_.empty())
+					return;
+				snapshot = std::move(queue_.front());
+				queue_.pop();
+			}
+			try
+			{
+				std::vector<void *> mem = { &snapshot.image[0] };
+				jpeg_save(mem, snapshot.w, snapshot.h, snapshot.stride, snapshot.pixel_format, snapshot.metadata,
+						  snapshot.filename, snapshot.cam_name, jpeg_params_);
+				std::cout << "Snapshot saved to " << snapshot.filename << std::endl;
+			}
+			catch (std::exception const &e)
+			{
+				// Failing to save a snapshot shouldn't spoil the recording.
+				std::cerr << "ERROR: snapshot not saved: " << e.what() << std::endl;
+			}
+		}
+	}
+
+	VideoOptions const *options_;
+	JpegParams jpeg_params_;
+	unsigned int count_;
+	std::queue<Snapshot> queue_;
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	bool abort_;
+	std::thread thread_;
+};
+
 // Some keypress/signal handling.
 
 static int signal_received;
@@ -45,6 +137,9 @@ static int get_key_or_signal(VideoOptions const *options, pollfd p[1])
 			key = '\n';
 		else if (signal_received == SIGUSR2)
 			key = 'x';
+		else if (signal_received == SIGRTMIN)
+			key = 's';
+		signal_received = 0;
 	}
 	return key;
 }
@@ -54,20 +149,48 @@ static int get_key_or_signal(VideoOptions const *options, pollfd p[1])
 static void event_loop(LibcameraEncoder &app)
 {
 	VideoOptions const *options = app.GetOptions();
-	std::unique_ptr<Output> output = std::unique_ptr<Output>(Output::Create(options));
-	app.SetEncodeBufferDoneCallback(std::bind(&LibcameraEncoder::ShowPreview, &app, _1, _2));
-	app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, output.get(), _1, _2, _3, _4));
-	app.StartEncoder();
+	// Sharing the camera buffers themselves with other processes takes the place of the
+	// encoder and output altogether.
+	bool share_dmabufs = options->output.compare(0, 9, "dmabuf://") == 0;
+	std::unique_ptr<Output> output;
+	if (!share_dmabufs)
+	{
+		output = std::unique_ptr<Output>(Output::Create(options));
+		app.SetEncodeBufferDoneCallback(std::bind(&LibcameraEncoder::ShowPreview, &app, _1, _2));
+		app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, output.get(), _1, _2, _3, _4));
+		app.StartEncoder();
+	}
 
 	app.OpenCamera();
 	app.SetPreviewDoneCallback(std::bind(&LibcameraEncoder::QueueRequest, &app, _1));
-	app.ConfigureVideo();
+	std::unique_ptr<SnapshotSaver> snapshot_saver;
+	if (!options->snapshot.empty())
+		snapshot_saver = std::make_unique<SnapshotSaver>(options);
+	unsigned int video_flags = LibcameraEncoder::FLAG_VIDEO_NONE;
+	if (snapshot_saver && options->snapshot_width)
+		video_flags |= LibcameraEncoder::FLAG_VIDEO_SNAPSHOT;
+	if (!options->raw_output.empty())
+		video_flags |= LibcameraEncoder::FLAG_VIDEO_RAW;
+	app.ConfigureVideo(video_flags, libcamera::Size(options->snapshot_width, options->snapshot_height));
+	int w, h, stride;
+	libcamera::Stream *video_stream = app.VideoStream(&w, &h, &stride);
+	std::unique_ptr<DmaBufServer> dmabuf_server;
+	if (share_dmabufs)
+		dmabuf_server = std::make_unique<DmaBufServer>(
+			options, w, h, stride, video_stream->configuration().pixelFormat.fourcc(),
+			std::bind(&LibcameraEncoder::ShowPreview, &app, _1, video_stream));
+	else
+		output->SetVideoFormat(w, h, stride);
+	std::unique_ptr<RawWriter> raw_writer;
+	if (!options->raw_output.empty())
+		raw_writer = std::make_unique<RawWriter>(options, app.RawStream()->configuration(), app.CameraId());
 	app.StartCamera();
 	auto start_time = std::chrono::high_resolution_clock::now();
 
 	// Monitoring for keypresses and signals.
 	signal(SIGUSR1, default_signal_handler);
 	signal(SIGUSR2, default_signal_handler);
+	signal(SIGRTMIN, default_signal_handler);
 	pollfd p[1] = { { STDIN_FILENO, POLLIN } };
 
 	for (unsigned int count = 0; ; count++)
@@ -79,7 +202,12 @@ static void event_loop(LibcameraEncoder &app)
 			throw std::runtime_error("unrecognised message!");
 		int key = get_key_or_signal(options, p);
 		if (key == '\n')
-			output->Signal();
+		{
+			if (output)
+				output->Signal();
+			if (raw_writer)
+				raw_writer->Signal();
+		}
 
 		if (options->verbose)
 			std::cout << "Viewfinder frame " << count << std::endl;
@@ -89,10 +217,24 @@ static void event_loop(LibcameraEncoder &app)
 		{
 			app.StopCamera(); // stop complains if encoder very slow to close
 			app.StopEncoder();
+			raw_writer.reset();
+			dmabuf_server.reset();
 			return;
 		}
 
-		app.EncodeBuffer(std::get<CompletedRequest>(msg.payload), app.VideoStream());
+		CompletedRequest &completed_request = std::get<CompletedRequest>(msg.payload);
+		if ((key == 's' || key == 'S') && snapshot_saver)
+			snapshot_saver->Save(app, completed_request, app.StillStream() ? app.StillStream() : app.VideoStream());
+		if (raw_writer)
+		{
+			libcamera::FrameBuffer *buffer = completed_request.buffers[app.RawStream()];
+			raw_writer->Write(app.Mmap(buffer)[0], completed_request.sequence, buffer->metadata().timestamp / 1000,
+							  completed_request.metadata);
+		}
+		if (dmabuf_server)
+			dmabuf_server->Send(completed_request, completed_request.buffers[video_stream]);
+		else
+			app.EncodeBuffer(completed_request, app.VideoStream());
 	}
 }
 
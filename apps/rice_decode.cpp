@@ -0,0 +1,133 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * rice_decode.cpp - check and decode the lossless raw streams that libcamera-raw makes with "--codec rice".
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "core/parallel.hpp"
+#include "encoder/rice_codec.hpp"
+
+static void read_bytes(FILE *fp, void *buf, size_t size, char const *what)
+{
+	if (fread(buf, size, 1, fp) != 1)
+		throw std::runtime_error(std::string("truncated ") + what);
+}
+
+// Decode one frame to packed rows, exactly as libcamera-raw would have written them
+// without compression (apart from the row padding, which is zeroed).
+static void decode_frame(RiceFrameHeader const &header, std::vector<RiceBand> const &table,
+						 std::vector<uint8_t> const &data, std::vector<uint8_t> &frame)
+{
+	if (header.band_rows == 0 || header.stride < rice_row_bytes(header.width, header.bits) ||
+		(header.height + header.band_rows - 1) / header.band_rows != header.num_bands)
+		throw std::runtime_error("bad frame header");
+	std::vector<size_t> offsets(header.num_bands + 1, 0);
+	for (unsigned int b = 0; b < header.num_bands; b++)
+		offsets[b + 1] = offsets[b] + table[b].size;
+	if (offsets.back() != data.size())
+		throw std::runtime_error("band sizes do not match the frame size");
+
+	frame.assign(header.stride * header.height, 0);
+	// Each band records its own error, so the threads never share one.
+	std::vector<std::string> errors(header.num_bands);
+	parallel_for(header.num_bands, [&](unsigned int begin, unsigned int end) {
+		for (unsigned int b = begin; b < end; b++)
+		{
+			try
+			{
+				unsigned int y = b * header.band_rows, rows = std::min(header.band_rows, header.height - y);
+				uint8_t *dest = &frame[y * header.stride];
+				rice_decompress_band(&data[offsets[b]], table[b].size, header.width, rows, header.bits, dest,
+									 header.stride);
+				if (rice_crc(dest, header.width, rows, header.stride, header.bits) != table[b].crc)
+					throw std::runtime_error("crc mismatch in band " + std::to_string(b));
+			}
+			catch (std::exception const &e)
+			{
+				errors[b] = e.what();
+			}
+		}
+	});
+	for (std::string const &error : errors)
+	{
+		if (!error.empty())
+			throw std::runtime_error(error);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		if (argc < 2 || argc > 3)
+		{
+			std::cerr << "Usage: rice_decode <input> [<output>]" << std::endl;
+			std::cerr << "Lists the frames in the input, checking that every one decodes exactly, and writes"
+					  << std::endl;
+			std::cerr << "them as uncompressed packed raw frames to the output, if given." << std::endl;
+			return -1;
+		}
+		FILE *in = fopen(argv[1], "r");
+		if (!in)
+			throw std::runtime_error("failed to open " + std::string(argv[1]));
+		FILE *out = argc > 2 ? fopen(argv[2], "w") : nullptr;
+		if (argc > 2 && !out)
+			throw std::runtime_error("failed to open " + std::string(argv[2]));
+
+		unsigned int frames = 0;
+		uint64_t raw_bytes = 0, encoded_bytes = 0;
+		std::vector<RiceBand> table;
+		std::vector<uint8_t> data, frame;
+		for (long offset = ftell(in);; offset = ftell(in))
+		{
+			RiceFrameHeader header;
+			size_t n = fread(&header, 1, sizeof(header), in);
+			if (n == 0)
+				break;
+			if (n != sizeof(header) || memcmp(header.magic, RICE_MAGIC, sizeof(header.magic)))
+				throw std::runtime_error("no frame header at offset " + std::to_string(offset));
+			if (header.header_size != sizeof(header) + header.num_bands * sizeof(RiceBand))
+				throw std::runtime_error("bad frame header at offset " + std::to_string(offset));
+			table.resize(header.num_bands);
+			read_bytes(in, &table[0], header.num_bands * sizeof(RiceBand), "band table");
+			data.resize(header.data_size);
+			read_bytes(in, &data[0], header.data_size, "frame data");
+
+			decode_frame(header, table, data, frame);
+			if (out && fwrite(&frame[0], frame.size(), 1, out) != 1)
+				throw std::runtime_error("failed to write output");
+
+			uint64_t frame_raw_bytes = rice_row_bytes(header.width, header.bits) * header.height;
+			char fourcc[5] = {};
+			memcpy(fourcc, &header.fourcc, 4);
+			std::cout << "frame " << header.frame << " at offset " << offset << ": " << header.width << "x"
+					  << header.height << " " << fourcc << " timestamp " << header.timestamp_us << "us, "
+					  << header.header_size + header.data_size << " bytes ("
+					  << (header.header_size + header.data_size) * 100 / frame_raw_bytes << "%)" << std::endl;
+			frames++;
+			raw_bytes += frame_raw_bytes;
+			encoded_bytes += header.header_size + header.data_size;
+		}
+		if (out)
+			fclose(out);
+		fclose(in);
+		if (!frames)
+			throw std::runtime_error("no frames found");
+		std::cout << frames << " frames decoded and verified, compressed to " << encoded_bytes * 100 / raw_bytes
+				  << "%" << std::endl;
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "ERROR: *** " << e.what() << " ***" << std::endl;
+		return -1;
+	}
+	return 0;
+}
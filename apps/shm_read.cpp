@@ -0,0 +1,95 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * shm_read.cpp - read the frames that libcamera-vid publishes with "-o shm://<socket>".
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "output/shm_ring.hpp"
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		if (argc < 2 || argc > 4)
+		{
+			std::cerr << "Usage: shm_read <socket> [<output> [<frames>]]" << std::endl;
+			std::cerr << "Reads frames from a libcamera-vid shm:// output, starting at the next keyframe, until"
+					  << std::endl;
+			std::cerr << "it stops (or for the given number of frames), and writes them to the output (- for"
+					  << std::endl;
+			std::cerr << "stdout), if given. Frames overwritten before they could be read are counted as missed."
+					  << std::endl;
+			return -1;
+		}
+		ShmRingReader reader(argv[1]);
+		FILE *out = nullptr;
+		if (argc > 2)
+			out = strcmp(argv[2], "-") == 0 ? stdout : fopen(argv[2], "w");
+		if (argc > 2 && !out)
+			throw std::runtime_error("failed to open " + std::string(argv[2]));
+		unsigned int max_frames = argc > 3 ? strtoul(argv[3], nullptr, 0) : 0;
+
+		ShmRingHeader const &header = reader.Header();
+		std::cerr << "shm_read: " << header.codec << " frames in a " << header.data_size << " byte ring";
+		if (header.width)
+			std::cerr << ", " << header.width << "x" << header.height << " stride " << header.stride;
+		std::cerr << std::endl;
+
+		unsigned int frames = 0, missed = 0;
+		uint64_t bytes = 0;
+		bool started = false;
+		std::vector<uint8_t> buffer;
+		for (uint64_t last = reader.Newest(); !max_frames || frames < max_frames;)
+		{
+			if (!reader.Wait(last, 5000))
+				break;
+			uint64_t newest = reader.Newest();
+			for (uint64_t sequence = last + 1; sequence <= newest && (!max_frames || frames < max_frames);
+				 sequence++)
+			{
+				ShmRingReader::Frame frame;
+				if (!reader.Get(sequence, frame))
+				{
+					missed += started;
+					continue;
+				}
+				if (!started && !(frame.flags & ShmRingHeader::FLAG_KEYFRAME))
+					continue;
+				// We copy the frame out only because the output might be slow.
+				buffer.assign(frame.data, frame.data + frame.size);
+				if (!reader.Valid(frame))
+				{
+					missed += started;
+					continue;
+				}
+				started = true;
+				if (out && fwrite(buffer.data(), buffer.size(), 1, out) != 1)
+					throw std::runtime_error("failed to write output");
+				frames++;
+				bytes += frame.size;
+			}
+			last = newest;
+		}
+		if (out && out != stdout)
+			fclose(out);
+		std::cerr << "shm_read: " << frames << " frames (" << bytes << " bytes) read, " << missed << " missed"
+				  << std::endl;
+		if (!frames)
+			throw std::runtime_error("no frames read");
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "ERROR: *** " << e.what() << " ***" << std::endl;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,97 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * file_output_bench.cpp - compare writing video files with stdio and with io_uring.
+ */
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "output/uring_file.hpp"
+
+using Clock = std::chrono::high_resolution_clock;
+
+// Write frames of the given size to a file in the given way, reporting the throughput
+// (including closing, and syncing, the file) and how long each frame's write call took.
+// The file is removed first so that no run pays for truncating the previous one's.
+template <typename Open, typename Write, typename Close>
+static void run(char const *what, std::string const &filename, unsigned int frame_size, unsigned int frames,
+				std::vector<uint8_t> const &data, Open open, Write write, Close close)
+{
+	std::vector<double> latency;
+	remove(filename.c_str());
+	auto start = Clock::now();
+	open();
+	for (unsigned int i = 0; i < frames; i++)
+	{
+		auto t = Clock::now();
+		write(&data[(i * 4096) % (data.size() - frame_size)], frame_size);
+		latency.push_back(std::chrono::duration<double, std::milli>(Clock::now() - t).count());
+	}
+	close();
+	double total = std::chrono::duration<double>(Clock::now() - start).count();
+	std::sort(latency.begin(), latency.end());
+	double mean = 0;
+	for (double l : latency)
+		mean += l / frames;
+	std::cout << "    " << what << ": " << (double)frame_size * frames / total / 1e6 << " MB/s, write latency mean "
+			  << mean << "ms, 99% " << latency[frames * 99 / 100] << "ms, max " << latency.back() << "ms" << std::endl;
+}
+
+static void bench(unsigned int frame_size, unsigned int frames, std::string const &filename)
+{
+	std::vector<uint8_t> data(frame_size + (64 << 10));
+	std::mt19937 rng(0);
+	for (auto &b : data)
+		b = rng();
+	std::cout << frames << " frames of " << frame_size << " bytes:" << std::endl;
+
+	// This is what FileOutput normally does, one fwrite per frame.
+	FILE *fp = nullptr;
+	run("stdio", filename, frame_size, frames, data, [&]() { fp = fopen(filename.c_str(), "w"); },
+		[&](void const *mem, size_t size) { fwrite(mem, size, 1, fp); },
+		[&]() {
+			fflush(fp);
+			fsync(fileno(fp));
+			fclose(fp);
+		});
+
+	if (!UringFile::Available())
+	{
+		std::cout << "    io_uring not available" << std::endl;
+		return;
+	}
+	for (bool direct : { false, true })
+	{
+		UringFile file;
+		run(direct ? "io_uring, direct I/O" : "io_uring", filename, frame_size, frames, data,
+			[&]() { file.Open(filename, direct); }, [&](void const *mem, size_t size) { file.Write(mem, size); },
+			[&]() { file.Close(); });
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		unsigned int frames = argc > 1 ? atoi(argv[1]) : 300;
+		std::string filename = argc > 2 ? argv[2] : "/tmp/file_output_bench.bin";
+		bench(25000, frames, filename); // H.264 at about 6Mbps and 30fps
+		bench(250000, frames, filename); // MJPEG, or H.264 at very high bitrates
+		bench(1920 * 1080 * 3 / 2, frames, filename); // uncompressed 1080p YUV420
+		remove(filename.c_str());
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "ERROR: *** " << e.what() << " ***" << std::endl;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,130 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * png_save_bench.cpp - time saving PNG files, and check that they decode to the right pixels.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <libcamera/formats.h>
+
+#include <png.h>
+
+#include "core/still_options.hpp"
+#include "image/png.hpp"
+#include "image/yuv2rgb.hpp"
+
+// Run fn a few times, returning the average time per frame in ms.
+template <typename F>
+static double time_it(F fn, unsigned int iterations)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	for (unsigned int i = 0; i < iterations; i++)
+		fn();
+	std::chrono::duration<double> t = std::chrono::high_resolution_clock::now() - start;
+	return t.count() * 1000 / iterations;
+}
+
+// A YUV420 frame of smooth gradients with a little noise, so that the PNG filter has
+// something to do and every row differs from the one above.
+static std::vector<uint8_t> make_yuv420(unsigned int w, unsigned int h, unsigned int stride)
+{
+	std::mt19937 rng(0);
+	std::vector<uint8_t> yuv420(stride * h * 3 / 2);
+	for (unsigned int y = 0; y < h; y++)
+	{
+		for (unsigned int x = 0; x < w; x++)
+			yuv420[y * stride + x] = (x + 2 * y + rng() % 16) & 0xff;
+	}
+	for (unsigned int y = 0; y < h; y++) // the U rows, then the V rows
+	{
+		for (unsigned int x = 0; x < w / 2; x++)
+			yuv420[stride * h + y * stride / 2 + x] = (128 + x - y + rng() % 8) & 0xff;
+	}
+	return yuv420;
+}
+
+// Decode the PNG file with libpng and compare it with the RGB rows the writer was given.
+static void check_png(std::string const &filename, std::vector<void *> const &mem, unsigned int w, unsigned int h,
+					  unsigned int stride, StillOptions const &options)
+{
+	png_image image = {};
+	image.version = PNG_IMAGE_VERSION;
+	if (!png_image_begin_read_from_file(&image, filename.c_str()))
+		throw std::runtime_error("failed to read " + filename + ": " + image.message);
+	image.format = PNG_FORMAT_RGB;
+	std::vector<uint8_t> decoded(PNG_IMAGE_SIZE(image));
+	if (!png_image_finish_read(&image, nullptr, &decoded[0], 0, nullptr))
+		throw std::runtime_error("failed to decode " + filename + ": " + image.message);
+	if (image.width != w || image.height != h)
+		throw std::runtime_error("decoded PNG has the wrong size");
+
+	RgbRowReader reader(mem, w, h, stride, libcamera::formats::YUV420, libcamera::formats::BGR888,
+						options.colour_space);
+	std::vector<uint8_t> buf(w * 3);
+	for (unsigned int y = 0; y < h; y++)
+	{
+		uint8_t const *row = reader.Row(y, &buf[0]);
+		if (!std::equal(row, row + w * 3, &decoded[y * w * 3]))
+			throw std::runtime_error("decoded PNG does not match the image at row " + std::to_string(y));
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		unsigned int iterations = argc > 1 ? atoi(argv[1]) : 10;
+		std::string filename = argc > 2 ? argv[2] : "/tmp/png_save_bench.png";
+		StillOptions options;
+		options.verbose = false;
+		options.colour_space = "jpeg";
+
+		// Bands that start on odd rows are easy to get wrong, so try plenty of them.
+		std::cout << "Checking PNG bands:" << std::endl;
+		for (unsigned int h : { 2, 6, 66, 98, 482, 1002, 3040 })
+		{
+			unsigned int w = 96, stride = 128;
+			std::vector<uint8_t> yuv420 = make_yuv420(w, h, stride);
+			std::vector<void *> mem = { &yuv420[0] };
+			for (unsigned int num_bands : { 1, 2, 3, 4, 5, 8 })
+			{
+				png_save_bands(mem, w, h, stride, libcamera::formats::YUV420, filename, &options, num_bands);
+				check_png(filename, mem, w, h, stride, options);
+			}
+		}
+		std::cout << "    all decoded correctly" << std::endl;
+
+		for (auto size : { std::make_pair(1920u, 1080u), std::make_pair(4056u, 3040u) })
+		{
+			unsigned int w = size.first, h = size.second, stride = (w + 63) & ~63;
+			std::vector<uint8_t> yuv420 = make_yuv420(w, h, stride);
+			std::vector<void *> mem = { &yuv420[0] };
+			std::cout << w << "x" << h << ":" << std::endl;
+			for (unsigned int num_bands : { 1, 0 })
+			{
+				double ms = time_it([&]() {
+					png_save_bands(mem, w, h, stride, libcamera::formats::YUV420, filename, &options, num_bands);
+				}, iterations);
+				std::cout << "    " << (num_bands ? "one band" : "one band per core") << ": " << ms << "ms"
+						  << std::endl;
+			}
+			check_png(filename, mem, w, h, stride, options);
+		}
+		remove(filename.c_str());
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "ERROR: *** " << e.what() << " ***" << std::endl;
+		return -1;
+	}
+	return 0;
+}
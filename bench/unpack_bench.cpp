@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * unpack_bench.cpp - time the raw Bayer unpacking used for DNG files.
+ */
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "image/unpack.hpp"
+
+typedef void (*UnpackRowFn)(uint8_t const *, unsigned int, uint16_t *);
+
+// Run fn over every row of the image a few times, returning the average time per frame in ms.
+template <typename F>
+static double time_it(F fn, unsigned int iterations)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	for (unsigned int i = 0; i < iterations; i++)
+		fn();
+	std::chrono::duration<double> t = std::chrono::high_resolution_clock::now() - start;
+	return t.count() * 1000 / iterations;
+}
+
+static void bench(unsigned int w, unsigned int h, unsigned int bits, unsigned int iterations)
+{
+	unsigned int stride = ((bits == 10 ? w * 5 / 4 : w * 3 / 2) + 31) & ~31;
+	std::vector<uint8_t> src(stride * h);
+	std::mt19937 rng(0);
+	for (auto &b : src)
+		b = rng();
+	std::vector<uint16_t> reference(w * h), dest(w * h);
+	UnpackRowFn scalar = bits == 10 ? unpack_10bit_row_scalar : unpack_12bit_row_scalar;
+	UnpackRowFn simd = bits == 10 ? unpack_10bit_row : unpack_12bit_row;
+
+	double scalar_ms = time_it(
+		[&]() {
+			for (unsigned int y = 0; y < h; y++)
+				scalar(&src[y * stride], w, &reference[y * w]);
+		},
+		iterations);
+	double simd_ms = time_it(
+		[&]() {
+			for (unsigned int y = 0; y < h; y++)
+				simd(&src[y * stride], w, &dest[y * w]);
+		},
+		iterations);
+	bool simd_ok = memcmp(&reference[0], &dest[0], w * h * sizeof(uint16_t)) == 0;
+	std::fill(dest.begin(), dest.end(), 0);
+	double threaded_ms = time_it([&]() { unpack_raw(&src[0], w, h, stride, bits, &dest[0], w); }, iterations);
+	bool threaded_ok = memcmp(&reference[0], &dest[0], w * h * sizeof(uint16_t)) == 0;
+
+	std::cout << w << "x" << h << " " << bits << "-bit: scalar " << scalar_ms << "ms, vector " << simd_ms
+			  << "ms, vector+threads " << threaded_ms << "ms" << std::endl;
+	if (!simd_ok || !threaded_ok)
+		throw std::runtime_error("unpacked output does not match the scalar version");
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		unsigned int iterations = argc > 1 ? atoi(argv[1]) : 10;
+		// The HQ camera's full resolution, plus an odd size to exercise the row tails.
+		bench(4056, 3040, 12, iterations);
+		bench(4056, 3040, 10, iterations);
+		bench(1333, 990, 12, iterations);
+		bench(1333, 990, 10, iterations);
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "ERROR: *** " << e.what() << " ***" << std::endl;
+		return -1;
+	}
+	return 0;
+}
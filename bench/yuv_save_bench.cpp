@@ -0,0 +1,118 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * yuv_save_bench.cpp - time saving raw YUV frames, and the YUYV deinterleaving.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <libcamera/formats.h>
+
+#include "core/still_options.hpp"
+#include "image/saver.hpp"
+#include "image/yuv.hpp"
+
+static void yuv_save(std::vector<void *> const &mem, int w, int h, int stride,
+					 libcamera::PixelFormat const &pixel_format, std::string const &filename, StillOptions const *options)
+{
+	find_image_saver(pixel_format, options->encoding)(mem, w, h, stride, pixel_format, libcamera::ControlList(),
+													  filename, "", options);
+}
+
+// Run fn a few times, returning the average time per frame in ms.
+template <typename F>
+static double time_it(F fn, unsigned int iterations)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	for (unsigned int i = 0; i < iterations; i++)
+		fn();
+	std::chrono::duration<double> t = std::chrono::high_resolution_clock::now() - start;
+	return t.count() * 1000 / iterations;
+}
+
+static void report(char const *what, unsigned int w, unsigned int h, double ms)
+{
+	std::cout << "    " << what << ": " << ms << "ms (" << 1000 / ms << " fps, " << w * h * 1.5 / ms / 1000
+			  << " MB/s of I420 output)" << std::endl;
+}
+
+static void bench(unsigned int w, unsigned int h, std::string const &filename, unsigned int iterations)
+{
+	StillOptions options;
+	options.encoding = "yuv420";
+	std::mt19937 rng(0);
+	std::cout << w << "x" << h << ":" << std::endl;
+
+	// Deinterleaving YUYV on its own.
+	unsigned int yuyv_stride = (w * 2 + 63) & ~63;
+	std::vector<uint8_t> yuyv(yuyv_stride * h);
+	for (auto &b : yuyv)
+		b = rng();
+	std::vector<uint8_t> reference(w * h * 3 / 2), dest(w * h * 3 / 2);
+	auto deinterleave = [&](auto fn, std::vector<uint8_t> &out) {
+		uint8_t *Y = &out[0], *U = Y + w * h, *V = U + w * h / 4;
+		for (unsigned int j = 0; j < h; j++)
+		{
+			bool even = !(j & 1);
+			fn(&yuyv[j * yuyv_stride], w, Y + j * w, even ? U + j / 2 * w / 2 : nullptr,
+			   even ? V + j / 2 * w / 2 : nullptr);
+		}
+	};
+	report("YUYV deinterleave, scalar", w, h,
+		   time_it([&]() { deinterleave(yuyv_deinterleave_row_scalar, reference); }, iterations));
+	report("YUYV deinterleave, vector", w, h,
+		   time_it([&]() { deinterleave(yuyv_deinterleave_row, dest); }, iterations));
+	if (reference != dest)
+		throw std::runtime_error("deinterleaved output does not match the scalar version");
+
+	// Whole frames written to the file. First the old way, one fwrite per row, for comparison.
+	unsigned int stride = (w + 63) & ~63;
+	std::vector<uint8_t> yuv420(stride * h * 3 / 2);
+	for (auto &b : yuv420)
+		b = rng();
+	report("YUV420 saved with fwrite per row", w, h, time_it([&]() {
+			   FILE *fp = fopen(filename.c_str(), "w");
+			   if (!fp)
+				   throw std::runtime_error("failed to open " + filename);
+			   for (unsigned int j = 0; j < h; j++)
+				   fwrite(&yuv420[j * stride], w, 1, fp);
+			   for (unsigned int j = 0; j < h; j++) // all the U rows, then all the V rows
+				   fwrite(&yuv420[stride * h + j * stride / 2], w / 2, 1, fp);
+			   fclose(fp);
+		   }, iterations));
+
+	std::vector<void *> mem = { &yuv420[0] };
+	report("YUV420 padded rows", w, h,
+		   time_it([&]() { yuv_save(mem, w, h, stride, libcamera::formats::YUV420, filename, &options); },
+				   iterations));
+	report("YUV420 unpadded rows", w, h,
+		   time_it([&]() { yuv_save(mem, w, h, w, libcamera::formats::YUV420, filename, &options); }, iterations));
+	mem = { &yuyv[0] };
+	report("YUYV to I420", w, h,
+		   time_it([&]() { yuv_save(mem, w, h, yuyv_stride, libcamera::formats::YUYV, filename, &options); },
+				   iterations));
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		unsigned int iterations = argc > 1 ? atoi(argv[1]) : 10;
+		std::string filename = argc > 2 ? argv[2] : "/tmp/yuv_save_bench.yuv";
+		bench(1920, 1080, filename, iterations);
+		bench(4056, 3040, filename, iterations);
+		remove(filename.c_str());
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "ERROR: *** " << e.what() << " ***" << std::endl;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,102 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * exposure_bracket.hpp - give successive requests their own exposures.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include <libcamera/control_ids.h>
+#include <libcamera/controls.h>
+
+// Asks for a sequence of exposures, one per request, cycling round them until the
+// application has all the frames it wants. The camera applies new exposures a few
+// frames after they are requested, so frames are matched to the bracket by the
+// exposure their metadata reports, not by the order they arrive in.
+class ExposureBracket
+{
+public:
+	struct Exposure
+	{
+		int32_t exposure_time; // in microseconds
+		float analogue_gain;
+	};
+
+	// The camera would only clamp exposures beyond its limits, and then the frames would
+	// never match, so we clamp them ourselves. Several exposures may end up the same.
+	ExposureBracket(std::vector<Exposure> const &exposures, libcamera::ControlInfoMap const &camera_controls)
+		: exposures_(exposures), matched_(exposures.size(), false), next_(0)
+	{
+		auto exposure_limits = camera_controls.find(&libcamera::controls::ExposureTime);
+		auto gain_limits = camera_controls.find(&libcamera::controls::AnalogueGain);
+		for (Exposure &exposure : exposures_)
+		{
+			Exposure requested = exposure;
+			if (exposure_limits != camera_controls.end())
+				exposure.exposure_time = clamp(exposure.exposure_time, exposure_limits->second);
+			if (gain_limits != camera_controls.end())
+				exposure.analogue_gain = clamp(exposure.analogue_gain, gain_limits->second);
+			if (exposure.exposure_time != requested.exposure_time ||
+				exposure.analogue_gain != requested.analogue_gain)
+				std::cerr << "WARNING: bracket exposure " << requested.exposure_time << "us gain "
+						  << requested.analogue_gain << " clamped to " << exposure.exposure_time << "us gain "
+						  << exposure.analogue_gain << std::endl;
+		}
+	}
+
+	// Use as the LibcameraApp's request controls callback.
+	void NextControls(libcamera::ControlList &controls)
+	{
+		Exposure const &exposure = exposures_[next_];
+		controls.set(libcamera::controls::ExposureTime, exposure.exposure_time);
+		controls.set(libcamera::controls::AnalogueGain, exposure.analogue_gain);
+		next_ = (next_ + 1) % exposures_.size();
+	}
+
+	// Return the index of an exposure this frame was taken with that has no frame yet,
+	// and count it as having one, or return -1 if there isn't one (for example because
+	// the frame was captured before the bracket took effect). Sensors can only
+	// approximate the exposures we ask for, so we allow a little slack.
+	int Match(libcamera::ControlList const &metadata)
+	{
+		if (!metadata.contains(libcamera::controls::ExposureTime) ||
+			!metadata.contains(libcamera::controls::AnalogueGain))
+			return -1;
+		int32_t exposure_time = metadata.get(libcamera::controls::ExposureTime);
+		float analogue_gain = metadata.get(libcamera::controls::AnalogueGain);
+		for (unsigned int i = 0; i < exposures_.size(); i++)
+		{
+			Exposure const &exposure = exposures_[i];
+			if (!matched_[i] &&
+				std::abs(exposure_time - exposure.exposure_time) <= std::max(exposure.exposure_time / 20, 50) &&
+				std::abs(analogue_gain - exposure.analogue_gain) <= exposure.analogue_gain / 20)
+			{
+				matched_[i] = true;
+				return i;
+			}
+		}
+		return -1;
+	}
+
+	std::vector<Exposure> const &Exposures() const { return exposures_; }
+
+private:
+	template <typename T>
+	static T clamp(T value, libcamera::ControlInfo const &limits)
+	{
+		T min = limits.min().get<T>(), max = limits.max().get<T>();
+		// Some limits may be left unset.
+		return max > min ? std::clamp(value, min, max) : value;
+	}
+
+	std::vector<Exposure> exposures_;
+	std::vector<bool> matched_;
+	unsigned int next_;
+};
@@ -39,6 +39,11 @@ std::string const &LibcameraApp::CameraId() const
 	return camera_->id();
 }
 
+libcamera::ControlInfoMap const &LibcameraApp::CameraControls() const
+{
+	return camera_->controls();
+}
+
 void LibcameraApp::OpenCamera()
 {
 	// Make a preview window.
@@ -150,7 +155,7 @@ void LibcameraApp::ConfigureViewfinder()
 		std::cout << "Viewfinder setup complete" << std::endl;
 }
 
-void LibcameraApp::ConfigureStill(unsigned int flags)
+void LibcameraApp::ConfigureStill(unsigned int flags, unsigned int buffer_count)
 {
 	if (options_->verbose)
 		std::cout << "Configuring still capture..." << std::endl;
@@ -176,14 +181,19 @@ void LibcameraApp::ConfigureStill(unsigned int flags)
 		configuration_->at(0).bufferCount = 2;
 	else if ((flags & FLAG_STILL_BUFFER_MASK) == FLAG_STILL_TRIPLE_BUFFER)
 		configuration_->at(0).bufferCount = 3;
+	if (buffer_count)
+		configuration_->at(0).bufferCount = buffer_count;
 	if (options_->width)
 		configuration_->at(0).size.width = options_->width;
 	if (options_->height)
 		configuration_->at(0).size.height = options_->height;
-	if ((flags & FLAG_STILL_RAW) && !options_->rawfull)
+	if (flags & FLAG_STILL_RAW)
 	{
-		configuration_->at(1).size.width = configuration_->at(0).size.width;
-		configuration_->at(1).size.height = configuration_->at(0).size.height;
+		if (!options_->rawfull)
+		{
+			configuration_->at(1).size.width = configuration_->at(0).size.width;
+			configuration_->at(1).size.height = configuration_->at(0).size.height;
+		}
 		configuration_->at(1).bufferCount = configuration_->at(0).bufferCount;
 	}
 	configuration_->transform = options_->transform;
@@ -198,16 +208,23 @@ void LibcameraApp::ConfigureStill(unsigned int flags)
 		std::cout << "Still capture setup complete" << std::endl;
 }
 
-void LibcameraApp::ConfigureVideo(unsigned int flags)
+void LibcameraApp::ConfigureVideo(unsigned int flags, Size const &snapshot_size)
 {
 	if (options_->verbose)
 		std::cout << "Configuring video..." << std::endl;
 
-	StreamRoles stream_roles;
+	StreamRoles stream_roles = { StreamRole::VideoRecording };
+	int raw_index = -1, snapshot_index = -1;
 	if (flags & FLAG_VIDEO_RAW)
-		stream_roles = { StreamRole::VideoRecording, StreamRole::Raw };
-	else
-		stream_roles = { StreamRole::VideoRecording };
+	{
+		raw_index = stream_roles.size();
+		stream_roles.push_back(StreamRole::Raw);
+	}
+	if (flags & FLAG_VIDEO_SNAPSHOT)
+	{
+		snapshot_index = stream_roles.size();
+		stream_roles.push_back(StreamRole::StillCapture);
+	}
 	configuration_ = camera_->generateConfiguration(stream_roles);
 	if (!configuration_)
 		throw std::runtime_error("failed to generate video configuration");
@@ -219,14 +236,24 @@ void LibcameraApp::ConfigureVideo(unsigned int flags)
 		configuration_->at(0).size.width = options_->width;
 	if (options_->height)
 		configuration_->at(0).size.height = options_->height;
-	if (flags & FLAG_VIDEO_RAW)
+	if (raw_index >= 0)
 	{
 		if (!options_->rawfull)
 		{
-			configuration_->at(1).size.width = configuration_->at(0).size.width;
-			configuration_->at(1).size.height = configuration_->at(0).size.height;
+			configuration_->at(raw_index).size.width = configuration_->at(0).size.width;
+			configuration_->at(raw_index).size.height = configuration_->at(0).size.height;
 		}
-		configuration_->at(1).bufferCount = configuration_->at(0).bufferCount;
+		configuration_->at(raw_index).bufferCount = configuration_->at(0).bufferCount;
+	}
+	if (snapshot_index >= 0)
+	{
+		// The snapshot stream is filled on every frame, so callers should ask for a modest
+		// size. Without one we keep libcamera's default size for a still capture stream,
+		// which on a Pi is the full sensor resolution.
+		configuration_->at(snapshot_index).pixelFormat = libcamera::formats::YUV420;
+		if (snapshot_size.width && snapshot_size.height)
+			configuration_->at(snapshot_index).size = snapshot_size;
+		configuration_->at(snapshot_index).bufferCount = configuration_->at(0).bufferCount;
 	}
 	configuration_->transform = options_->transform;
 
@@ -234,7 +261,10 @@ void LibcameraApp::ConfigureVideo(unsigned int flags)
 	setupCapture();
 
 	video_stream_ = configuration_->at(0).stream();
-	raw_stream_ = configuration_->at(1).stream();
+	if (raw_index >= 0)
+		raw_stream_ = configuration_->at(raw_index).stream();
+	if (snapshot_index >= 0)
+		still_stream_ = configuration_->at(snapshot_index).stream();
 
 	if (options_->verbose)
 		std::cout << "Video setup complete" << std::endl;
@@ -289,10 +319,11 @@ void LibcameraApp::StartCamera()
 
 	// Framerate is a bit weird. If it was set programmatically, we go with that, but
 	// otherwise it applies only to preview/video modes. For stills capture we set it
-	// as long as possible so that we get whatever the exposure profile wants.
+	// as long as possible so that we get whatever the exposure profile wants. A video
+	// snapshot stream doesn't count, as the video stream sets the pace there.
 	if (!controls_.contains(controls::FrameDurationLimits))
 	{
-		if (still_stream_)
+		if (still_stream_ && !video_stream_)
 			controls_.set(controls::FrameDurationLimits, { INT64_C(100), INT64_C(1000000000) });
 		else if (options_->framerate > 0)
 		{
@@ -334,6 +365,8 @@ void LibcameraApp::StartCamera()
 
 	for (std::unique_ptr<Request> &request : requests_)
 	{
+		if (request_controls_callback_)
+			request_controls_callback_(request->controls());
 		if (camera_->queueRequest(request.get()) < 0)
 			throw std::runtime_error("Failed to queue request");
 	}
@@ -418,6 +451,8 @@ void LibcameraApp::QueueRequest(CompletedRequest const &completed_request)
 	{
 		std::lock_guard<std::mutex> lock(control_mutex_);
 		request->controls() = std::move(controls_);
+		if (request_controls_callback_)
+			request_controls_callback_(request->controls());
 	}
 
 	if (camera_->queueRequest(request) < 0)
@@ -490,6 +525,12 @@ void LibcameraApp::SetControls(ControlList &controls)
 	controls_ = std::move(controls);
 }
 
+void LibcameraApp::SetRequestControlsCallback(RequestControlsCallback request_controls_callback)
+{
+	std::lock_guard<std::mutex> lock(control_mutex_);
+	request_controls_callback_ = request_controls_callback;
+}
+
 void LibcameraApp::StreamDimensions(Stream const *stream, int *w, int *h, int *stride) const
 {
 	StreamConfiguration const &cfg = stream->configuration();
@@ -48,6 +48,7 @@ struct CompletedRequest
 };
 
 typedef std::function<void(CompletedRequest &)> PreviewDoneCallback;
+typedef std::function<void(libcamera::ControlList &)> RequestControlsCallback;
 
 class LibcameraApp
 {
@@ -94,6 +95,7 @@ public:
 
 	static constexpr unsigned int FLAG_VIDEO_NONE = 0;
 	static constexpr unsigned int FLAG_VIDEO_RAW = 1; // request raw image stream
+	static constexpr unsigned int FLAG_VIDEO_SNAPSHOT = 2; // request a second YUV stream, the StillStream
 
 	LibcameraApp(std::unique_ptr<Options> const opts = nullptr);
 	virtual ~LibcameraApp();
@@ -101,12 +103,17 @@ public:
 	Options *GetOptions() const { return options_.get(); }
 
 	std::string const &CameraId() const;
+	// The controls the camera supports, and their limits.
+	libcamera::ControlInfoMap const &CameraControls() const;
 	void OpenCamera();
 	void CloseCamera();
 
 	void ConfigureViewfinder();
-	void ConfigureStill(unsigned int flags = FLAG_STILL_NONE);
-	void ConfigureVideo(unsigned int flags = FLAG_VIDEO_NONE);
+	// A non-zero buffer_count overrides any of the FLAG_STILL_*_BUFFER flags.
+	void ConfigureStill(unsigned int flags = FLAG_STILL_NONE, unsigned int buffer_count = 0);
+	// A snapshot stream has the given size, or by default libcamera's default size for
+	// a still capture stream (the full sensor resolution on a Pi).
+	void ConfigureVideo(unsigned int flags = FLAG_VIDEO_NONE, Size const &snapshot_size = Size());
 
 	void Teardown();
 	void StartCamera();
@@ -127,6 +134,9 @@ public:
 	void ShowPreview(CompletedRequest &completed_request, Stream *stream);
 
 	void SetControls(ControlList &controls);
+	// The callback may add its own controls to every request as it is queued, for
+	// example to give each frame a different exposure.
+	void SetRequestControlsCallback(RequestControlsCallback request_controls_callback);
 	void StreamDimensions(Stream const *stream, int *w, int *h, int *stride) const;
 
 protected:
@@ -217,6 +227,7 @@ private:
 	// For setting camera controls.
 	std::mutex control_mutex_;
 	ControlList controls_;
+	RequestControlsCallback request_controls_callback_;
 	// Other:
 	uint64_t last_timestamp_;
 };
@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * parallel.hpp - split a job into bands and run them on several threads.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+// Call fn(begin, end) for consecutive ranges covering [0, n), running them on up
+// to num_threads threads (0 means one per core). The calling thread does a share
+// of the work too. fn must not throw.
+template <typename F>
+void parallel_for(unsigned int n, F fn, unsigned int num_threads = 0)
+{
+	if (num_threads == 0)
+		num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+	num_threads = std::min(num_threads, n);
+	if (num_threads <= 1)
+	{
+		if (n)
+			fn(0u, n);
+		return;
+	}
+
+	unsigned int step = (n + num_threads - 1) / num_threads;
+	std::vector<std::thread> threads;
+	for (unsigned int begin = step; begin < n; begin += step)
+		threads.emplace_back(fn, begin, std::min(begin + step, n));
+	fn(0u, step);
+	for (auto &t : threads)
+		t.join();
+}
@@ -8,6 +8,7 @@
 #pragma once
 
 #include <cstdio>
+#include <sstream>
 
 #include "options.hpp"
 
@@ -39,10 +40,22 @@ struct StillOptions : public Options
 			 "Set thumbnail parameters as width:height:quality")
 			("encoding,e", value<std::string>(&encoding)->default_value("jpg"),
 			 "Set the desired output encoding, either jpg, png, rgb, bmp or yuv420")
+			("colour-space", value<std::string>(&colour_space)->default_value("jpeg"),
+			 "Colour space of YUV images being saved as RGB, either jpeg, smpte170m, rec709 or rec709full")
 			("raw,r", value<bool>(&raw)->default_value(false)->implicit_value(true),
 			 "Also save raw file in DNG format")
+			("raw-compression", value<std::string>(&raw_compression)->default_value("none"),
+			 "Compression for DNG files, either none, ljpeg (lossless JPEG) or deflate")
 			("latest", value<std::string>(&latest),
 			 "Create a symbolic link with this name to most recent saved file")
+			("burst", value<unsigned int>(&burst)->default_value(0),
+			 "Capture this many consecutive full resolution frames at sensor rate")
+			("stack", value<unsigned int>(&stack)->default_value(0),
+			 "Average this many consecutive raw frames into a single low-noise DNG")
+			("stack-mode", value<std::string>(&stack_mode)->default_value("average"),
+			 "How to combine stacked frames, either average, or sum (adds signal above the black level)")
+			("bracket", value<std::string>(&bracket),
+			 "Capture frames at these comma separated EV offsets, e.g. -2,0,2, and fuse them into one image")
 			;
 	}
 
@@ -58,8 +71,15 @@ struct StillOptions : public Options
 	std::string thumb;
 	unsigned int thumb_width, thumb_height, thumb_quality;
 	std::string encoding;
+	std::string colour_space;
 	bool raw;
+	std::string raw_compression;
 	std::string latest;
+	unsigned int burst;
+	unsigned int stack;
+	std::string stack_mode;
+	std::string bracket;
+	std::vector<float> bracket_ev;
 
 	virtual bool Parse(int argc, char *argv[]) override
 	{
@@ -81,14 +101,45 @@ struct StillOptions : public Options
 			encoding = "bmp";
 		else
 			throw std::runtime_error("invalid encoding format " + encoding);
+		if (colour_space != "jpeg" && colour_space != "smpte170m" && colour_space != "rec709" &&
+			colour_space != "rec709full")
+			throw std::runtime_error("invalid colour space " + colour_space);
+		if (raw_compression != "none" && raw_compression != "ljpeg" && raw_compression != "deflate")
+			throw std::runtime_error("invalid raw compression " + raw_compression);
+		if (stack_mode != "average" && stack_mode != "sum")
+			throw std::runtime_error("invalid stack mode " + stack_mode);
+		if (stack && burst)
+			throw std::runtime_error("stack and burst options are mutually exclusive");
+		bracket_ev.clear();
+		if (!bracket.empty())
+		{
+			std::stringstream ss(bracket);
+			std::string ev;
+			while (std::getline(ss, ev, ','))
+			{
+				char *end;
+				bracket_ev.push_back(strtof(ev.c_str(), &end));
+				if (ev.empty() || *end)
+					throw std::runtime_error("bad bracket EV value \"" + ev + "\"");
+			}
+			if (bracket_ev.size() < 2 || bracket_ev.size() > 6)
+				throw std::runtime_error("a bracket needs between 2 and 6 exposures");
+			if (burst || stack)
+				throw std::runtime_error("bracket cannot be used with the burst or stack options");
+		}
+		if (burst > 1 && (datetime || timestamp || output.find('%') == std::string::npos))
+			std::cout << "WARNING: burst frames may overwrite one another without a % directive in the output filename"
+					  << std::endl;
 		return true;
 	}
 	virtual void Print() const override
 	{
 		Options::Print();
 		std::cout << "    encoding: " << encoding << std::endl;
+		std::cout << "    colour space: " << colour_space << std::endl;
 		std::cout << "    quality: " << quality << std::endl;
 		std::cout << "    raw: " << raw << std::endl;
+		std::cout << "    raw compression: " << raw_compression << std::endl;
 		std::cout << "    restart: " << restart << std::endl;
 		std::cout << "    timelapse: " << timelapse << std::endl;
 		std::cout << "    framestart: " << framestart << std::endl;
@@ -100,6 +151,10 @@ struct StillOptions : public Options
 		std::cout << "    thumbnail height: " << thumb_height << std::endl;
 		std::cout << "    thumbnail quality: " << thumb_quality << std::endl;
 		std::cout << "    latest: " << latest << std::endl;
+		std::cout << "    burst: " << burst << std::endl;
+		std::cout << "    stack: " << stack << std::endl;
+		std::cout << "    stack mode: " << stack_mode << std::endl;
+		std::cout << "    bracket: " << bracket << std::endl;
 		for (auto &s : exif)
 			std::cout << "    EXIF: " << s << std::endl;
 	}
@@ -8,6 +8,7 @@
 #pragma once
 
 #include <cstdio>
+#include <cstring>
 
 #include <string>
 
@@ -32,13 +33,13 @@ struct VideoOptions : public Options
 			("inline", value<bool>(&inline_headers)->default_value(false)->implicit_value(true),
 			 "Force PPS/SPS header with every I frame (h264 only)")
 			("codec", value<std::string>(&codec)->default_value("h264"),
-			 "Set the codec to use, either h264, mjpeg or yuv420")
+			 "Set the codec to use, either h264, mjpeg or yuv420 (or rice, lossless raw compression, in libcamera-raw)")
 			("save-pts", value<std::string>(&save_pts),
 			 "Save a timestamp file with this name")
 			("quality,q", value<int>(&quality)->default_value(50),
 			 "Set the MJPEG quality parameter (mjpeg only)")
 			("listen,l", value<bool>(&listen)->default_value(false)->implicit_value(true),
-			 "Listen for an incoming client network connection before sending data to the client")
+			 "Serve the stream to any TCP clients that connect, rather than connecting to a server")
 			("keypress,k", value<bool>(&keypress)->default_value(false)->implicit_value(true),
 			 "Pause or resume video recording when ENTER pressed")
 			("signal,s", value<bool>(&signal)->default_value(false)->implicit_value(true),
@@ -51,6 +52,37 @@ struct VideoOptions : public Options
 			 "Break the recording into files of approximately this many milliseconds")
 			("circular", value<bool>(&circular)->default_value(false)->implicit_value(true),
 			 "Write output to a circular buffer which is saved on exit")
+			("raw-output", value<std::string>(&raw_output),
+			 "Also write the raw stream to this file, or to a DNG file per frame if the name ends in .dng "
+			 "(use a %d directive)")
+			("snapshot", value<std::string>(&snapshot),
+			 "Save a JPEG snapshot to this file (which may contain a %d directive) when 's' is entered in keypress "
+			 "mode, or SIGRTMIN is received in signal mode")
+			("snapshot-width", value<unsigned int>(&snapshot_width)->default_value(0),
+			 "Take snapshots from an extra stream of this width, rather than from the video frames")
+			("snapshot-height", value<unsigned int>(&snapshot_height)->default_value(0),
+			 "Take snapshots from an extra stream of this height, rather than from the video frames")
+			("snapshot-quality", value<int>(&snapshot_quality)->default_value(93),
+			 "Set the JPEG quality parameter for snapshots")
+			("y4m", value<bool>(&y4m)->default_value(false)->implicit_value(true),
+			 "Write yuv420 video as Y4M, as happens anyway when the output name ends in .y4m (use with -o - "
+			 "to stream Y4M to stdout)")
+			("y4m-timestamps", value<bool>(&y4m_timestamps)->default_value(false)->implicit_value(true),
+			 "Record each frame's timestamp in its frame header when writing Y4M")
+			("write-buffer", value<unsigned int>(&write_buffer)->default_value(0),
+			 "Write output files from a separate thread through a buffer of this many MB (0 = write directly). "
+			 "Cannot be used with --flush")
+			("write-policy", value<std::string>(&write_policy)->default_value("block"),
+			 "What to do when the write buffer is full: 'block' waits for space, 'drop' drops frames until "
+			 "the next keyframe")
+			("io-uring", value<bool>(&io_uring)->default_value(false)->implicit_value(true),
+			 "Write output files using io_uring, where the kernel supports it")
+			("direct-io", value<bool>(&direct_io)->default_value(false)->implicit_value(true),
+			 "Bypass the page cache (O_DIRECT) when writing output files with io_uring")
+			("mpegts", value<bool>(&mpegts)->default_value(false)->implicit_value(true),
+			 "Send or write h264 in an MPEG transport stream (the default for output files ending in .ts)")
+			("shm-size", value<unsigned int>(&shm_size)->default_value(16),
+			 "Size in MB of the shared memory ring that a shm:// output publishes frames in")
 			;
 	}
 
@@ -70,6 +102,19 @@ struct VideoOptions : public Options
 	bool split;
 	uint32_t segment;
 	bool circular;
+	std::string raw_output;
+	std::string snapshot;
+	unsigned int snapshot_width;
+	unsigned int snapshot_height;
+	int snapshot_quality;
+	bool y4m;
+	bool y4m_timestamps;
+	unsigned int write_buffer;
+	std::string write_policy;
+	bool io_uring;
+	bool direct_io;
+	bool mpegts;
+	unsigned int shm_size;
 
 	virtual bool Parse(int argc, char *argv[]) override
 	{
@@ -86,8 +131,40 @@ struct VideoOptions : public Options
 			codec = "yuv420";
 		else if (strcasecmp(codec.c_str(), "mjpeg") == 0)
 			codec = "mjpeg";
+		else if (strcasecmp(codec.c_str(), "rice") == 0)
+			codec = "rice";
 		else
 			throw std::runtime_error("unrecognised codec " + codec);
+		if (strcasecmp(write_policy.c_str(), "block") == 0)
+			write_policy = "block";
+		else if (strcasecmp(write_policy.c_str(), "drop") == 0)
+			write_policy = "drop";
+		else
+			throw std::runtime_error("unrecognised write policy " + write_policy);
+		if (io_uring && write_buffer)
+			throw std::runtime_error("io_uring output cannot be combined with a write buffer");
+		// The write buffer holds data back to write it in large chunks, so it can't flush every frame.
+		if (flush && write_buffer)
+			throw std::runtime_error("flushing output cannot be combined with a write buffer");
+		if (direct_io && !io_uring)
+			throw std::runtime_error("direct I/O is only available with io_uring output");
+		if (output.size() >= 3 && strcasecmp(output.c_str() + output.size() - 3, ".ts") == 0)
+			mpegts = true;
+		if (mpegts && codec != "h264")
+			throw std::runtime_error("MPEG-TS output only supports h264");
+		if (mpegts && circular)
+			throw std::runtime_error("MPEG-TS output cannot be combined with a circular buffer");
+		if (codec == "yuv420" && output.size() >= 4 && strcasecmp(output.c_str() + output.size() - 4, ".y4m") == 0)
+			y4m = true;
+		if (y4m && codec != "yuv420")
+			throw std::runtime_error("Y4M output only supports yuv420");
+		if (y4m && circular)
+			throw std::runtime_error("Y4M output cannot be combined with a circular buffer");
+		if (!raw_output.empty() && !raw_output_valid())
+			throw std::runtime_error("raw output must be a plain file, a .dng file pattern, or a udp://, tcp:// "
+									 "or shm:// address");
+		if (shm_size == 0)
+			throw std::runtime_error("shared memory ring size must be at least 1MB");
 		if (strcasecmp(initial.c_str(), "pause") == 0)
 			pause = true;
 		else if (strcasecmp(initial.c_str(), "record") == 0)
@@ -98,6 +175,10 @@ struct VideoOptions : public Options
 			std::cout << "WARNING: consider inline headers with 'pause'/split/segment/circular" << std::endl;
 		if ((split || segment) && output.find('%') == std::string::npos)
 			std::cout << "WARNING: expected % directive in output filename" << std::endl;
+		if (!snapshot.empty() && !keypress && !signal)
+			std::cout << "WARNING: snapshots need keypress or signal mode" << std::endl;
+		if ((snapshot_width == 0) != (snapshot_height == 0))
+			throw std::runtime_error("snapshot width and height must be given together");
 
 		return true;
 	}
@@ -118,5 +199,36 @@ struct VideoOptions : public Options
 		std::cout << "    split: " << split << std::endl;
 		std::cout << "    segment: " << segment << std::endl;
 		std::cout << "    circular: " << circular << std::endl;
+		std::cout << "    raw output: " << raw_output << std::endl;
+		std::cout << "    snapshot: " << snapshot << std::endl;
+		std::cout << "    snapshot size: " << snapshot_width << "x" << snapshot_height << std::endl;
+		std::cout << "    snapshot quality: " << snapshot_quality << std::endl;
+		std::cout << "    y4m: " << y4m << std::endl;
+		std::cout << "    y4m timestamps: " << y4m_timestamps << std::endl;
+		std::cout << "    write buffer: " << write_buffer << "MB, policy " << write_policy << std::endl;
+		std::cout << "    io_uring: " << io_uring << (direct_io ? " (direct I/O)" : "") << std::endl;
+		std::cout << "    mpegts: " << mpegts << std::endl;
+		std::cout << "    shm size: " << shm_size << "MB" << std::endl;
+	}
+
+private:
+	// Raw frames are written just as they are, so they may go to a flat file, a socket or
+	// shared memory, or to DNG files, but not to anything that Output::Create would wrap
+	// in a container or packetise.
+	bool raw_output_valid() const
+	{
+		auto ends_with = [this](char const *ext) {
+			size_t n = strlen(ext);
+			return raw_output.size() >= n && strcasecmp(raw_output.c_str() + raw_output.size() - n, ext) == 0;
+		};
+		if (ends_with(".dng"))
+			return true;
+		for (char const *scheme : { "udp://", "tcp://", "shm://" })
+		{
+			if (raw_output.compare(0, strlen(scheme), scheme) == 0)
+				return true;
+		}
+		return raw_output.find("://") == std::string::npos && !ends_with(".mp4") && !ends_with(".ts") &&
+			   !ends_with(".y4m");
 	}
 };
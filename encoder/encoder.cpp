@@ -20,5 +20,7 @@ Encoder *Encoder::Create(VideoOptions const *options)
 		return new H264Encoder(options);
 	else if (strcasecmp(options->codec.c_str(), "mjpeg") == 0)
 		return new MjpegEncoder(options);
+	else if (strcasecmp(options->codec.c_str(), "rice") == 0)
+		throw std::runtime_error("rice codec is only for raw streams (use libcamera-raw)");
 	throw std::runtime_error("Unrecognised codec " + options->codec);
 }
@@ -0,0 +1,290 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * rice_codec.cpp - lossless compression of packed raw Bayer frames.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <zlib.h>
+
+#include "image/unpack.hpp"
+
+#include "rice_codec.hpp"
+
+// Errors that need a unary part this long (or longer) are sent as escape codes
+// followed by the plain mapped error value instead.
+static constexpr unsigned int ESCAPE = 24;
+
+static unsigned int group_pixels(unsigned int bits)
+{
+	if (bits == 10)
+		return 4;
+	else if (bits == 12)
+		return 2;
+	throw std::runtime_error("rice codec: unsupported bit depth " + std::to_string(bits));
+}
+
+static unsigned int padded_width(unsigned int width, unsigned int bits)
+{
+	unsigned int group = group_pixels(bits);
+	return (width + group - 1) / group * group;
+}
+
+unsigned int rice_row_bytes(unsigned int width, unsigned int bits)
+{
+	return padded_width(width, bits) * bits / 8;
+}
+
+uint32_t rice_crc(uint8_t const *src, unsigned int width, unsigned int rows, unsigned int stride, unsigned int bits)
+{
+	unsigned int row_bytes = rice_row_bytes(width, bits);
+	uLong crc = crc32(0, Z_NULL, 0);
+	for (unsigned int y = 0; y < rows; y++)
+		crc = crc32(crc, src + y * stride, row_bytes);
+	return crc;
+}
+
+// The running mean error of one Bayer colour, from which we choose its Rice parameter.
+struct ChannelState
+{
+	uint32_t sum = 4;
+	uint32_t count = 1;
+	unsigned int k() const
+	{
+		unsigned int k = 0;
+		while ((count << k) < sum)
+			k++;
+		return k;
+	}
+	void update(uint32_t u)
+	{
+		sum += u;
+		if (++count == 64)
+			sum >>= 1, count >>= 1;
+	}
+};
+
+static inline int median_predictor(int a, int b, int c)
+{
+	int lo = std::min(a, b), hi = std::max(a, b);
+	if (c >= hi)
+		return lo;
+	else if (c <= lo)
+		return hi;
+	return a + b - c;
+}
+
+// Predict pixel x of row cur, where up is the row two above (of the same colours) or
+// null at the top of a band. The prediction uses only pixels already coded.
+static inline int predict(uint16_t const *cur, uint16_t const *up, unsigned int x, unsigned int bits)
+{
+	if (!up)
+		return x >= 2 ? cur[x - 2] : 1 << (bits - 1);
+	else if (x < 2)
+		return up[x];
+	return median_predictor(cur[x - 2], up[x], up[x - 2]);
+}
+
+// Bits are written most significant first, 32 at a time.
+class BitWriter
+{
+public:
+	BitWriter(std::vector<uint8_t> &data) : data_(data), acc_(0), n_(0) {}
+	void Put(uint32_t value, unsigned int nbits)
+	{
+		acc_ = (acc_ << nbits) | value;
+		n_ += nbits;
+		if (n_ >= 32)
+		{
+			n_ -= 32;
+			uint32_t word = acc_ >> n_;
+			data_.push_back(word >> 24);
+			data_.push_back(word >> 16);
+			data_.push_back(word >> 8);
+			data_.push_back(word);
+		}
+	}
+	void Flush()
+	{
+		for (; n_ >= 8; n_ -= 8)
+			data_.push_back(acc_ >> (n_ - 8));
+		if (n_)
+			data_.push_back(acc_ << (8 - n_));
+		n_ = 0;
+	}
+
+private:
+	std::vector<uint8_t> &data_;
+	uint64_t acc_;
+	unsigned int n_;
+};
+
+class BitReader
+{
+public:
+	BitReader(uint8_t const *data, size_t size) : ptr_(data), end_(data + size), bits_(0), avail_(0) {}
+	uint32_t Get(unsigned int nbits)
+	{
+		if (nbits == 0)
+			return 0;
+		refill();
+		uint32_t value = bits_ >> (64 - nbits);
+		bits_ <<= nbits;
+		avail_ -= nbits;
+		return value;
+	}
+	// Count the zeros before the next one, and skip past them all.
+	unsigned int Unary()
+	{
+		refill();
+		if (!bits_)
+			throw std::runtime_error("rice codec: corrupt band data");
+		unsigned int q = __builtin_clzll(bits_);
+		if (q > ESCAPE)
+			throw std::runtime_error("rice codec: corrupt band data");
+		bits_ <<= q + 1;
+		avail_ -= q + 1;
+		return q;
+	}
+	// True if we have used more bits than there were.
+	bool Overrun() const { return overrun_ > avail_; }
+
+private:
+	void refill()
+	{
+		for (; avail_ <= 56; avail_ += 8)
+		{
+			uint64_t byte = 0;
+			if (ptr_ < end_)
+				byte = *ptr_++;
+			else
+				overrun_ += 8;
+			bits_ |= byte << (56 - avail_);
+		}
+	}
+	uint8_t const *ptr_, *end_;
+	uint64_t bits_;
+	unsigned int avail_;
+	unsigned int overrun_ = 0;
+};
+
+static void pack_row(uint16_t const *src, unsigned int w, unsigned int bits, uint8_t *dest)
+{
+	if (bits == 10)
+	{
+		for (unsigned int x = 0; x < w; x += 4, src += 4, dest += 5)
+		{
+			dest[0] = src[0] >> 2, dest[1] = src[1] >> 2, dest[2] = src[2] >> 2, dest[3] = src[3] >> 2;
+			dest[4] = (src[0] & 3) | ((src[1] & 3) << 2) | ((src[2] & 3) << 4) | ((src[3] & 3) << 6);
+		}
+	}
+	else
+	{
+		for (unsigned int x = 0; x < w; x += 2, src += 2, dest += 3)
+		{
+			dest[0] = src[0] >> 4, dest[1] = src[1] >> 4;
+			dest[2] = (src[0] & 15) | ((src[1] & 15) << 4);
+		}
+	}
+}
+
+std::vector<uint8_t> rice_compress_band(uint8_t const *src, unsigned int width, unsigned int rows, unsigned int stride,
+										unsigned int bits, RiceBand &band)
+{
+	unsigned int w = padded_width(width, bits);
+	void (*unpack_row)(uint8_t const *, unsigned int, uint16_t *) = bits == 10 ? unpack_10bit_row : unpack_12bit_row;
+
+	// We only need to keep the current row, and the two above it.
+	std::vector<uint16_t> buf(3 * w);
+	std::vector<uint8_t> data;
+	data.reserve(rows * rice_row_bytes(width, bits) / 2);
+	BitWriter writer(data);
+	ChannelState state[4];
+
+	for (unsigned int y = 0; y < rows; y++)
+	{
+		uint16_t *cur = &buf[(y % 3) * w];
+		uint16_t const *up = y >= 2 ? &buf[((y - 2) % 3) * w] : nullptr;
+		ChannelState *row_state = &state[(y & 1) * 2];
+		unpack_row(src + y * stride, w, cur);
+		for (unsigned int x = 0; x < w; x++)
+		{
+			int err = cur[x] - predict(cur, up, x, bits);
+			uint32_t u = ((uint32_t)err << 1) ^ (uint32_t)(err >> 31); // 0, -1, 1, -2, 2...
+			ChannelState &s = row_state[x & 1];
+			unsigned int k = s.k();
+			uint32_t q = u >> k;
+			if (q < ESCAPE)
+			{
+				writer.Put(1, q + 1);
+				writer.Put(u & ((1u << k) - 1), k);
+			}
+			else
+			{
+				writer.Put(1, ESCAPE + 1);
+				writer.Put(u, bits + 1);
+			}
+			s.update(u);
+		}
+	}
+	writer.Flush();
+
+	// Noisy data can come out bigger. Then we store the rows as they were, and the
+	// decoder knows this band by its size.
+	unsigned int row_bytes = rice_row_bytes(width, bits);
+	if (data.size() >= rows * row_bytes)
+	{
+		data.resize(rows * row_bytes);
+		for (unsigned int y = 0; y < rows; y++)
+			memcpy(&data[y * row_bytes], src + y * stride, row_bytes);
+	}
+
+	band.size = data.size();
+	band.crc = rice_crc(src, width, rows, stride, bits);
+	return data;
+}
+
+void rice_decompress_band(uint8_t const *src, size_t size, unsigned int width, unsigned int rows, unsigned int bits,
+						  uint8_t *dest, unsigned int stride)
+{
+	unsigned int row_bytes = rice_row_bytes(width, bits);
+	if (size == rows * row_bytes)
+	{
+		for (unsigned int y = 0; y < rows; y++)
+			memcpy(dest + y * stride, src + y * row_bytes, row_bytes);
+		return;
+	}
+
+	unsigned int w = padded_width(width, bits);
+	std::vector<uint16_t> buf(3 * w);
+	BitReader reader(src, size);
+	ChannelState state[4];
+	int max_value = (1 << bits) - 1;
+
+	for (unsigned int y = 0; y < rows; y++)
+	{
+		uint16_t *cur = &buf[(y % 3) * w];
+		uint16_t const *up = y >= 2 ? &buf[((y - 2) % 3) * w] : nullptr;
+		ChannelState *row_state = &state[(y & 1) * 2];
+		for (unsigned int x = 0; x < w; x++)
+		{
+			ChannelState &s = row_state[x & 1];
+			unsigned int k = s.k();
+			unsigned int q = reader.Unary();
+			uint32_t u = q == ESCAPE ? reader.Get(bits + 1) : (q << k) | reader.Get(k);
+			int value = predict(cur, up, x, bits) + (int)((u >> 1) ^ -(u & 1));
+			if (value < 0 || value > max_value)
+				throw std::runtime_error("rice codec: corrupt band data");
+			cur[x] = value;
+			s.update(u);
+		}
+		pack_row(cur, w, bits, dest + y * stride);
+	}
+	if (reader.Overrun())
+		throw std::runtime_error("rice codec: band data truncated");
+}
@@ -0,0 +1,66 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * rice_codec.hpp - lossless compression of packed raw Bayer frames.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// A "rice" stream is a sequence of self-contained frames, so that it can be cut,
+// paused or sent over the network like any other video stream. Each frame is a
+// RiceFrameHeader, then a table of num_bands RiceBand entries, then the compressed
+// bands one after another. All values are little-endian.
+//
+// Each band of band_rows rows is compressed independently (and so in parallel). Every
+// pixel is predicted from its nearest neighbours of the same Bayer colour, and the
+// errors are Rice coded with a parameter that adapts separately for each colour. A band
+// that would not get any smaller is stored as it was, with a size of exactly
+// band_rows * rice_row_bytes(width, bits) bytes.
+
+static constexpr char RICE_MAGIC[4] = { 'R', 'I', 'C', 'E' };
+
+struct RiceFrameHeader
+{
+	char magic[4];
+	uint32_t header_size; // the header and the band table
+	uint32_t frame; // counts up from 0 at the start of the stream
+	uint32_t fourcc; // of the original (libcamera) pixel format
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride; // of the original packed rows, in bytes
+	uint32_t bits; // 10 or 12, with CSI-2 packing
+	uint32_t band_rows;
+	uint32_t num_bands;
+	uint32_t data_size; // of all the compressed bands
+	uint32_t reserved;
+	int64_t timestamp_us;
+};
+static_assert(sizeof(RiceFrameHeader) == 56, "RiceFrameHeader must not contain padding");
+
+struct RiceBand
+{
+	uint32_t size; // compressed size in bytes
+	uint32_t crc; // zlib crc32 of the band's original packed rows (without their padding)
+};
+
+// Number of bytes of packed pixel data in each row. Rows are compressed as a whole
+// number of pixel groups (4 for 10-bit, 2 for 12-bit) so that this is reproduced exactly.
+unsigned int rice_row_bytes(unsigned int width, unsigned int bits);
+
+// Compress the given number of packed rows starting at src, returning the compressed
+// band and filling in its table entry.
+std::vector<uint8_t> rice_compress_band(uint8_t const *src, unsigned int width, unsigned int rows, unsigned int stride,
+										unsigned int bits, RiceBand &band);
+
+// Decompress a band back to packed rows with the given stride, leaving any padding
+// bytes alone. Throws if the data is corrupt; the crc must be checked by the caller.
+void rice_decompress_band(uint8_t const *src, size_t size, unsigned int width, unsigned int rows, unsigned int bits,
+						  uint8_t *dest, unsigned int stride);
+
+// The crc we record for rows of packed data.
+uint32_t rice_crc(uint8_t const *src, unsigned int width, unsigned int rows, unsigned int stride, unsigned int bits);
@@ -0,0 +1,190 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * rice_encoder.cpp - lossless raw Bayer video encoder.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <libcamera/formats.h>
+
+#include "core/parallel.hpp"
+
+#include "rice_codec.hpp"
+#include "rice_encoder.hpp"
+
+using namespace libcamera;
+
+static unsigned int packed_bits(PixelFormat const &pixel_format)
+{
+	if (pixel_format == formats::SRGGB10_CSI2P || pixel_format == formats::SGRBG10_CSI2P ||
+		pixel_format == formats::SBGGR10_CSI2P || pixel_format == formats::SGBRG10_CSI2P)
+		return 10;
+	else if (pixel_format == formats::SRGGB12_CSI2P || pixel_format == formats::SGRBG12_CSI2P ||
+			 pixel_format == formats::SBGGR12_CSI2P || pixel_format == formats::SGBRG12_CSI2P)
+		return 12;
+	throw std::runtime_error("rice encoder: unsupported pixel format " + pixel_format.toString());
+}
+
+RiceEncoder::RiceEncoder(VideoOptions const *options, PixelFormat const &pixel_format)
+	: Encoder(options), abort_(false), fourcc_(pixel_format.fourcc()), bits_(packed_bits(pixel_format)), frame_(0)
+{
+	output_thread_ = std::thread(&RiceEncoder::outputThread, this);
+	encode_thread_ = std::thread(&RiceEncoder::encodeThread, this);
+	if (options_->verbose)
+		std::cout << "Opened RiceEncoder" << std::endl;
+}
+
+RiceEncoder::~RiceEncoder()
+{
+	abort_ = true;
+	encode_thread_.join();
+	output_thread_.join();
+	if (options_->verbose)
+		std::cout << "RiceEncoder closed" << std::endl;
+}
+
+void RiceEncoder::EncodeBuffer(int fd, size_t size, void *mem, int width, int height, int stride, int64_t timestamp_us)
+{
+	std::lock_guard<std::mutex> lock(encode_mutex_);
+	EncodeItem item = { mem, width, height, stride, timestamp_us };
+	encode_queue_.push(item);
+	encode_cond_var_.notify_all();
+}
+
+void RiceEncoder::encodeThread()
+{
+	std::chrono::duration<double> encode_time(0);
+	uint64_t raw_bytes = 0, encoded_bytes = 0;
+	uint32_t frames = 0, frames_dropped = 0;
+
+	EncodeItem item;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(encode_mutex_);
+			while (true)
+			{
+				using namespace std::chrono_literals;
+				if (abort_)
+				{
+					if (frames && options_->verbose)
+						std::cout << "Encode " << frames << " frames, average time "
+								  << encode_time.count() * 1000 / frames << "ms, compressed to "
+								  << encoded_bytes * 100 / raw_bytes << "%" << std::endl;
+					if (frames_dropped)
+						std::cerr << "WARNING: rice encoder dropped " << frames_dropped << " frames" << std::endl;
+					return;
+				}
+				if (!encode_queue_.empty())
+				{
+					item = encode_queue_.front();
+					encode_queue_.pop();
+					break;
+				}
+				else
+					encode_cond_var_.wait_for(lock, 200ms);
+			}
+		}
+
+		auto start_time = std::chrono::high_resolution_clock::now();
+		unsigned int band_rows = ((item.height + NUM_BANDS - 1) / NUM_BANDS + 1) & ~1;
+		unsigned int num_bands = (item.height + band_rows - 1) / band_rows;
+		std::vector<std::vector<uint8_t>> bands(num_bands);
+		std::vector<RiceBand> table(num_bands);
+		// Each band records its own error, so the threads never share one.
+		std::vector<std::string> errors(num_bands);
+		parallel_for(num_bands, [&](unsigned int begin, unsigned int end) {
+			for (unsigned int b = begin; b < end; b++)
+			{
+				try
+				{
+					unsigned int y = b * band_rows, rows = std::min(band_rows, (unsigned int)item.height - y);
+					bands[b] = rice_compress_band((uint8_t *)item.mem + y * item.stride, item.width, rows,
+												  item.stride, bits_, table[b]);
+				}
+				catch (std::exception const &e)
+				{
+					errors[b] = e.what();
+				}
+			}
+		});
+		// The camera can have its buffer back now, whether or not the frame worked.
+		input_done_callback_(nullptr);
+		auto error = std::find_if(errors.begin(), errors.end(), [](std::string const &e) { return !e.empty(); });
+		if (error != errors.end())
+		{
+			std::cerr << "ERROR: rice encoder dropped frame: " << *error << std::endl;
+			frames_dropped++;
+			continue;
+		}
+
+		RiceFrameHeader header = {};
+		memcpy(header.magic, RICE_MAGIC, sizeof(header.magic));
+		header.header_size = sizeof(header) + num_bands * sizeof(RiceBand);
+		header.frame = frame_++;
+		header.fourcc = fourcc_;
+		header.width = item.width;
+		header.height = item.height;
+		header.stride = item.stride;
+		header.bits = bits_;
+		header.band_rows = band_rows;
+		header.num_bands = num_bands;
+		for (auto const &band : table)
+			header.data_size += band.size;
+		header.timestamp_us = item.timestamp_us;
+
+		OutputItem output_item;
+		output_item.data.resize(header.header_size + header.data_size);
+		uint8_t *ptr = &output_item.data[0];
+		memcpy(ptr, &header, sizeof(header));
+		memcpy(ptr + sizeof(header), &table[0], num_bands * sizeof(RiceBand));
+		ptr += header.header_size;
+		for (auto const &band : bands)
+		{
+			memcpy(ptr, band.data(), band.size());
+			ptr += band.size();
+		}
+		output_item.timestamp_us = item.timestamp_us;
+		encode_time += (std::chrono::high_resolution_clock::now() - start_time);
+		raw_bytes += rice_row_bytes(item.width, bits_) * item.height;
+		encoded_bytes += output_item.data.size();
+		frames++;
+
+		std::lock_guard<std::mutex> lock(output_mutex_);
+		output_queue_.push(std::move(output_item));
+		output_cond_var_.notify_one();
+	}
+}
+
+void RiceEncoder::outputThread()
+{
+	OutputItem item;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(output_mutex_);
+			while (true)
+			{
+				using namespace std::chrono_literals;
+				if (abort_)
+					return;
+				if (!output_queue_.empty())
+				{
+					item = std::move(output_queue_.front());
+					output_queue_.pop();
+					break;
+				}
+				else
+					output_cond_var_.wait_for(lock, 200ms);
+			}
+		}
+		// Every frame is complete in itself, so they all count as "keyframes".
+		output_ready_callback_(&item.data[0], item.data.size(), item.timestamp_us, true);
+	}
+}
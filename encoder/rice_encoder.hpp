@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * rice_encoder.hpp - lossless raw Bayer video encoder.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include <libcamera/pixel_format.h>
+
+#include "encoder.hpp"
+
+// Compresses packed 10 or 12-bit Bayer frames losslessly into the "rice" stream
+// format (see rice_codec.hpp). Each frame is split into row bands which are compressed
+// in parallel, so a frame's input buffer goes back as soon as the frame is done.
+class RiceEncoder : public Encoder
+{
+public:
+	RiceEncoder(VideoOptions const *options, libcamera::PixelFormat const &pixel_format);
+	~RiceEncoder();
+	// Encode the given buffer.
+	void EncodeBuffer(int fd, size_t size, void *mem, int width, int height, int stride, int64_t timestamp_us) override;
+
+private:
+	// Bands per frame. More bands than cores keeps them all busy, at a small cost in compression.
+	static const unsigned int NUM_BANDS = 16;
+
+	void encodeThread();
+
+	// Handle the output buffers in another thread so as not to hold up the encoding of the next frame.
+	void outputThread();
+
+	bool abort_;
+	uint32_t fourcc_;
+	unsigned int bits_;
+	uint32_t frame_;
+
+	struct EncodeItem
+	{
+		void *mem;
+		int width;
+		int height;
+		int stride;
+		int64_t timestamp_us;
+	};
+	std::queue<EncodeItem> encode_queue_;
+	std::mutex encode_mutex_;
+	std::condition_variable encode_cond_var_;
+	std::thread encode_thread_;
+
+	struct OutputItem
+	{
+		std::vector<uint8_t> data;
+		int64_t timestamp_us;
+	};
+	std::queue<OutputItem> output_queue_;
+	std::mutex output_mutex_;
+	std::condition_variable output_cond_var_;
+	std::thread output_thread_;
+};
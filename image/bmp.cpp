@@ -12,6 +12,8 @@
 
 #include "core/still_options.hpp"
 
+#include "yuv2rgb.hpp"
+
 struct ImageHeader
 {
 	uint32_t size = sizeof(ImageHeader);
@@ -43,8 +45,8 @@ static_assert(sizeof(FileHeader) == 16, "FileHeader size wrong");
 void bmp_save(std::vector<void *> const &mem, int w, int h, int stride, libcamera::PixelFormat const &pixel_format,
 			  std::string const &filename, StillOptions const *options)
 {
-	if (pixel_format != libcamera::formats::RGB888)
-		throw std::runtime_error("pixel format for bmp should be RGB");
+	// BMP wants B, G, R in memory, which is what libcamera calls RGB888.
+	RgbRowReader reader(mem, w, h, stride, pixel_format, libcamera::formats::RGB888, options->colour_space);
 
 	FILE *fp = fopen(filename.c_str(), "wb");
 
@@ -57,7 +59,7 @@ void bmp_save(std::vector<void *> const &mem, int w, int h, int stride, libcamer
 		unsigned int pitch = (line + 3) & ~3; // lines are multiples of 4 bytes
 		unsigned int pad = pitch - line;
 		uint8_t padding[3] = {};
-		uint8_t *ptr = (uint8_t *)mem[0];
+		std::vector<uint8_t> buf(line);
 
 		FileHeader file_header;
 		ImageHeader image_header;
@@ -70,9 +72,9 @@ void bmp_save(std::vector<void *> const &mem, int w, int h, int stride, libcamer
 			fwrite(&image_header, sizeof(image_header), 1, fp) != 1)
 			throw std::runtime_error("failed to write BMP file");
 
-		for (int i = 0; i < h; i++, ptr += stride)
+		for (int i = 0; i < h; i++)
 		{
-			if (fwrite(ptr, line, 1, fp) != 1 || (pad != 0 && fwrite(padding, pad, 1, fp) != 1))
+			if (fwrite(reader.Row(i, buf.data()), line, 1, fp) != 1 || (pad != 0 && fwrite(padding, pad, 1, fp) != 1))
 				throw std::runtime_error("failed to write BMP file, row " + std::to_string(i));
 		}
 
@@ -5,7 +5,12 @@
  * dng.cpp - Save raw image as DNG file.
  */
 
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <functional>
 #include <map>
+#include <thread>
 
 #include <libcamera/control_ids.h>
 #include <libcamera/formats.h>
@@ -13,8 +18,13 @@
 
 #include <tiffio.h>
 
+#include "core/parallel.hpp"
 #include "core/still_options.hpp"
 
+#include "dng.hpp"
+#include "dng_compress.hpp"
+#include "unpack.hpp"
+
 using namespace libcamera;
 
 static char TIFF_RGGB[4] = { 0, 1, 1, 2 };
@@ -39,43 +49,27 @@ static const std::map<PixelFormat, BayerFormat> bayer_formats =
 	{ formats::SGRBG12_CSI2P, { "GRBG-12", 12, TIFF_GRBG } },
 	{ formats::SBGGR12_CSI2P, { "BGGR-12", 12, TIFF_BGGR } },
 	{ formats::SGBRG12_CSI2P, { "GBRG-12", 12, TIFF_GBRG } },
+	// Unpacked 16-bit data, as made by stacking several raw frames.
+	{ formats::SRGGB16, { "RGGB-16", 16, TIFF_RGGB } },
+	{ formats::SGRBG16, { "GRBG-16", 16, TIFF_GRBG } },
+	{ formats::SBGGR16, { "BGGR-16", 16, TIFF_BGGR } },
+	{ formats::SGBRG16, { "GBRG-16", 16, TIFF_GBRG } },
 };
 
-static void unpack_10bit(uint8_t *src, int w, int h, int stride, uint16_t *dest)
+// Fetch a single pixel straight from the packed raw data.
+static inline uint16_t packed_pixel(uint8_t const *row, int x, int bits)
 {
-	int i = 0;
-	int w_align = w & ~3;
-	for (int y = 0; y < h; y++, src += stride)
+	if (bits == 16)
+		return ((uint16_t const *)row)[x];
+	else if (bits == 10)
 	{
-		uint8_t *ptr = src;
-		int x;
-		for (x = 0; x < w_align; x += 4, ptr += 5)
-		{
-			*dest++ = (ptr[0] << 2) | ((ptr[4] >> 0) & 3);
-			*dest++ = (ptr[1] << 2) | ((ptr[4] >> 2) & 3);
-			*dest++ = (ptr[2] << 2) | ((ptr[4] >> 4) & 3);
-			*dest++ = (ptr[3] << 2) | ((ptr[4] >> 6) & 3);
-		}
-		for (; x < w; x++)
-			*dest++ = (ptr[x & 3] << 2) | ((ptr[4] >> ((x & 3) << 1)) & 3);
+		uint8_t const *ptr = row + (x >> 2) * 5;
+		return (ptr[x & 3] << 2) | ((ptr[4] >> ((x & 3) << 1)) & 3);
 	}
-}
-
-static void unpack_12bit(uint8_t *src, int w, int h, int stride, uint16_t *dest)
-{
-	int i = 0;
-	int w_align = w & ~1;
-	for (int y = 0; y < h; y++, src += stride)
+	else
 	{
-		uint8_t *ptr = src;
-		int x;
-		for (x = 0; x < w_align; x += 2, ptr += 3)
-		{
-			*dest++ = (ptr[0] << 4) | ((ptr[2] >> 0) & 15);
-			*dest++ = (ptr[1] << 4) | ((ptr[2] >> 4) & 15);
-		}
-		if (x < w)
-			*dest++ = (ptr[x & 1] << 4) | ((ptr[2] >> ((x & 1) << 2)) & 15);
+		uint8_t const *ptr = row + (x >> 1) * 3;
+		return (ptr[x & 1] << 4) | ((ptr[2] >> ((x & 1) << 2)) & 15);
 	}
 }
 
@@ -128,25 +122,25 @@ Matrix(float m0, float m1, float m2,
 	}
 };
 
-void dng_save(std::vector<void *> const &mem, int w, int h, int stride, PixelFormat const &pixel_format,
-			  ControlList const &metadata, std::string const &filename, std::string const &cam_name,
-			  StillOptions const *options)
+// Write the DNG to the TIFF handle that open_tiff returns, which is only called once
+// the format and metadata have been checked. The unpacking and compression is shared
+// between up to num_threads threads (0 means one per core).
+static void write_dng(std::function<TIFF *()> const &open_tiff, std::vector<void *> const &mem, int w, int h,
+					  int stride, PixelFormat const &pixel_format, ControlList const &metadata,
+					  std::string const &cam_name, std::string const &compression, bool verbose,
+					  unsigned int num_threads)
 {
-	// Check the Bayer format and unpack it to u16.
+	// Check the Bayer format. We unpack it to u16 a strip at a time while writing.
 
 	auto it = bayer_formats.find(pixel_format);
 	if (it == bayer_formats.end())
 		throw std::runtime_error("unsupported Bayer format");
 	BayerFormat const &bayer_format = it->second;
-	std::cout << "Bayer format is " << bayer_format.name << "\n";
-
-	std::vector<uint16_t> buf(w * h);
-	if (bayer_format.bits == 10)
-		unpack_10bit((uint8_t *)mem[0], w, h, stride, &buf[0]);
-	else if (bayer_format.bits == 12)
-		unpack_12bit((uint8_t *)mem[0], w, h, stride, &buf[0]);
-	else
+	if (verbose)
+		std::cout << "Bayer format is " << bayer_format.name << "\n";
+	if (bayer_format.bits != 10 && bayer_format.bits != 12 && bayer_format.bits != 16)
 		throw std::runtime_error("unsupported bit depth " + std::to_string(bayer_format.bits));
+	uint8_t const *raw = (uint8_t *)mem[0];
 
 	// We need to fish out some metadata values for the DNG.
 
@@ -207,7 +201,7 @@ void dng_save(std::vector<void *> const &mem, int w, int h, int stride, PixelFor
 				   0.0193339, 0.1191920, 0.9503041);
 	Matrix CAM_XYZ = (RGB2XYZ * CCM * WB_GAINS).Inv();
 
-	if (options->verbose)
+	if (verbose)
 	{
 		std::cout << "Black levels " << black_levels[0] << " " << black_levels[1] << " " << black_levels[2] << " "
 				  << black_levels[3] << ", exposure time " << exp_time * 1e6 << "us, ISO " << iso << std::endl;
@@ -228,9 +222,7 @@ void dng_save(std::vector<void *> const &mem, int w, int h, int stride, PixelFor
 		uint32_t white = (1 << bayer_format.bits) - 1;
 		toff_t offset_subifd = 0, offset_exififd = 0;
 
-		tif = TIFFOpen(filename.c_str(), "w");
-		if (!tif)
-			throw std::runtime_error("could not open file " + filename);
+		tif = open_tiff();
 
 		// This is just the thumbnail, but put it first to help software that only
 		// reads the first IFD.
@@ -242,8 +234,17 @@ void dng_save(std::vector<void *> const &mem, int w, int h, int stride, PixelFor
 		TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
 		TIFFSetField(tif, TIFFTAG_MAKE, "Raspberry Pi");
 		TIFFSetField(tif, TIFFTAG_MODEL, cam_name.c_str());
-		TIFFSetField(tif, TIFFTAG_DNGVERSION, "\001\001\000\000");
-		TIFFSetField(tif, TIFFTAG_DNGBACKWARDVERSION, "\001\000\000\000");
+		// Deflate compression only arrived with DNG 1.4.
+		if (compression == "deflate")
+		{
+			TIFFSetField(tif, TIFFTAG_DNGVERSION, "\001\004\000\000");
+			TIFFSetField(tif, TIFFTAG_DNGBACKWARDVERSION, "\001\004\000\000");
+		}
+		else
+		{
+			TIFFSetField(tif, TIFFTAG_DNGVERSION, "\001\001\000\000");
+			TIFFSetField(tif, TIFFTAG_DNGBACKWARDVERSION, "\001\000\000\000");
+		}
 		TIFFSetField(tif, TIFFTAG_UNIQUECAMERAMODEL, cam_name.c_str());
 		TIFFSetField(tif, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
 		TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 3);
@@ -260,10 +261,12 @@ void dng_save(std::vector<void *> const &mem, int w, int h, int stride, PixelFor
 
 		for (int y = 0; y < h >> 4; y++)
 		{
+			uint8_t const *row0 = raw + (y << 4) * stride, *row1 = row0 + stride;
+			int bits = bayer_format.bits;
 			for (int x = 0; x < w >> 4; x++)
 			{
-				int off = (y * w + x) << 4;
-				int grey = buf[off] + buf[off + 1] + buf[off + w] + buf[off + w + 1];
+				int grey = packed_pixel(row0, x << 4, bits) + packed_pixel(row0, (x << 4) + 1, bits) +
+						   packed_pixel(row1, x << 4, bits) + packed_pixel(row1, (x << 4) + 1, bits);
 				grey = white * sqrt(grey / (double)white); // fake "gamma"
 				thumb_buf[3 * x] = thumb_buf[3 * x + 1] = thumb_buf[3 * x + 2] = grey >> (bayer_format.bits - 6);
 			}
@@ -277,7 +280,6 @@ void dng_save(std::vector<void *> const &mem, int w, int h, int stride, PixelFor
 		TIFFSetField(tif, TIFFTAG_SUBFILETYPE, 0);
 		TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, w);
 		TIFFSetField(tif, TIFFTAG_IMAGELENGTH, h);
-		TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 16);
 		TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_CFA);
 		TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 1);
 		TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
@@ -288,10 +290,79 @@ void dng_save(std::vector<void *> const &mem, int w, int h, int stride, PixelFor
 		TIFFSetField(tif, TIFFTAG_BLACKLEVELREPEATDIM, &black_level_repeat_dim);
 		TIFFSetField(tif, TIFFTAG_BLACKLEVEL, 4, &black_levels);
 
-		for (int y = 0; y < h; y++)
+		if (compression == "none")
+		{
+			// Unpack and write the image one strip at a time, so we only ever hold a few rows
+			// of 16-bit pixels. The unpacking of each strip is still shared between threads.
+			TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 16);
+			TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+			int strip_rows = 16 * (num_threads ? num_threads : std::max(std::thread::hardware_concurrency(), 1u));
+			TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, strip_rows);
+			std::vector<uint16_t> strip(strip_rows * w);
+			for (int y = 0, strip_num = 0; y < h; y += strip_rows, strip_num++)
+			{
+				int rows = std::min(strip_rows, h - y);
+				unpack_raw(raw + y * stride, w, rows, stride, bayer_format.bits, &strip[0], w, num_threads);
+				if (TIFFWriteEncodedStrip(tif, strip_num, &strip[0], rows * w * sizeof(uint16_t)) < 0)
+					throw std::runtime_error("error writing DNG image data");
+			}
+		}
+		else
 		{
-			if (TIFFWriteScanline(tif, &buf[w * y], y, 0) != 1)
-				throw std::runtime_error("error writing DNG image data");
+			// Compressed images are tiled. We unpack one row of tiles at a time, compress all
+			// the tiles in that row in parallel, and then let libtiff record the tile offsets
+			// as we write them out.
+			const int tile_size = 256;
+			bool ljpeg = compression == "ljpeg";
+			// Lossless JPEG records the true sample precision, deflate stores whole 16-bit words.
+			TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, ljpeg ? bayer_format.bits : 16);
+			TIFFSetField(tif, TIFFTAG_COMPRESSION, ljpeg ? COMPRESSION_JPEG : COMPRESSION_ADOBE_DEFLATE);
+			if (!ljpeg)
+				TIFFSetField(tif, TIFFTAG_PREDICTOR, 34892); // horizontal difference X2
+			TIFFSetField(tif, TIFFTAG_TILEWIDTH, tile_size);
+			TIFFSetField(tif, TIFFTAG_TILELENGTH, tile_size);
+
+			unsigned int num_tiles = (w + tile_size - 1) / tile_size;
+			std::vector<uint16_t> band(tile_size * w);
+			std::vector<std::vector<uint8_t>> tiles(num_tiles);
+			for (int y = 0; y < h; y += tile_size)
+			{
+				int rows = std::min(tile_size, h - y);
+				unpack_raw(raw + y * stride, w, rows, stride, bayer_format.bits, &band[0], w, num_threads);
+
+				// Each tile records its own error, so the threads never share one.
+				std::vector<std::string> errors(num_tiles);
+				parallel_for(num_tiles, [&](unsigned int begin, unsigned int end) {
+					for (unsigned int t = begin; t < end; t++)
+					{
+						try
+						{
+							int x = t * tile_size, cols = std::min(tile_size, w - x);
+							if (ljpeg)
+								tiles[t] = ljpeg_compress_tile(&band[x], w, cols, rows, tile_size, tile_size,
+															   bayer_format.bits);
+							else
+								tiles[t] = deflate_compress_tile(&band[x], w, cols, rows, tile_size, tile_size);
+						}
+						catch (std::exception const &e)
+						{
+							errors[t] = e.what();
+						}
+					}
+				}, num_threads);
+				for (std::string const &error : errors)
+				{
+					if (!error.empty())
+						throw std::runtime_error(error);
+				}
+
+				for (unsigned int t = 0; t < num_tiles; t++)
+				{
+					ttile_t tile = TIFFComputeTile(tif, t * tile_size, y, 0, 0);
+					if (TIFFWriteRawTile(tif, tile, &tiles[t][0], tiles[t].size()) < 0)
+						throw std::runtime_error("error writing DNG tile data");
+				}
+			}
 		}
 
 		// We have to checkpoint before the directory offset is valid.
@@ -324,3 +395,81 @@ void dng_save(std::vector<void *> const &mem, int w, int h, int stride, PixelFor
 		throw;
 	}
 }
+
+void dng_save(std::vector<void *> const &mem, int w, int h, int stride, PixelFormat const &pixel_format,
+			  ControlList const &metadata, std::string const &filename, std::string const &cam_name,
+			  StillOptions const *options)
+{
+	auto open_tiff = [&filename]() {
+		TIFF *tif = TIFFOpen(filename.c_str(), "w");
+		if (!tif)
+			throw std::runtime_error("could not open file " + filename);
+		return tif;
+	};
+	write_dng(open_tiff, mem, w, h, stride, pixel_format, metadata, cam_name, options->raw_compression,
+			  options->verbose, 0);
+}
+
+// libtiff reads and writes the in-memory DNG through these. It reads back what it has
+// written when it rewrites the first IFD at the end.
+struct MemoryFile
+{
+	std::vector<uint8_t> data;
+	size_t pos = 0;
+
+	static tmsize_t read(thandle_t handle, void *buf, tmsize_t size)
+	{
+		MemoryFile *file = (MemoryFile *)handle;
+		size_t n = file->pos < file->data.size() ? std::min<size_t>(size, file->data.size() - file->pos) : 0;
+		memcpy(buf, file->data.data() + file->pos, n);
+		file->pos += n;
+		return n;
+	}
+	static tmsize_t write(thandle_t handle, void *buf, tmsize_t size)
+	{
+		MemoryFile *file = (MemoryFile *)handle;
+		if (file->pos + size > file->data.size())
+		{
+			// Grow generously, as libtiff writes the image a strip or tile at a time.
+			if (file->pos + size > file->data.capacity())
+				file->data.reserve(std::max<size_t>(file->pos + size, file->data.capacity() * 2));
+			file->data.resize(file->pos + size);
+		}
+		memcpy(file->data.data() + file->pos, buf, size);
+		file->pos += size;
+		return size;
+	}
+	static toff_t seek(thandle_t handle, toff_t offset, int whence)
+	{
+		MemoryFile *file = (MemoryFile *)handle;
+		if (whence == SEEK_CUR)
+			offset += file->pos;
+		else if (whence == SEEK_END)
+			offset += file->data.size();
+		file->pos = offset;
+		return offset;
+	}
+	static int close(thandle_t) { return 0; }
+	static toff_t size(thandle_t handle) { return ((MemoryFile *)handle)->data.size(); }
+	static int map(thandle_t, void **, toff_t *) { return 0; }
+	static void unmap(thandle_t, void *, toff_t) {}
+};
+
+std::vector<uint8_t> dng_encode(std::vector<void *> const &mem, int w, int h, int stride,
+								PixelFormat const &pixel_format, ControlList const &metadata,
+								std::string const &cam_name, std::string const &compression, bool verbose,
+								unsigned int num_threads)
+{
+	MemoryFile file;
+	file.data.reserve(w * h * 2 + 65536);
+	auto open_tiff = [&file]() {
+		TIFF *tif = TIFFClientOpen("memory", "wm", (thandle_t)&file, MemoryFile::read, MemoryFile::write,
+								   MemoryFile::seek, MemoryFile::close, MemoryFile::size, MemoryFile::map,
+								   MemoryFile::unmap);
+		if (!tif)
+			throw std::runtime_error("could not create in-memory DNG");
+		return tif;
+	};
+	write_dng(open_tiff, mem, w, h, stride, pixel_format, metadata, cam_name, compression, verbose, num_threads);
+	return std::move(file.data);
+}
@@ -0,0 +1,24 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * dng.hpp - make DNG files in memory.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <libcamera/controls.h>
+#include <libcamera/pixel_format.h>
+
+// Return a complete DNG file made from a raw frame, just as dng_save would write it.
+// compression is "none", "ljpeg" or "deflate", as for the --raw-compression option. The
+// work is shared between up to num_threads threads (0 means one per core); pass 1 when
+// encoding several frames at once on different threads.
+std::vector<uint8_t> dng_encode(std::vector<void *> const &mem, int w, int h, int stride,
+								libcamera::PixelFormat const &pixel_format, libcamera::ControlList const &metadata,
+								std::string const &cam_name, std::string const &compression, bool verbose,
+								unsigned int num_threads);
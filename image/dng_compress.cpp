@@ -0,0 +1,254 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * dng_compress.cpp - lossless compression of DNG tiles.
+ */
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <zlib.h>
+
+#include "dng_compress.hpp"
+
+// Copy the valid part of the tile and pad it out to its full size. Padding pixels
+// repeat the pixel two to the left (or two above), which has the same colour.
+static std::vector<uint16_t> pad_tile(uint16_t const *src, unsigned int stride, unsigned int w, unsigned int h,
+									  unsigned int tile_width, unsigned int tile_height)
+{
+	if (w < 2 || h < 2)
+		throw std::runtime_error("DNG tile too small");
+
+	std::vector<uint16_t> tile(tile_width * tile_height);
+	for (unsigned int y = 0; y < tile_height; y++)
+	{
+		uint16_t *row = &tile[y * tile_width];
+		if (y < h)
+		{
+			std::copy(src + y * stride, src + y * stride + w, row);
+			for (unsigned int x = w; x < tile_width; x++)
+				row[x] = row[x - 2];
+		}
+		else
+			std::copy(row - 2 * tile_width, row - tile_width, row);
+	}
+	return tile;
+}
+
+class BitWriter
+{
+public:
+	BitWriter(std::vector<uint8_t> &buf) : buf_(buf), bits_(0), count_(0) {}
+	void Put(uint32_t value, unsigned int length)
+	{
+		bits_ = (bits_ << length) | (value & ((1u << length) - 1));
+		count_ += length;
+		while (count_ >= 8)
+		{
+			count_ -= 8;
+			uint8_t byte = bits_ >> count_;
+			buf_.push_back(byte);
+			if (byte == 0xff)
+				buf_.push_back(0); // JPEG byte stuffing
+		}
+	}
+	void Flush()
+	{
+		// Pad out the final byte with ones.
+		if (count_)
+			Put(0xff, 8 - count_);
+	}
+
+private:
+	std::vector<uint8_t> &buf_;
+	uint64_t bits_;
+	unsigned int count_;
+};
+
+// A lossless JPEG difference category ("SSSS") is the number of bits in the magnitude.
+static const int NUM_CATEGORIES = 17;
+
+struct HuffmanTable
+{
+	uint8_t bits[17] = {}; // bits[i] = number of codes of length i
+	std::vector<uint8_t> values;
+	uint16_t code[NUM_CATEGORIES] = {};
+	uint8_t size[NUM_CATEGORIES] = {};
+};
+
+// Make an optimal Huffman table, with codes no longer than 16 bits, for the given
+// symbol frequencies. This follows ITU T.81 Annex K.2.
+static HuffmanTable build_huffman_table(uint32_t const *counts)
+{
+	// One extra symbol with the lowest frequency reserves the all-ones code.
+	const int N = NUM_CATEGORIES + 1;
+	uint64_t freq[N];
+	int code_size[N] = {}, others[N];
+	for (int i = 0; i < NUM_CATEGORIES; i++)
+		freq[i] = counts[i];
+	freq[N - 1] = 1;
+	std::fill(others, others + N, -1);
+
+	while (true)
+	{
+		int v1 = -1, v2 = -1;
+		for (int i = 0; i < N; i++)
+		{
+			if (freq[i] && (v1 < 0 || freq[i] <= freq[v1]))
+				v1 = i;
+		}
+		for (int i = 0; i < N; i++)
+		{
+			if (freq[i] && i != v1 && (v2 < 0 || freq[i] <= freq[v2]))
+				v2 = i;
+		}
+		if (v2 < 0)
+			break;
+
+		freq[v1] += freq[v2];
+		freq[v2] = 0;
+		for (code_size[v1]++; others[v1] >= 0; code_size[v1]++)
+			v1 = others[v1];
+		others[v1] = v2;
+		for (code_size[v2]++; others[v2] >= 0; code_size[v2]++)
+			v2 = others[v2];
+	}
+
+	int bits[2 * N] = {};
+	for (int i = 0; i < N; i++)
+		bits[code_size[i]]++;
+	bits[0] = 0;
+
+	// Limit the code lengths to 16 bits, then drop the reserved code.
+	for (int i = 2 * N - 1; i > 16; i--)
+	{
+		while (bits[i] > 0)
+		{
+			int j = i - 2;
+			while (bits[j] == 0)
+				j--;
+			bits[i] -= 2;
+			bits[i - 1]++;
+			bits[j + 1] += 2;
+			bits[j]--;
+		}
+	}
+	int i = 16;
+	while (bits[i] == 0)
+		i--;
+	bits[i]--;
+
+	HuffmanTable table;
+	for (int i = 1; i <= 16; i++)
+		table.bits[i] = bits[i];
+	for (int i = 1; i < 2 * N; i++)
+	{
+		for (int j = 0; j < NUM_CATEGORIES; j++)
+		{
+			if (code_size[j] == i)
+				table.values.push_back(j);
+		}
+	}
+
+	// Canonical code assignment, shortest codes first.
+	unsigned int code = 0, k = 0;
+	for (int length = 1; length <= 16; length++, code <<= 1)
+	{
+		for (int n = 0; n < table.bits[length]; n++, code++, k++)
+		{
+			table.code[table.values[k]] = code;
+			table.size[table.values[k]] = length;
+		}
+	}
+	return table;
+}
+
+static void put_marker(std::vector<uint8_t> &buf, uint8_t marker, unsigned int length)
+{
+	buf.insert(buf.end(), { 0xff, marker });
+	if (length)
+		buf.insert(buf.end(), { (uint8_t)(length >> 8), (uint8_t)length });
+}
+
+std::vector<uint8_t> ljpeg_compress_tile(uint16_t const *src, unsigned int stride, unsigned int w, unsigned int h,
+										 unsigned int tile_width, unsigned int tile_height, unsigned int bits)
+{
+	std::vector<uint16_t> tile = pad_tile(src, stride, w, h, tile_width, tile_height);
+
+	// With two interleaved components, each pixel is predicted from the one two to its
+	// left (predictor 1), or directly above at the start of a row, or from the mid-point
+	// for the very first pixels. Gather the differences and their statistics first.
+	std::vector<int32_t> diffs(tile.size());
+	uint32_t counts[NUM_CATEGORIES] = {};
+	for (unsigned int y = 0; y < tile_height; y++)
+	{
+		uint16_t const *row = &tile[y * tile_width];
+		for (unsigned int x = 0; x < tile_width; x++)
+		{
+			int pred = x >= 2 ? row[x - 2] : (y ? (row - tile_width)[x] : 1 << (bits - 1));
+			int diff = row[x] - pred;
+			if (diff > 32768)
+				diff -= 65536;
+			else if (diff < -32767)
+				diff += 65536;
+			diffs[y * tile_width + x] = diff;
+			counts[diff ? 32 - __builtin_clz(diff < 0 ? -diff : diff) : 0]++;
+		}
+	}
+	HuffmanTable table = build_huffman_table(counts);
+
+	std::vector<uint8_t> buf;
+	buf.reserve(tile.size() * bits / 8 + 1024);
+
+	put_marker(buf, 0xd8, 0); // SOI
+
+	put_marker(buf, 0xc4, 2 + 1 + 16 + table.values.size()); // DHT
+	buf.push_back(0x00); // DC table 0
+	buf.insert(buf.end(), table.bits + 1, table.bits + 17);
+	buf.insert(buf.end(), table.values.begin(), table.values.end());
+
+	put_marker(buf, 0xc3, 8 + 3 * 2); // SOF3
+	unsigned int columns = tile_width / 2;
+	buf.insert(buf.end(), { (uint8_t)bits, (uint8_t)(tile_height >> 8), (uint8_t)tile_height,
+							(uint8_t)(columns >> 8), (uint8_t)columns, 2 });
+	buf.insert(buf.end(), { 1, 0x11, 0, 2, 0x11, 0 });
+
+	put_marker(buf, 0xda, 6 + 2 * 2); // SOS
+	buf.insert(buf.end(), { 2, 1, 0x00, 2, 0x00, 1 /* predictor */, 0, 0 });
+
+	BitWriter writer(buf);
+	for (int32_t diff : diffs)
+	{
+		int category = diff ? 32 - __builtin_clz(diff < 0 ? -diff : diff) : 0;
+		writer.Put(table.code[category], table.size[category]);
+		// Category 16 (a difference of 32768) has no extra bits.
+		if (category && category < 16)
+			writer.Put(diff < 0 ? diff - 1 : diff, category);
+	}
+	writer.Flush();
+
+	put_marker(buf, 0xd9, 0); // EOI
+	return buf;
+}
+
+std::vector<uint8_t> deflate_compress_tile(uint16_t const *src, unsigned int stride, unsigned int w, unsigned int h,
+										   unsigned int tile_width, unsigned int tile_height)
+{
+	std::vector<uint16_t> tile = pad_tile(src, stride, w, h, tile_width, tile_height);
+
+	for (unsigned int y = 0; y < tile_height; y++)
+	{
+		uint16_t *row = &tile[y * tile_width];
+		for (unsigned int x = tile_width - 1; x >= 2; x--)
+			row[x] -= row[x - 2];
+	}
+
+	// Like the PNG writer, favour speed over the last few percent of compression.
+	uLongf size = compressBound(tile.size() * sizeof(uint16_t));
+	std::vector<uint8_t> buf(size);
+	if (compress2(&buf[0], &size, (Bytef *)&tile[0], tile.size() * sizeof(uint16_t), 1) != Z_OK)
+		throw std::runtime_error("failed to deflate DNG tile");
+	buf.resize(size);
+	return buf;
+}
@@ -0,0 +1,27 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * dng_compress.hpp - lossless compression of DNG tiles.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Each of these compresses one tile_width x tile_height tile of 16-bit Bayer data
+// taken from src, whose rows are stride pixels apart. Only the top left w x h
+// pixels of the tile need be valid; the rest of the tile is padded by repeating
+// the nearest pixel of the same colour.
+
+// Lossless JPEG (ITU T.81 process 14, DNG compression 7) with the tile coded as two
+// interleaved components so that predictions are always between pixels of the same
+// colour. bits gives the sample precision.
+std::vector<uint8_t> ljpeg_compress_tile(uint16_t const *src, unsigned int stride, unsigned int w, unsigned int h,
+										 unsigned int tile_width, unsigned int tile_height, unsigned int bits);
+
+// Deflate (DNG compression 8) after applying DNG's "horizontal difference X2"
+// predictor (34892), leaving samples in the host's byte order.
+std::vector<uint8_t> deflate_compress_tile(uint16_t const *src, unsigned int stride, unsigned int w, unsigned int h,
+										   unsigned int tile_width, unsigned int tile_height);
@@ -0,0 +1,212 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * exposure_fusion.cpp - combine frames taken at different exposures into one image.
+ */
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <stdexcept>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+#include "core/parallel.hpp"
+
+#include "exposure_fusion.hpp"
+#include "raw_stack.hpp"
+#include "unpack.hpp"
+
+static constexpr unsigned int MAX_FRAMES = 8;
+
+// The sums of the weights and of the weighted pixels stay well inside the range where
+// floats are exact. Adding 0.5 to the rounded numerator keeps the quotient away from
+// whole numbers, so even NEON's approximate reciprocal truncates to the same result as
+// integer division.
+void fuse_row_scalar(uint8_t const *const *src, uint8_t const *const *weight, unsigned int n, unsigned int w,
+					 uint8_t *dest)
+{
+	for (unsigned int x = 0; x < w; x++)
+	{
+		uint32_t num = 0, den = 0;
+		for (unsigned int i = 0; i < n; i++)
+		{
+			num += weight[i][x] * src[i][x];
+			den += weight[i][x];
+		}
+		dest[x] = (num + den / 2) / den;
+	}
+}
+
+void fuse_row(uint8_t const *const *src, uint8_t const *const *weight, unsigned int n, unsigned int w, uint8_t *dest)
+{
+	unsigned int x = 0;
+#if defined(__ARM_NEON)
+	for (; x + 8 <= w; x += 8)
+	{
+		uint32x4_t num_lo = vdupq_n_u32(0), num_hi = vdupq_n_u32(0);
+		uint16x8_t den = vdupq_n_u16(0);
+		for (unsigned int i = 0; i < n; i++)
+		{
+			uint8x8_t wt = vld1_u8(weight[i] + x);
+			uint16x8_t product = vmull_u8(vld1_u8(src[i] + x), wt);
+			num_lo = vaddw_u16(num_lo, vget_low_u16(product));
+			num_hi = vaddw_u16(num_hi, vget_high_u16(product));
+			den = vaddw_u8(den, wt);
+		}
+		uint32x4_t den_lo = vmovl_u16(vget_low_u16(den)), den_hi = vmovl_u16(vget_high_u16(den));
+		float32x4_t half = vdupq_n_f32(0.5);
+		float32x4_t a_lo = vaddq_f32(vcvtq_f32_u32(vaddq_u32(num_lo, vshrq_n_u32(den_lo, 1))), half);
+		float32x4_t a_hi = vaddq_f32(vcvtq_f32_u32(vaddq_u32(num_hi, vshrq_n_u32(den_hi, 1))), half);
+		float32x4_t d_lo = vcvtq_f32_u32(den_lo), d_hi = vcvtq_f32_u32(den_hi);
+#if defined(__aarch64__)
+		float32x4_t q_lo = vdivq_f32(a_lo, d_lo), q_hi = vdivq_f32(a_hi, d_hi);
+#else
+		// Two Newton-Raphson steps refine the reciprocal estimate to nearly full precision.
+		float32x4_t r_lo = vrecpeq_f32(d_lo), r_hi = vrecpeq_f32(d_hi);
+		r_lo = vmulq_f32(vrecpsq_f32(d_lo, r_lo), r_lo);
+		r_hi = vmulq_f32(vrecpsq_f32(d_hi, r_hi), r_hi);
+		r_lo = vmulq_f32(vrecpsq_f32(d_lo, r_lo), r_lo);
+		r_hi = vmulq_f32(vrecpsq_f32(d_hi, r_hi), r_hi);
+		float32x4_t q_lo = vmulq_f32(a_lo, r_lo), q_hi = vmulq_f32(a_hi, r_hi);
+#endif
+		uint16x8_t result = vcombine_u16(vmovn_u32(vcvtq_u32_f32(q_lo)), vmovn_u32(vcvtq_u32_f32(q_hi)));
+		vst1_u8(dest + x, vmovn_u16(result));
+	}
+#elif defined(__SSSE3__)
+	__m128i zero = _mm_setzero_si128();
+	__m128 half = _mm_set1_ps(0.5);
+	for (; x + 8 <= w; x += 8)
+	{
+		__m128i num_lo = zero, num_hi = zero, den = zero;
+		for (unsigned int i = 0; i < n; i++)
+		{
+			__m128i wt = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *)(weight[i] + x)), zero);
+			__m128i pixels = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *)(src[i] + x)), zero);
+			__m128i product = _mm_mullo_epi16(pixels, wt); // at most 255 * 255, so no overflow
+			num_lo = _mm_add_epi32(num_lo, _mm_unpacklo_epi16(product, zero));
+			num_hi = _mm_add_epi32(num_hi, _mm_unpackhi_epi16(product, zero));
+			den = _mm_add_epi16(den, wt);
+		}
+		__m128i den_lo = _mm_unpacklo_epi16(den, zero), den_hi = _mm_unpackhi_epi16(den, zero);
+		__m128 a_lo = _mm_add_ps(_mm_cvtepi32_ps(_mm_add_epi32(num_lo, _mm_srli_epi32(den_lo, 1))), half);
+		__m128 a_hi = _mm_add_ps(_mm_cvtepi32_ps(_mm_add_epi32(num_hi, _mm_srli_epi32(den_hi, 1))), half);
+		__m128i q_lo = _mm_cvttps_epi32(_mm_div_ps(a_lo, _mm_cvtepi32_ps(den_lo)));
+		__m128i q_hi = _mm_cvttps_epi32(_mm_div_ps(a_hi, _mm_cvtepi32_ps(den_hi)));
+		__m128i result = _mm_packs_epi32(q_lo, q_hi);
+		_mm_storel_epi64((__m128i *)(dest + x), _mm_packus_epi16(result, result));
+	}
+#endif
+	uint8_t const *src_tail[MAX_FRAMES], *weight_tail[MAX_FRAMES];
+	for (unsigned int i = 0; i < n; i++)
+		src_tail[i] = src[i] + x, weight_tail[i] = weight[i] + x;
+	fuse_row_scalar(src_tail, weight_tail, n, w - x, dest + x);
+}
+
+// How well exposed each Y value is: a Gaussian around mid-grey, as in Mertens et al.'s
+// exposure fusion. It never reaches zero, so every pixel has some weight.
+static uint8_t const *well_exposed_table()
+{
+	static const std::array<uint8_t, 256> table = []() {
+		std::array<uint8_t, 256> t;
+		for (int i = 0; i < 256; i++)
+		{
+			double d = (i - 127.5) / 255;
+			t[i] = std::max(1.0, std::round(255 * std::exp(-d * d / (2 * 0.2 * 0.2))));
+		}
+		return t;
+	}();
+	return table.data();
+}
+
+void fuse_yuv420(std::vector<uint8_t const *> const &frames, unsigned int w, unsigned int h, unsigned int stride,
+				 uint8_t *dest)
+{
+	unsigned int n = frames.size();
+	if (n == 0 || n > MAX_FRAMES)
+		throw std::runtime_error("can only fuse between 1 and " + std::to_string(MAX_FRAMES) + " frames");
+	uint8_t const *table = well_exposed_table();
+	unsigned int uv_stride = stride / 2;
+	size_t u_offset = stride * h, v_offset = u_offset + uv_stride * (h / 2);
+
+	// Each band is some number of pairs of Y rows and the U and V rows that go with them.
+	parallel_for(h / 2, [&](unsigned int begin, unsigned int end) {
+		std::vector<uint8_t> weights(n * w);
+		uint8_t const *src[MAX_FRAMES], *weight[MAX_FRAMES];
+		for (unsigned int i = 0; i < n; i++)
+			weight[i] = &weights[i * w];
+		for (unsigned int j = begin; j < end; j++)
+		{
+			for (unsigned int y = 2 * j; y < 2 * j + 2; y++)
+			{
+				for (unsigned int i = 0; i < n; i++)
+				{
+					src[i] = frames[i] + y * stride;
+					for (unsigned int x = 0; x < w; x++)
+						weights[i * w + x] = table[src[i][x]];
+				}
+				fuse_row(src, weight, n, w, dest + y * stride);
+			}
+			// The chroma reuses the weights of the second luma row, subsampled in place.
+			for (unsigned int i = 0; i < n; i++)
+			{
+				for (unsigned int x = 0; x < w / 2; x++)
+					weights[i * w + x] = weights[i * w + 2 * x];
+			}
+			for (size_t offset : { u_offset, v_offset })
+			{
+				for (unsigned int i = 0; i < n; i++)
+					src[i] = frames[i] + offset + j * uv_stride;
+				fuse_row(src, weight, n, w / 2, dest + offset + j * uv_stride);
+			}
+		}
+	});
+}
+
+void merge_raw(std::vector<uint8_t const *> const &frames, std::vector<float> const &ratios,
+			   libcamera::PixelFormat const &pixel_format, unsigned int w, unsigned int h, unsigned int stride,
+			   unsigned int black_level, uint16_t *dest)
+{
+	unsigned int n = frames.size();
+	if (n == 0 || n != ratios.size())
+		throw std::runtime_error("merge_raw needs an exposure ratio for every frame");
+	unsigned int bits;
+	unpacked_bayer_format(pixel_format, &bits);
+	void (*unpack_row)(uint8_t const *, unsigned int, uint16_t *) = bits == 10 ? unpack_10bit_row : unpack_12bit_row;
+	unsigned int shift = 16 - bits;
+	// Pixels this close to the top of the range may have clipped, so we don't trust them.
+	uint16_t saturation = ((1 << bits) - 1) * 15 / 16;
+	unsigned int shortest = std::min_element(ratios.begin(), ratios.end()) - ratios.begin();
+
+	parallel_for(h, [&](unsigned int begin, unsigned int end) {
+		std::vector<uint16_t> rows(n * w);
+		for (unsigned int y = begin; y < end; y++)
+		{
+			for (unsigned int i = 0; i < n; i++)
+				unpack_row(frames[i] + y * stride, w, &rows[i * w]);
+			uint16_t *out = dest + y * w;
+			for (unsigned int x = 0; x < w; x++)
+			{
+				// Dividing the sum of the signals by the sum of the exposures weights each
+				// frame by its exposure, which suits the shot noise.
+				float total = 0, ratio_sum = 0;
+				for (unsigned int i = 0; i < n; i++)
+				{
+					uint16_t value = rows[i * w + x];
+					if (value < saturation)
+					{
+						total += (int)(value << shift) - (int)black_level;
+						ratio_sum += ratios[i];
+					}
+				}
+				float value = ratio_sum ? black_level + total / ratio_sum : rows[shortest * w + x] << shift;
+				out[x] = std::clamp(value + 0.5f, 0.0f, 65535.0f);
+			}
+		}
+	});
+}
@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * exposure_fusion.hpp - combine frames taken at different exposures into one image.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <libcamera/pixel_format.h>
+
+// Blend one row from each of n images (n at most 8). Every output pixel is the
+// average of the inputs weighted by the matching entries of the weight rows, which
+// must not all be zero. This uses NEON or SSSE3 where available.
+void fuse_row(uint8_t const *const *src, uint8_t const *const *weight, unsigned int n, unsigned int w, uint8_t *dest);
+
+// Plain C version of the above, used as the fallback and for benchmarking.
+void fuse_row_scalar(uint8_t const *const *src, uint8_t const *const *weight, unsigned int n, unsigned int w,
+					 uint8_t *dest);
+
+// Fuse up to 8 YUV420 images of the same scene into dest, which has the same layout.
+// Each pixel is weighted by how well exposed it is in each image, so that the
+// result keeps the detail in both the highlights and the shadows.
+void fuse_yuv420(std::vector<uint8_t const *> const &frames, unsigned int w, unsigned int h, unsigned int stride,
+				 uint8_t *dest);
+
+// Merge packed raw frames into a 16-bit linear image (in the unpacked format that
+// unpacked_bayer_format gives) with the brightness of the shortest exposure.
+// ratios gives each frame's exposure relative to that one, so the smallest is 1.
+// Every pixel is estimated from the frames where it isn't saturated. black_level
+// is in 16-bit units.
+void merge_raw(std::vector<uint8_t const *> const &frames, std::vector<float> const &ratios,
+			   libcamera::PixelFormat const &pixel_format, unsigned int w, unsigned int h, unsigned int stride,
+			   unsigned int black_level, uint16_t *dest);
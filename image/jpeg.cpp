@@ -23,6 +23,8 @@
 
 #include "core/still_options.hpp"
 
+#include "jpeg.hpp"
+
 #if JPEG_LIB_VERSION_MAJOR > 9 || (JPEG_LIB_VERSION_MAJOR == 9 && JPEG_LIB_VERSION_MINOR >= 4)
 typedef size_t jpeg_mem_len_t;
 #else
@@ -250,60 +252,6 @@ void exif_read_tag(ExifData *exif, char const *str)
 	}
 }
 
-static void YUYV_to_JPEG(const uint8_t *input, const int input_width, const int input_height, const int stride,
-						 const int output_width, const int output_height, const int quality, const unsigned int restart,
-						 uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len)
-{
-	struct jpeg_compress_struct cinfo;
-	struct jpeg_error_mgr jerr;
-
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_compress(&cinfo);
-
-	cinfo.image_width = output_width;
-	cinfo.image_height = output_height;
-	cinfo.input_components = 3;
-	cinfo.in_color_space = JCS_YCbCr;
-	cinfo.restart_interval = restart;
-
-	jpeg_set_defaults(&cinfo);
-	jpeg_set_quality(&cinfo, quality, TRUE);
-	jpeg_buffer = NULL;
-	jpeg_len = 0;
-	jpeg_mem_dest(&cinfo, &jpeg_buffer, &jpeg_len);
-	jpeg_start_compress(&cinfo, TRUE);
-
-	const unsigned int output_width3 = 3 * output_width;
-	std::vector<uint8_t> tmp_row(output_width3);
-	JSAMPROW jrow[1];
-	jrow[0] = &tmp_row[0];
-
-	// Pre-calculate the horizontal offsets to speed up the main loop.
-	std::vector<unsigned int> h_offset(output_width3);
-	for (unsigned int i = 0, k = 0; i < output_width; i++)
-	{
-		unsigned int off = (i * input_width) / output_width * 2;
-		unsigned int off_align = off & ~3;
-		h_offset[k++] = off;
-		h_offset[k++] = off_align + 1;
-		h_offset[k++] = off_align + 3;
-	}
-	while (cinfo.next_scanline < output_height)
-	{
-		unsigned int offset = ((cinfo.next_scanline * input_height) / output_height) * stride;
-		for (unsigned int k = 0; k < output_width3; k += 3)
-		{
-			tmp_row[k] = input[offset + h_offset[k]];
-			tmp_row[k + 1] = input[offset + h_offset[k + 1]];
-			tmp_row[k + 2] = input[offset + h_offset[k + 2]];
-		}
-		jpeg_write_scanlines(&cinfo, jrow, 1);
-	}
-
-	jpeg_finish_compress(&cinfo);
-	jpeg_destroy_compress(&cinfo);
-}
-
 static void YUV420_to_JPEG_fast(const uint8_t *input, const int width, const int height, const int stride,
 								const int quality, const unsigned int restart, uint8_t *&jpeg_buffer,
 								jpeg_mem_len_t &jpeg_len)
@@ -375,11 +323,57 @@ static void YUV420_to_JPEG_fast(const uint8_t *input, const int width, const int
 	jpeg_destroy_compress(&cinfo);
 }
 
-static void YUV420_to_JPEG(const uint8_t *input, const int input_width, const int input_height, const int stride,
-						   const int output_width, const int output_height, const int quality,
-						   const unsigned int restart, uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len)
+// Each layout knows where to find the Y, U and V samples for a row and column of
+// the input, so that the compiler generates a specialised scaling loop per format.
+struct YuyvLayout
+{
+	static constexpr bool PLANAR_420 = false;
+	YuyvLayout(const uint8_t *input, int height, int stride) : input_(input), stride_(stride) {}
+	void Rows(unsigned int row, unsigned int in_height, unsigned int out_height, const uint8_t *&y, const uint8_t *&u,
+			  const uint8_t *&v) const
+	{
+		y = u = v = input_ + ((row * in_height) / out_height) * stride_;
+	}
+	static void Columns(unsigned int col, unsigned int *offsets)
+	{
+		unsigned int off = col * 2, off_align = off & ~3;
+		offsets[0] = off;
+		offsets[1] = off_align + 1;
+		offsets[2] = off_align + 3;
+	}
+	const uint8_t *input_;
+	int stride_;
+};
+
+struct Yuv420Layout
 {
-	if (input_width == output_width && input_height == output_height)
+	static constexpr bool PLANAR_420 = true;
+	Yuv420Layout(const uint8_t *input, int height, int stride)
+		: Y_(input), U_(Y_ + stride * height), V_(U_ + (stride / 2) * (height / 2)), stride_(stride)
+	{
+	}
+	void Rows(unsigned int row, unsigned int in_height, unsigned int out_height, const uint8_t *&y, const uint8_t *&u,
+			  const uint8_t *&v) const
+	{
+		y = Y_ + ((row * in_height) / out_height) * stride_;
+		u = U_ + (((row / 2) * in_height) / out_height) * (stride_ / 2);
+		v = V_ + (((row / 2) * in_height) / out_height) * (stride_ / 2);
+	}
+	static void Columns(unsigned int col, unsigned int *offsets)
+	{
+		offsets[0] = col;
+		offsets[1] = offsets[2] = col / 2;
+	}
+	const uint8_t *Y_, *U_, *V_;
+	int stride_;
+};
+
+template <typename Layout>
+static void YUV_to_JPEG(const uint8_t *input, const int input_width, const int input_height, const int stride,
+						const int output_width, const int output_height, const int quality, const unsigned int restart,
+						uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len)
+{
+	if (Layout::PLANAR_420 && input_width == output_width && input_height == output_height)
 	{
 		YUV420_to_JPEG_fast(input, input_width, input_height, stride, quality, restart, jpeg_buffer, jpeg_len);
 		return;
@@ -409,28 +403,22 @@ static void YUV420_to_JPEG(const uint8_t *input, const int input_width, const in
 	JSAMPROW jrow[1];
 	jrow[0] = &tmp_row[0];
 
-	const uint8_t *Y = input;
-	const uint8_t *U = Y + stride * input_height;
-	const uint8_t *V = U + (stride / 2) * (input_height / 2);
+	const Layout layout(input, input_height, stride);
 
 	// Pre-calculate the horizontal offsets to speed up the main loop.
 	std::vector<unsigned int> h_offset(output_width3);
-	for (unsigned int i = 0, k = 0; i < output_width; i++)
-	{
-		unsigned int off = (i * input_width) / output_width;
-		h_offset[k++] = off;
-		h_offset[k++] = off / 2;
-		h_offset[k++] = off / 2;
-	}
-	while (cinfo.next_scanline < output_height)
+	for (unsigned int i = 0; i < (unsigned int)output_width; i++)
+		Layout::Columns((i * input_width) / output_width, &h_offset[3 * i]);
+
+	while (cinfo.next_scanline < (unsigned int)output_height)
 	{
-		unsigned int offset = ((cinfo.next_scanline * input_height) / output_height) * stride;
-		unsigned int offset_uv = (((cinfo.next_scanline / 2) * input_height) / output_height) * (stride / 2);
+		const uint8_t *Y, *U, *V;
+		layout.Rows(cinfo.next_scanline, input_height, output_height, Y, U, V);
 		for (unsigned int k = 0; k < output_width3; k += 3)
 		{
-			tmp_row[k] = Y[offset + h_offset[k]];
-			tmp_row[k + 1] = U[offset_uv + h_offset[k + 1]];
-			tmp_row[k + 2] = V[offset_uv + h_offset[k + 2]];
+			tmp_row[k] = Y[h_offset[k]];
+			tmp_row[k + 1] = U[h_offset[k + 1]];
+			tmp_row[k + 2] = V[h_offset[k + 2]];
 		}
 		jpeg_write_scanlines(&cinfo, jrow, 1);
 	}
@@ -439,22 +427,29 @@ static void YUV420_to_JPEG(const uint8_t *input, const int input_width, const in
 	jpeg_destroy_compress(&cinfo);
 }
 
+typedef void (*YuvToJpegFn)(const uint8_t *input, const int input_width, const int input_height, const int stride,
+							const int output_width, const int output_height, const int quality,
+							const unsigned int restart, uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len);
+
+// Adding a YUV format only needs a new layout and an entry here.
+static const std::map<PixelFormat, YuvToJpegFn> yuv_to_jpeg_fns = {
+	{ libcamera::formats::YUYV, YUV_to_JPEG<YuyvLayout> },
+	{ libcamera::formats::YUV420, YUV_to_JPEG<Yuv420Layout> },
+};
+
 static void YUV_to_JPEG(PixelFormat const &pixel_format, const uint8_t *input, const int input_width,
 						const int input_height, const int stride, const int output_width, const int output_height,
 						const int quality, const unsigned int restart, uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len)
 {
-	if (pixel_format == libcamera::formats::YUYV)
-		YUYV_to_JPEG(input, input_width, input_height, stride, output_width, output_height, quality, restart,
-					 jpeg_buffer, jpeg_len);
-	else if (pixel_format == libcamera::formats::YUV420)
-		YUV420_to_JPEG(input, input_width, input_height, stride, output_width, output_height, quality, restart,
-					   jpeg_buffer, jpeg_len);
-	else
+	auto it = yuv_to_jpeg_fns.find(pixel_format);
+	if (it == yuv_to_jpeg_fns.end())
 		throw std::runtime_error("unsupported YUV format in JPEG encode");
+	it->second(input, input_width, input_height, stride, output_width, output_height, quality, restart, jpeg_buffer,
+			   jpeg_len);
 }
 
 static void create_exif_data(PixelFormat const &pixel_format, std::vector<void *> const &mem, int w, int h, int stride,
-							 ControlList const &metadata, std::string const &cam_name, StillOptions const *options,
+							 ControlList const &metadata, std::string const &cam_name, JpegParams const &params,
 							 uint8_t *&exif_buffer, unsigned int &exif_len, uint8_t *&thumb_buffer,
 							 jpeg_mem_len_t &thumb_len)
 {
@@ -490,7 +485,7 @@ static void create_exif_data(PixelFormat const &pixel_format, std::vector<void *
 		{
 			entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_EXPOSURE_TIME);
 			int32_t exposure_time = metadata.get(libcamera::controls::ExposureTime);
-			if (options->verbose)
+			if (params.verbose)
 				std::cout << "Exposure time: " << exposure_time << std::endl;
 			ExifRational exposure = { (ExifLong)exposure_time, 1000000 };
 			exif_set_rational(entry->data, exif_byte_order, exposure);
@@ -502,15 +497,15 @@ static void create_exif_data(PixelFormat const &pixel_format, std::vector<void *
 			if (metadata.contains(libcamera::controls::DigitalGain))
 				dg = metadata.get(libcamera::controls::DigitalGain);
 			gain = ag * dg;
-			if (options->verbose)
+			if (params.verbose)
 				std::cout << "Ag " << ag << " Dg " << dg << " Total " << gain << std::endl;
 			exif_set_short(entry->data, exif_byte_order, 100 * gain);
 		}
 
 		// Command-line supplied tags.
-		for (auto &exif_item : options->exif)
+		for (auto &exif_item : params.exif)
 		{
-			if (options->verbose)
+			if (params.verbose)
 				std::cout << "Processing EXIF item: " << exif_item << std::endl;
 			exif_read_tag(exif, exif_item.c_str());
 		}
@@ -518,13 +513,13 @@ static void create_exif_data(PixelFormat const &pixel_format, std::vector<void *
 		// Add some tags for the thumbnail. We put in dummy values for the thumbnail
 		// offset/length to occupy the right amount of space, and fill them in later.
 
-		if (options->verbose)
-			std::cout << "Thumbnail dimensions are " << options->thumb_width << " x " << options->thumb_height
+		if (params.verbose)
+			std::cout << "Thumbnail dimensions are " << params.thumb_width << " x " << params.thumb_height
 					  << std::endl;
 		entry = exif_create_tag(exif, EXIF_IFD_1, EXIF_TAG_IMAGE_WIDTH);
-		exif_set_short(entry->data, exif_byte_order, options->thumb_width);
+		exif_set_short(entry->data, exif_byte_order, params.thumb_width);
 		entry = exif_create_tag(exif, EXIF_IFD_1, EXIF_TAG_IMAGE_LENGTH);
-		exif_set_short(entry->data, exif_byte_order, options->thumb_height);
+		exif_set_short(entry->data, exif_byte_order, params.thumb_height);
 		entry = exif_create_tag(exif, EXIF_IFD_1, EXIF_TAG_COMPRESSION);
 		exif_set_short(entry->data, exif_byte_order, 6);
 		ExifEntry *thumb_offset_entry = exif_create_tag(exif, EXIF_IFD_1, EXIF_TAG_JPEG_INTERCHANGE_FORMAT);
@@ -542,17 +537,17 @@ static void create_exif_data(PixelFormat const &pixel_format, std::vector<void *
 		// Next create the JPEG for the thumbnail, we need to do this now so that we can
 		// go back and fill in the correct values for the thumbnail offsets/length.
 
-		int q = options->thumb_quality;
+		int q = params.thumb_quality;
 		for (; q > 0; q -= 5)
 		{
-			YUV_to_JPEG(pixel_format, (uint8_t *)(mem[0]), w, h, stride, options->thumb_width, options->thumb_height, q,
+			YUV_to_JPEG(pixel_format, (uint8_t *)(mem[0]), w, h, stride, params.thumb_width, params.thumb_height, q,
 						0, thumb_buffer, thumb_len);
 			if (thumb_len < 60000) // entire EXIF data must be < 65536, so this should be safe
 				break;
 			free(thumb_buffer);
 			thumb_buffer = nullptr;
 		}
-		if (options->verbose)
+		if (params.verbose)
 			std::cout << "Thumbnail size " << thumb_len << std::endl;
 		if (q <= 0)
 			throw std::runtime_error("failed to make acceptable thumbnail");
@@ -583,7 +578,7 @@ static void create_exif_data(PixelFormat const &pixel_format, std::vector<void *
 
 void jpeg_save(std::vector<void *> const &mem, int w, int h, int stride, PixelFormat const &pixel_format,
 			   ControlList const &metadata, std::string const &filename, std::string const &cam_name,
-			   StillOptions const *options)
+			   JpegParams const &params)
 {
 	FILE *fp = nullptr;
 	uint8_t *thumb_buffer = nullptr;
@@ -601,25 +596,25 @@ void jpeg_save(std::vector<void *> const &mem, int w, int h, int stride, PixelFo
 
 		jpeg_mem_len_t thumb_len;
 		unsigned int exif_len;
-		create_exif_data(pixel_format, mem, w, h, stride, metadata, cam_name, options, exif_buffer, exif_len,
+		create_exif_data(pixel_format, mem, w, h, stride, metadata, cam_name, params, exif_buffer, exif_len,
 						 thumb_buffer, thumb_len);
 
 		// Make the full size JPEG (could probably be more efficient if we had
 		// YUV422 or YUV420 planar format).
 
 		jpeg_mem_len_t jpeg_len;
-		YUV_to_JPEG(pixel_format, (uint8_t *)(mem[0]), w, h, stride, w, h, options->quality, options->restart,
+		YUV_to_JPEG(pixel_format, (uint8_t *)(mem[0]), w, h, stride, w, h, params.quality, params.restart,
 					jpeg_buffer, jpeg_len);
-		if (options->verbose)
+		if (params.verbose)
 			std::cout << "JPEG size is " << jpeg_len << std::endl;
 
 		// Write everything out.
 
 		fp = fopen(filename.c_str(), "w");
 		if (!fp)
-			throw std::runtime_error("failed to open file " + options->output);
+			throw std::runtime_error("failed to open file " + filename);
 
-		if (options->verbose)
+		if (params.verbose)
 			std::cout << "EXIF data len " << exif_len << std::endl;
 
 		if (fwrite(exif_header, sizeof(exif_header), 1, fp) != 1 || fputc((exif_len + thumb_len + 2) >> 8, fp) == EOF ||
@@ -648,3 +643,18 @@ void jpeg_save(std::vector<void *> const &mem, int w, int h, int stride, PixelFo
 		throw;
 	}
 }
+
+void jpeg_save(std::vector<void *> const &mem, int w, int h, int stride, PixelFormat const &pixel_format,
+			   ControlList const &metadata, std::string const &filename, std::string const &cam_name,
+			   StillOptions const *options)
+{
+	JpegParams params;
+	params.verbose = options->verbose;
+	params.quality = options->quality;
+	params.restart = options->restart;
+	params.thumb_width = options->thumb_width;
+	params.thumb_height = options->thumb_height;
+	params.thumb_quality = options->thumb_quality;
+	params.exif = options->exif;
+	jpeg_save(mem, w, h, stride, pixel_format, metadata, filename, cam_name, params);
+}
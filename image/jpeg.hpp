@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * jpeg.hpp - write JPEG files.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <libcamera/controls.h>
+#include <libcamera/pixel_format.h>
+
+// How to make a JPEG file. The JPEG saver fills these in from the StillOptions, and
+// applications without a StillOptions can fill them in for themselves.
+struct JpegParams
+{
+	bool verbose = false;
+	int quality = 93;
+	unsigned int restart = 0;
+	unsigned int thumb_width = 320;
+	unsigned int thumb_height = 240;
+	unsigned int thumb_quality = 70;
+	std::vector<std::string> exif; // extra EXIF tags, as given to the --exif option
+};
+
+// Save a YUV image as a JPEG file, with EXIF data and a thumbnail.
+void jpeg_save(std::vector<void *> const &mem, int w, int h, int stride, libcamera::PixelFormat const &pixel_format,
+			   libcamera::ControlList const &metadata, std::string const &filename, std::string const &cam_name,
+			   JpegParams const &params);
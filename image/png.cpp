@@ -6,20 +6,100 @@
  */
 
 #include <cstdio>
+#include <cstring>
 #include <string>
+#include <thread>
 
 #include <libcamera/formats.h>
 #include <libcamera/pixel_format.h>
 
 #include <png.h>
+#include <zlib.h>
 
+#include "core/parallel.hpp"
 #include "core/still_options.hpp"
 
-void png_save(std::vector<void *> const &mem, int w, int h, int stride, libcamera::PixelFormat const &pixel_format,
-			  std::string const &filename, StillOptions const *options)
+#include "png.hpp"
+#include "yuv2rgb.hpp"
+
+// We compress the image in bands of rows, each band on its own thread, much like
+// pigz does. Each band is its own raw deflate stream that ends with a full flush
+// (or finishes, for the last band), so the results can simply be concatenated
+// behind a zlib header to give one valid stream. Because every band starts with
+// an empty dictionary we lose a tiny amount of compression at each join.
+struct PngBand
 {
-	if (pixel_format != libcamera::formats::BGR888)
-		throw std::runtime_error("pixel format for png should be BGR");
+	std::vector<uint8_t> data;
+	uLong adler;
+	size_t length; // uncompressed bytes, including the filter type bytes
+};
+
+// Apply the "average" filter to a row of RGB pixels. prev may be null for the first row.
+static void png_filter_avg(uint8_t const *row, uint8_t const *prev, int bytes, uint8_t *dest)
+{
+	dest[0] = PNG_FILTER_VALUE_AVG;
+	dest++;
+	if (prev)
+	{
+		for (int i = 0; i < 3; i++)
+			dest[i] = row[i] - (prev[i] >> 1);
+		for (int i = 3; i < bytes; i++)
+			dest[i] = row[i] - ((row[i - 3] + prev[i]) >> 1);
+	}
+	else
+	{
+		std::memcpy(dest, row, 3);
+		for (int i = 3; i < bytes; i++)
+			dest[i] = row[i] - (row[i - 3] >> 1);
+	}
+}
+
+static void png_compress_band(RgbRowReader const &reader, int first_row, int num_rows, bool last, PngBand &band)
+{
+	z_stream z = {};
+	if (deflateInit2(&z, 1, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		throw std::runtime_error("failed to initialise deflate");
+
+	int bytes = reader.Width() * 3;
+	std::vector<uint8_t> filtered(bytes + 1);
+	std::vector<uint8_t> row_bufs[2] = { std::vector<uint8_t>(bytes), std::vector<uint8_t>(bytes) };
+	band.data.resize(deflateBound(&z, (bytes + 1) * num_rows) + 64);
+	band.adler = adler32(0, nullptr, 0);
+	band.length = 0;
+	z.next_out = band.data.data();
+	z.avail_out = band.data.size();
+
+	// The row above the band goes in the buffer that the band's first row won't use.
+	uint8_t const *prev = first_row ? reader.Row(first_row - 1, row_bufs[(first_row - 1) & 1].data()) : nullptr;
+	for (int y = first_row; y < first_row + num_rows; y++)
+	{
+		uint8_t const *row = reader.Row(y, row_bufs[y & 1].data());
+		png_filter_avg(row, prev, bytes, filtered.data());
+		prev = row;
+		band.adler = adler32(band.adler, filtered.data(), filtered.size());
+		band.length += filtered.size();
+
+		int flush = y < first_row + num_rows - 1 ? Z_NO_FLUSH : (last ? Z_FINISH : Z_FULL_FLUSH);
+		z.next_in = filtered.data();
+		z.avail_in = filtered.size();
+		int ret = deflate(&z, flush);
+		if (ret == Z_STREAM_ERROR || z.avail_in || (flush == Z_FINISH && ret != Z_STREAM_END))
+		{
+			deflateEnd(&z);
+			throw std::runtime_error("failed to deflate png data");
+		}
+	}
+
+	band.data.resize(z.total_out);
+	deflateEnd(&z);
+}
+
+void png_save_bands(std::vector<void *> const &mem, int w, int h, int stride,
+					libcamera::PixelFormat const &pixel_format, std::string const &filename,
+					StillOptions const *options, unsigned int num_bands)
+{
+	// PNG wants R, G, B in memory, which is what libcamera calls BGR888.
+	RgbRowReader reader(mem, w, h, stride, pixel_format, libcamera::formats::BGR888, options->colour_space);
 
 	FILE *fp = fopen(filename.c_str(), "wb");
 	png_structp png_ptr = NULL;
@@ -45,19 +125,59 @@ void png_save(std::vector<void *> const &mem, int w, int h, int stride, libcamer
 		// Set image attributes.
 		png_set_IHDR(png_ptr, info_ptr, w, h, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
 					 PNG_FILTER_TYPE_DEFAULT);
-		// These settings get us most of the compression, but are much faster.
-		png_set_filter(png_ptr, 0, PNG_FILTER_AVG);
-		png_set_compression_level(png_ptr, 1);
 
-		// Set up the image data.
-		png_byte **row_ptrs = (png_byte **)png_malloc(png_ptr, h * sizeof(png_byte *));
-		png_byte *row = (uint8_t *)mem[0];
-		for (int i = 0; i < h; i++, row += stride)
-			row_ptrs[i] = row;
+		// Filter and compress the bands in parallel. As before, the "average" filter and
+		// the fastest compression level get us most of the compression, but much faster.
+		if (num_bands == 0)
+			num_bands = std::max(std::thread::hardware_concurrency(), 1u);
+		num_bands = std::min<unsigned int>(num_bands, h);
+		std::vector<PngBand> bands(num_bands);
+		// Each band records its own error, so the threads never share one.
+		std::vector<std::string> errors(num_bands);
+		parallel_for(num_bands, [&](unsigned int begin, unsigned int end) {
+			for (unsigned int i = begin; i < end; i++)
+			{
+				try
+				{
+					int first_row = h * i / num_bands, num_rows = h * (i + 1) / num_bands - first_row;
+					png_compress_band(reader, first_row, num_rows, i == bands.size() - 1, bands[i]);
+				}
+				catch (std::exception const &e)
+				{
+					errors[i] = e.what();
+				}
+			}
+		});
+		for (std::string const &error : errors)
+		{
+			if (!error.empty())
+				throw std::runtime_error(error);
+		}
+
+		// Stitch the bands into a single IDAT chunk, libpng working out the chunk CRC as
+		// we go. The zlib trailer needs the Adler-32 of all the bands combined.
+		uLong adler = bands[0].adler;
+		png_uint_32 idat_length = 2 + 4;
+		for (unsigned int i = 0; i < num_bands; i++)
+		{
+			if (i)
+				adler = adler32_combine(adler, bands[i].adler, bands[i].length);
+			idat_length += bands[i].data.size();
+		}
+		const png_byte zlib_header[] = { 0x78, 0x01 };
+		const png_byte zlib_trailer[] = { (png_byte)(adler >> 24), (png_byte)(adler >> 16), (png_byte)(adler >> 8),
+										  (png_byte)adler };
 
 		png_init_io(png_ptr, fp);
-		png_set_rows(png_ptr, info_ptr, row_ptrs);
-		png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+		png_write_info(png_ptr, info_ptr);
+		png_write_chunk_start(png_ptr, (png_const_bytep) "IDAT", idat_length);
+		png_write_chunk_data(png_ptr, zlib_header, sizeof(zlib_header));
+		for (auto &band : bands)
+			png_write_chunk_data(png_ptr, band.data.data(), band.data.size());
+		png_write_chunk_data(png_ptr, zlib_trailer, sizeof(zlib_trailer));
+		png_write_chunk_end(png_ptr);
+		png_write_chunk(png_ptr, (png_const_bytep) "IEND", NULL, 0);
+		fflush(fp);
 
 		if (options->verbose)
 		{
@@ -66,7 +186,6 @@ void png_save(std::vector<void *> const &mem, int w, int h, int stride, libcamer
 		}
 
 		// Free and close everything and we're done.
-		png_free(png_ptr, row_ptrs);
 		png_destroy_write_struct(&png_ptr, &info_ptr);
 		fclose(fp);
 	}
@@ -79,3 +198,9 @@ void png_save(std::vector<void *> const &mem, int w, int h, int stride, libcamer
 		throw;
 	}
 }
+
+void png_save(std::vector<void *> const &mem, int w, int h, int stride, libcamera::PixelFormat const &pixel_format,
+			  std::string const &filename, StillOptions const *options)
+{
+	png_save_bands(mem, w, h, stride, pixel_format, filename, options, 0);
+}
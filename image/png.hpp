@@ -0,0 +1,21 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * png.hpp - write PNG files.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <libcamera/pixel_format.h>
+
+struct StillOptions;
+
+// Write a PNG file exactly as png_save does, but compressing the image in num_bands bands of
+// rows, which are shared between the cores (0 means one band per core).
+void png_save_bands(std::vector<void *> const &mem, int w, int h, int stride,
+					libcamera::PixelFormat const &pixel_format, std::string const &filename,
+					StillOptions const *options, unsigned int num_bands);
@@ -0,0 +1,119 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * raw_stack.cpp - accumulate several raw frames into one low-noise image.
+ */
+
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+#include <libcamera/formats.h>
+
+#include "core/parallel.hpp"
+
+#include "raw_stack.hpp"
+#include "unpack.hpp"
+
+using namespace libcamera;
+
+void accumulate_row_scalar(uint16_t const *src, unsigned int w, uint32_t *acc)
+{
+	for (unsigned int x = 0; x < w; x++)
+		acc[x] += src[x];
+}
+
+void accumulate_row(uint16_t const *src, unsigned int w, uint32_t *acc)
+{
+	unsigned int x = 0;
+#if defined(__ARM_NEON)
+	for (; x + 8 <= w; x += 8)
+	{
+		uint16x8_t pixels = vld1q_u16(src + x);
+		vst1q_u32(acc + x, vaddw_u16(vld1q_u32(acc + x), vget_low_u16(pixels)));
+		vst1q_u32(acc + x + 4, vaddw_u16(vld1q_u32(acc + x + 4), vget_high_u16(pixels)));
+	}
+#elif defined(__SSSE3__)
+	__m128i zero = _mm_setzero_si128();
+	for (; x + 8 <= w; x += 8)
+	{
+		__m128i pixels = _mm_loadu_si128((__m128i const *)(src + x));
+		__m128i *lo = (__m128i *)(acc + x), *hi = (__m128i *)(acc + x + 4);
+		_mm_storeu_si128(lo, _mm_add_epi32(_mm_loadu_si128(lo), _mm_unpacklo_epi16(pixels, zero)));
+		_mm_storeu_si128(hi, _mm_add_epi32(_mm_loadu_si128(hi), _mm_unpackhi_epi16(pixels, zero)));
+	}
+#endif
+	accumulate_row_scalar(src + x, w - x, acc + x);
+}
+
+struct StackFormat
+{
+	unsigned int bits;
+	PixelFormat output_format;
+};
+
+static const std::map<PixelFormat, StackFormat> stack_formats =
+{
+	{ formats::SRGGB10_CSI2P, { 10, formats::SRGGB16 } },
+	{ formats::SGRBG10_CSI2P, { 10, formats::SGRBG16 } },
+	{ formats::SBGGR10_CSI2P, { 10, formats::SBGGR16 } },
+	{ formats::SGBRG10_CSI2P, { 10, formats::SGBRG16 } },
+	{ formats::SRGGB12_CSI2P, { 12, formats::SRGGB16 } },
+	{ formats::SGRBG12_CSI2P, { 12, formats::SGRBG16 } },
+	{ formats::SBGGR12_CSI2P, { 12, formats::SBGGR16 } },
+	{ formats::SGBRG12_CSI2P, { 12, formats::SGBRG16 } },
+};
+
+PixelFormat const &unpacked_bayer_format(PixelFormat const &pixel_format, unsigned int *bits)
+{
+	auto it = stack_formats.find(pixel_format);
+	if (it == stack_formats.end())
+		throw std::runtime_error("unsupported packed Bayer format");
+	*bits = it->second.bits;
+	return it->second.output_format;
+}
+
+RawStack::RawStack(PixelFormat const &pixel_format, unsigned int w, unsigned int h)
+	: output_format_(unpacked_bayer_format(pixel_format, &bits_)), w_(w), h_(h), count_(0), acc_(w * h, 0)
+{
+}
+
+void RawStack::Add(uint8_t const *mem, unsigned int stride)
+{
+	// A 32-bit total can't overflow before 2^20 12-bit frames, so we don't check.
+	void (*unpack_row)(uint8_t const *, unsigned int, uint16_t *) =
+		bits_ == 10 ? unpack_10bit_row : unpack_12bit_row;
+	parallel_for(h_, [&](unsigned int begin, unsigned int end) {
+		std::vector<uint16_t> row(w_);
+		for (unsigned int y = begin; y < end; y++)
+		{
+			unpack_row(mem + y * stride, w_, &row[0]);
+			accumulate_row(&row[0], w_, &acc_[y * w_]);
+		}
+	});
+	count_++;
+}
+
+void RawStack::Result(uint16_t *dest, bool sum, unsigned int black_level) const
+{
+	if (count_ == 0)
+		throw std::runtime_error("no frames have been stacked");
+	unsigned int shift = 16 - bits_;
+	// Everything is done in 64 bits as the scaled totals no longer fit in 32.
+	int64_t offset = sum ? (int64_t)(count_ - 1) * black_level : 0;
+	uint64_t divisor = sum ? 1 : count_;
+	parallel_for(h_, [&](unsigned int begin, unsigned int end) {
+		for (unsigned int i = begin * w_; i < end * w_; i++)
+		{
+			int64_t value = (((int64_t)acc_[i] << shift) - offset + divisor / 2) / (int64_t)divisor;
+			dest[i] = std::clamp<int64_t>(value, 0, 65535);
+		}
+	});
+}
@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * raw_stack.hpp - accumulate several raw frames into one low-noise image.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <libcamera/pixel_format.h>
+
+// Add a row of w 16-bit pixels into a row of 32-bit totals. This uses NEON or
+// SSSE3 where available.
+void accumulate_row(uint16_t const *src, unsigned int w, uint32_t *acc);
+
+// Plain C version of the above, used as the fallback and for benchmarking.
+void accumulate_row_scalar(uint16_t const *src, unsigned int w, uint32_t *acc);
+
+// Return the unpacked 16-bit Bayer format for a packed 10 or 12-bit one, and its
+// bit depth in bits. Throws for any other format.
+libcamera::PixelFormat const &unpacked_bayer_format(libcamera::PixelFormat const &pixel_format, unsigned int *bits);
+
+// Sums packed 10 or 12-bit Bayer frames in a 32-bit accumulator and turns the total
+// back into a single 16-bit Bayer image, which dng_save can write like any other.
+class RawStack
+{
+public:
+	RawStack(libcamera::PixelFormat const &pixel_format, unsigned int w, unsigned int h);
+
+	// Unpack a frame and add it to the total, splitting the rows between threads.
+	void Add(uint8_t const *mem, unsigned int stride);
+
+	// Write the result to dest, which holds w * h pixels scaled to 16 bits. With sum
+	// unset this is the mean of the frames. Otherwise the frames' signals above the
+	// black level (in 16-bit units) are added together, brightening the image
+	// while keeping the black level where the DNG metadata says it is.
+	void Result(uint16_t *dest, bool sum, unsigned int black_level) const;
+
+	// The unpacked 16-bit Bayer format of the result.
+	libcamera::PixelFormat const &OutputFormat() const { return output_format_; }
+	unsigned int Count() const { return count_; }
+
+private:
+	libcamera::PixelFormat output_format_;
+	unsigned int w_, h_, bits_;
+	unsigned int count_;
+	std::vector<uint32_t> acc_;
+};
@@ -0,0 +1,128 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * saver.cpp - find the function that saves a given pixel format and encoding.
+ */
+
+#include <map>
+#include <mutex>
+#include <stdexcept>
+
+#include <libcamera/formats.h>
+
+#include "core/still_options.hpp"
+
+#include "saver.hpp"
+
+using libcamera::ControlList;
+using libcamera::PixelFormat;
+
+// In jpeg.cpp:
+void jpeg_save(std::vector<void *> const &mem, int w, int h, int stride, PixelFormat const &pixel_format,
+			   ControlList const &metadata, std::string const &filename, std::string const &cam_name,
+			   StillOptions const *options);
+
+// In dng.cpp:
+void dng_save(std::vector<void *> const &mem, int w, int h, int stride, PixelFormat const &pixel_format,
+			  ControlList const &metadata, std::string const &filename, std::string const &cam_name,
+			  StillOptions const *options);
+
+// In png.cpp:
+void png_save(std::vector<void *> const &mem, int w, int h, int stride, PixelFormat const &pixel_format,
+			  std::string const &filename, StillOptions const *options);
+
+// In bmp.cpp:
+void bmp_save(std::vector<void *> const &mem, int w, int h, int stride, PixelFormat const &pixel_format,
+			  std::string const &filename, StillOptions const *options);
+
+// In yuv.cpp:
+void yuv420_save(std::vector<void *> const &mem, int w, int h, int stride, std::string const &filename,
+				 StillOptions const *options);
+void yuyv_save(std::vector<void *> const &mem, int w, int h, int stride, std::string const &filename,
+			   StillOptions const *options);
+void rgb_save(std::vector<void *> const &mem, int w, int h, int stride, PixelFormat const &pixel_format,
+			  std::string const &filename, StillOptions const *options);
+
+// Adapt the savers that don't need the metadata or camera name.
+typedef void (*SimpleSaver)(std::vector<void *> const &, int, int, int, PixelFormat const &, std::string const &,
+							StillOptions const *);
+typedef void (*PlanarSaver)(std::vector<void *> const &, int, int, int, std::string const &, StillOptions const *);
+
+template <SimpleSaver F>
+static void simple_saver(std::vector<void *> const &mem, int w, int h, int stride, PixelFormat const &pixel_format,
+						 ControlList const &, std::string const &filename, std::string const &,
+						 StillOptions const *options)
+{
+	F(mem, w, h, stride, pixel_format, filename, options);
+}
+
+template <PlanarSaver F>
+static void planar_saver(std::vector<void *> const &mem, int w, int h, int stride, PixelFormat const &,
+						 ControlList const &, std::string const &filename, std::string const &,
+						 StillOptions const *options)
+{
+	F(mem, w, h, stride, filename, options);
+}
+
+typedef std::pair<PixelFormat, std::string> SaverKey;
+
+class SaverRegistry
+{
+public:
+	static SaverRegistry &Get()
+	{
+		static SaverRegistry registry;
+		return registry;
+	}
+	void Register(PixelFormat const &pixel_format, std::string const &encoding, ImageSaver saver)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		savers_[SaverKey(pixel_format, encoding)] = saver;
+	}
+	ImageSaver Find(PixelFormat const &pixel_format, std::string const &encoding)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto it = savers_.find(SaverKey(pixel_format, encoding));
+		if (it == savers_.end())
+			it = savers_.find(SaverKey(PixelFormat(), encoding));
+		if (it == savers_.end())
+			throw std::runtime_error("no way to save " + pixel_format.toString() + " images with encoding " +
+									 encoding);
+		return it->second;
+	}
+
+private:
+	SaverRegistry()
+	{
+		using namespace libcamera::formats;
+
+		// The RGB savers convert YUV themselves.
+		static const PixelFormat rgb_sources[] = { YUV420, YUYV, BGR888, RGB888 };
+		for (auto const &format : rgb_sources)
+		{
+			savers_[SaverKey(format, "rgb")] = simple_saver<rgb_save>;
+			savers_[SaverKey(format, "png")] = simple_saver<png_save>;
+			savers_[SaverKey(format, "bmp")] = simple_saver<bmp_save>;
+		}
+		savers_[SaverKey(YUV420, "jpg")] = jpeg_save;
+		savers_[SaverKey(YUYV, "jpg")] = jpeg_save;
+		savers_[SaverKey(YUV420, "yuv420")] = planar_saver<yuv420_save>;
+		savers_[SaverKey(YUYV, "yuv420")] = planar_saver<yuyv_save>;
+		// dng_save checks for itself which Bayer formats it understands.
+		savers_[SaverKey(PixelFormat(), "dng")] = dng_save;
+	}
+
+	std::mutex mutex_;
+	std::map<SaverKey, ImageSaver> savers_;
+};
+
+void register_image_saver(PixelFormat const &pixel_format, std::string const &encoding, ImageSaver saver)
+{
+	SaverRegistry::Get().Register(pixel_format, encoding, saver);
+}
+
+ImageSaver find_image_saver(PixelFormat const &pixel_format, std::string const &encoding)
+{
+	return SaverRegistry::Get().Find(pixel_format, encoding);
+}
@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * saver.hpp - find the function that saves a given pixel format and encoding.
+ */
+
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <libcamera/controls.h>
+#include <libcamera/pixel_format.h>
+
+struct StillOptions;
+
+typedef std::function<void(std::vector<void *> const &mem, int w, int h, int stride,
+						   libcamera::PixelFormat const &pixel_format, libcamera::ControlList const &metadata,
+						   std::string const &filename, std::string const &cam_name, StillOptions const *options)>
+	ImageSaver;
+
+// Add a saver for images of the given pixel format and encoding, replacing any that
+// was there before. A saver registered with a default constructed (invalid) pixel
+// format handles that encoding for any format that has no saver of its own.
+void register_image_saver(libcamera::PixelFormat const &pixel_format, std::string const &encoding, ImageSaver saver);
+
+// Return the saver for this pixel format and encoding, throwing if there isn't one.
+// All the savers in the image library are registered from the start.
+ImageSaver find_image_saver(libcamera::PixelFormat const &pixel_format, std::string const &encoding);
@@ -0,0 +1,182 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * unpack.cpp - unpack CSI-2 packed Bayer data to 16 bits per pixel.
+ */
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+#include "core/parallel.hpp"
+
+#include "unpack.hpp"
+
+void unpack_10bit_row_scalar(uint8_t const *src, unsigned int w, uint16_t *dest)
+{
+	unsigned int w_align = w & ~3;
+	unsigned int x;
+	uint8_t const *ptr = src;
+	for (x = 0; x < w_align; x += 4, ptr += 5)
+	{
+		*dest++ = (ptr[0] << 2) | ((ptr[4] >> 0) & 3);
+		*dest++ = (ptr[1] << 2) | ((ptr[4] >> 2) & 3);
+		*dest++ = (ptr[2] << 2) | ((ptr[4] >> 4) & 3);
+		*dest++ = (ptr[3] << 2) | ((ptr[4] >> 6) & 3);
+	}
+	for (; x < w; x++)
+		*dest++ = (ptr[x & 3] << 2) | ((ptr[4] >> ((x & 3) << 1)) & 3);
+}
+
+void unpack_12bit_row_scalar(uint8_t const *src, unsigned int w, uint16_t *dest)
+{
+	unsigned int w_align = w & ~1;
+	unsigned int x;
+	uint8_t const *ptr = src;
+	for (x = 0; x < w_align; x += 2, ptr += 3)
+	{
+		*dest++ = (ptr[0] << 4) | ((ptr[2] >> 0) & 15);
+		*dest++ = (ptr[1] << 4) | ((ptr[2] >> 4) & 15);
+	}
+	if (x < w)
+		*dest++ = (ptr[x & 1] << 4) | ((ptr[2] >> ((x & 1) << 2)) & 15);
+}
+
+// The vector versions do 8 pixels at a time from a single 16 byte load. A byte
+// shuffle moves each pixel's 8 high bits into the bottom of its own 16-bit lane,
+// and a second shuffle copies the byte holding its low bits alongside, which we
+// then shift by a different amount in each lane. We stop early enough that the
+// 16 byte load never reads past the end of the row.
+
+#if defined(__ARM_NEON)
+
+static inline uint8x16_t shuffle(uint8x16_t v, uint8x16_t idx)
+{
+#if defined(__aarch64__)
+	return vqtbl1q_u8(v, idx);
+#else
+	uint8x8x2_t table = { { vget_low_u8(v), vget_high_u8(v) } };
+	return vcombine_u8(vtbl2_u8(table, vget_low_u8(idx)), vtbl2_u8(table, vget_high_u8(idx)));
+#endif
+}
+
+void unpack_10bit_row(uint8_t const *src, unsigned int w, uint16_t *dest)
+{
+	static const uint8_t high_idx[16] = { 0, 255, 1, 255, 2, 255, 3, 255, 5, 255, 6, 255, 7, 255, 8, 255 };
+	static const uint8_t low_idx[16] = { 4, 255, 4, 255, 4, 255, 4, 255, 9, 255, 9, 255, 9, 255, 9, 255 };
+	static const int16_t low_shift[8] = { 0, -2, -4, -6, 0, -2, -4, -6 };
+	uint8x16_t high_table = vld1q_u8(high_idx), low_table = vld1q_u8(low_idx);
+	int16x8_t shift = vld1q_s16(low_shift);
+	uint16x8_t mask = vdupq_n_u16(3);
+	unsigned int x = 0;
+	for (; x + 16 <= w; x += 8, src += 10, dest += 8)
+	{
+		uint8x16_t v = vld1q_u8(src);
+		uint16x8_t high = vreinterpretq_u16_u8(shuffle(v, high_table));
+		uint16x8_t low = vreinterpretq_u16_u8(shuffle(v, low_table));
+		low = vandq_u16(vshlq_u16(low, shift), mask);
+		vst1q_u16(dest, vorrq_u16(vshlq_n_u16(high, 2), low));
+	}
+	unpack_10bit_row_scalar(src, w - x, dest);
+}
+
+void unpack_12bit_row(uint8_t const *src, unsigned int w, uint16_t *dest)
+{
+	static const uint8_t high_idx[16] = { 0, 255, 1, 255, 3, 255, 4, 255, 6, 255, 7, 255, 9, 255, 10, 255 };
+	static const uint8_t low_idx[16] = { 2, 255, 2, 255, 5, 255, 5, 255, 8, 255, 8, 255, 11, 255, 11, 255 };
+	static const int16_t low_shift[8] = { 0, -4, 0, -4, 0, -4, 0, -4 };
+	uint8x16_t high_table = vld1q_u8(high_idx), low_table = vld1q_u8(low_idx);
+	int16x8_t shift = vld1q_s16(low_shift);
+	uint16x8_t mask = vdupq_n_u16(15);
+	unsigned int x = 0;
+	for (; x + 12 <= w; x += 8, src += 12, dest += 8)
+	{
+		uint8x16_t v = vld1q_u8(src);
+		uint16x8_t high = vreinterpretq_u16_u8(shuffle(v, high_table));
+		uint16x8_t low = vreinterpretq_u16_u8(shuffle(v, low_table));
+		low = vandq_u16(vshlq_u16(low, shift), mask);
+		vst1q_u16(dest, vorrq_u16(vshlq_n_u16(high, 4), low));
+	}
+	unpack_12bit_row_scalar(src, w - x, dest);
+}
+
+#elif defined(__SSSE3__)
+
+// SSE has no per-lane variable shift for 16-bit values, so we multiply to move the
+// bits we want to the same place in every lane and then shift them all together.
+
+void unpack_10bit_row(uint8_t const *src, unsigned int w, uint16_t *dest)
+{
+	const __m128i high_table = _mm_setr_epi8(0, -1, 1, -1, 2, -1, 3, -1, 5, -1, 6, -1, 7, -1, 8, -1);
+	const __m128i low_table = _mm_setr_epi8(4, -1, 4, -1, 4, -1, 4, -1, 9, -1, 9, -1, 9, -1, 9, -1);
+	const __m128i low_mul = _mm_setr_epi16(64, 16, 4, 1, 64, 16, 4, 1);
+	const __m128i mask = _mm_set1_epi16(3);
+	unsigned int x = 0;
+	for (; x + 16 <= w; x += 8, src += 10, dest += 8)
+	{
+		__m128i v = _mm_loadu_si128((__m128i const *)src);
+		__m128i high = _mm_shuffle_epi8(v, high_table);
+		__m128i low = _mm_shuffle_epi8(v, low_table);
+		low = _mm_and_si128(_mm_srli_epi16(_mm_mullo_epi16(low, low_mul), 6), mask);
+		_mm_storeu_si128((__m128i *)dest, _mm_or_si128(_mm_slli_epi16(high, 2), low));
+	}
+	unpack_10bit_row_scalar(src, w - x, dest);
+}
+
+void unpack_12bit_row(uint8_t const *src, unsigned int w, uint16_t *dest)
+{
+	const __m128i high_table = _mm_setr_epi8(0, -1, 1, -1, 3, -1, 4, -1, 6, -1, 7, -1, 9, -1, 10, -1);
+	const __m128i low_table = _mm_setr_epi8(2, -1, 2, -1, 5, -1, 5, -1, 8, -1, 8, -1, 11, -1, 11, -1);
+	const __m128i low_mul = _mm_setr_epi16(16, 1, 16, 1, 16, 1, 16, 1);
+	const __m128i mask = _mm_set1_epi16(15);
+	unsigned int x = 0;
+	for (; x + 12 <= w; x += 8, src += 12, dest += 8)
+	{
+		__m128i v = _mm_loadu_si128((__m128i const *)src);
+		__m128i high = _mm_shuffle_epi8(v, high_table);
+		__m128i low = _mm_shuffle_epi8(v, low_table);
+		low = _mm_and_si128(_mm_srli_epi16(_mm_mullo_epi16(low, low_mul), 4), mask);
+		_mm_storeu_si128((__m128i *)dest, _mm_or_si128(_mm_slli_epi16(high, 4), low));
+	}
+	unpack_12bit_row_scalar(src, w - x, dest);
+}
+
+#else
+
+void unpack_10bit_row(uint8_t const *src, unsigned int w, uint16_t *dest)
+{
+	unpack_10bit_row_scalar(src, w, dest);
+}
+
+void unpack_12bit_row(uint8_t const *src, unsigned int w, uint16_t *dest)
+{
+	unpack_12bit_row_scalar(src, w, dest);
+}
+
+#endif
+
+void unpack_raw(uint8_t const *src, unsigned int w, unsigned int h, unsigned int stride, unsigned int bits,
+				uint16_t *dest, unsigned int dest_stride, unsigned int num_threads)
+{
+	void (*unpack_row)(uint8_t const *, unsigned int, uint16_t *);
+	if (bits == 10)
+		unpack_row = unpack_10bit_row;
+	else if (bits == 12)
+		unpack_row = unpack_12bit_row;
+	else if (bits == 16)
+		unpack_row = [](uint8_t const *src, unsigned int w, uint16_t *dest) { memcpy(dest, src, w * 2); };
+	else
+		throw std::runtime_error("unsupported bit depth " + std::to_string(bits));
+
+	parallel_for(h, [=](unsigned int begin, unsigned int end) {
+		for (unsigned int y = begin; y < end; y++)
+			unpack_row(src + y * stride, w, dest + y * dest_stride);
+	}, num_threads);
+}
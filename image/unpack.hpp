@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * unpack.hpp - unpack CSI-2 packed Bayer data to 16 bits per pixel.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+// Unpack one row of w pixels. 10-bit data has 4 pixels in every 5 bytes, 12-bit
+// data 2 pixels in every 3 bytes. These use NEON or SSSE3 where available.
+void unpack_10bit_row(uint8_t const *src, unsigned int w, uint16_t *dest);
+void unpack_12bit_row(uint8_t const *src, unsigned int w, uint16_t *dest);
+
+// Plain C versions of the above, used as the fallback and for benchmarking.
+void unpack_10bit_row_scalar(uint8_t const *src, unsigned int w, uint16_t *dest);
+void unpack_12bit_row_scalar(uint8_t const *src, unsigned int w, uint16_t *dest);
+
+// Unpack h rows of a 10 or 12-bit image, splitting the rows between up to num_threads
+// threads (0 means one per core). The strides are in bytes and elements respectively.
+// 16-bit images are simply copied.
+void unpack_raw(uint8_t const *src, unsigned int w, unsigned int h, unsigned int stride, unsigned int bits,
+				uint16_t *dest, unsigned int dest_stride, unsigned int num_threads = 0);
@@ -5,140 +5,212 @@
  * yuv.cpp - dummy stills encoder to save uncompressed data
  */
 
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
 #include <libcamera/formats.h>
 #include <libcamera/pixel_format.h>
 
+#include "core/parallel.hpp"
 #include "core/still_options.hpp"
 
-static void yuv420_save(std::vector<void *> const &mem, int w, int h, int stride, std::string const &filename,
-						StillOptions const *options)
+#include "yuv.hpp"
+#include "yuv2rgb.hpp"
+
+void yuyv_deinterleave_row_scalar(uint8_t const *src, unsigned int w, uint8_t *y, uint8_t *u, uint8_t *v)
 {
-	if (options->encoding == "yuv420")
+	for (unsigned int i = 0; i < w; i++)
+		y[i] = src[i << 1];
+	if (u && v)
 	{
-		if ((w & 1) || (h & 1))
-			throw std::runtime_error("both width and height must be even");
-		if (mem.size() != 1)
-			throw std::runtime_error("incorrect number of planes in YUV420 data");
-		FILE *fp = fopen(filename.c_str(), "w");
-		if (!fp)
-			throw std::runtime_error("failed to open file " + filename);
-		try
+		for (unsigned int i = 0; i < w / 2; i++)
 		{
-			uint8_t *Y = (uint8_t *)mem[0];
-			for (int j = 0; j < h; j++)
-			{
-				if (fwrite(Y + j * stride, w, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
-			}
-			uint8_t *U = Y + stride * h;
-			h /= 2, w /= 2, stride /= 2;
-			for (int j = 0; j < h; j++)
-			{
-				if (fwrite(U + j * stride, w, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
-			}
-			uint8_t *V = U + stride * h;
-			for (int j = 0; j < h; j++)
-			{
-				if (fwrite(V + j * stride, w, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
-			}
+			u[i] = src[(i << 2) + 1];
+			v[i] = src[(i << 2) + 3];
+		}
+	}
+}
+
+#if defined(__ARM_NEON)
+
+void yuyv_deinterleave_row(uint8_t const *src, unsigned int w, uint8_t *y, uint8_t *u, uint8_t *v)
+{
+	// Each 64 byte load gives us 16 each of the even Ys, Us, odd Ys and Vs.
+	unsigned int x = 0;
+	for (; x + 32 <= w; x += 32, src += 64)
+	{
+		uint8x16x4_t yuyv = vld4q_u8(src);
+		uint8x16x2_t luma = { { yuyv.val[0], yuyv.val[2] } };
+		vst2q_u8(y + x, luma);
+		if (u && v)
+		{
+			vst1q_u8(u + x / 2, yuyv.val[1]);
+			vst1q_u8(v + x / 2, yuyv.val[3]);
 		}
-		catch (std::exception const &e)
+	}
+	yuyv_deinterleave_row_scalar(src, w - x, y + x, u ? u + x / 2 : nullptr, v ? v + x / 2 : nullptr);
+}
+
+#elif defined(__SSSE3__)
+
+void yuyv_deinterleave_row(uint8_t const *src, unsigned int w, uint8_t *y, uint8_t *u, uint8_t *v)
+{
+	// Gather the 8 Y values of each 16 bytes into the low half, then the 4 Us and 4 Vs.
+	const __m128i split = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, 1, 5, 9, 13, 3, 7, 11, 15);
+	unsigned int x = 0;
+	for (; x + 16 <= w; x += 16, src += 32)
+	{
+		__m128i a = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)src), split);
+		__m128i b = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(src + 16)), split);
+		_mm_storeu_si128((__m128i *)(y + x), _mm_unpacklo_epi64(a, b));
+		if (u && v)
 		{
-			fclose(fp);
-			throw;
+			__m128i uv = _mm_unpackhi_epi32(a, b); // U0-3, U4-7, V0-3, V4-7
+			_mm_storel_epi64((__m128i *)(u + x / 2), uv);
+			_mm_storel_epi64((__m128i *)(v + x / 2), _mm_srli_si128(uv, 8));
 		}
 	}
-	else
-		throw std::runtime_error("output format " + options->encoding + " not supported");
+	yuyv_deinterleave_row_scalar(src, w - x, y + x, u ? u + x / 2 : nullptr, v ? v + x / 2 : nullptr);
+}
+
+#else
+
+void yuyv_deinterleave_row(uint8_t const *src, unsigned int w, uint8_t *y, uint8_t *u, uint8_t *v)
+{
+	yuyv_deinterleave_row_scalar(src, w, y, u, v);
 }
 
-static void yuyv_save(std::vector<void *> const &mem, int w, int h, int stride, std::string const &filename,
-					  StillOptions const *options)
+#endif
+
+// Collects the pieces of a file and writes them with as few system calls as we can.
+// Pieces that follow on from one another in memory are merged, so a plane with no
+// padding at the end of its rows goes out as a single write.
+class IovecWriter
 {
-	if (options->encoding == "yuv420")
+public:
+	IovecWriter(std::string const &filename) : filename_(filename)
 	{
-		if ((w & 1) || (h & 1))
-			throw std::runtime_error("both width and height must be even");
-		FILE *fp = fopen(filename.c_str(), "w");
-		if (!fp)
+		fd_ = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd_ < 0)
 			throw std::runtime_error("failed to open file " + filename);
-		try
+	}
+	~IovecWriter() { close(fd_); }
+	void Add(void const *ptr, size_t size)
+	{
+		if (!size)
+			return;
+		if (!iov_.empty() && (uint8_t *)iov_.back().iov_base + iov_.back().iov_len == ptr)
+			iov_.back().iov_len += size;
+		else
+			iov_.push_back({ const_cast<void *>(ptr), size });
+	}
+	void Flush()
+	{
+		size_t i = 0;
+		while (i < iov_.size())
 		{
-			// We could doubtless do this much quicker. Though starting with
-			// YUV420 planar buffer would have been nice.
-			std::vector<uint8_t> row(w);
-			uint8_t *ptr = (uint8_t *)mem[0];
-			for (int j = 0; j < h; j++, ptr += stride)
-			{
-				for (int i = 0; i < w; i++)
-					row[i] = ptr[i << 1];
-				if (fwrite(&row[0], w, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
-			}
-			ptr = (uint8_t *)mem[0];
-			for (int j = 0; j < h; j += 2, ptr += 2 * stride)
+			ssize_t ret = writev(fd_, &iov_[i], std::min<size_t>(iov_.size() - i, IOV_MAX));
+			if (ret < 0)
 			{
-				for (int i = 0; i < w / 2; i++)
-					row[i] = ptr[(i << 2) + 1];
-				if (fwrite(&row[0], w / 2, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
+				if (errno == EINTR)
+					continue;
+				throw std::runtime_error("failed to write file " + filename_);
 			}
-			ptr = (uint8_t *)mem[0];
-			for (int j = 0; j < h; j += 2, ptr += 2 * stride)
+			// A short write may leave us part way through an iovec.
+			for (; i < iov_.size() && (size_t)ret >= iov_[i].iov_len; i++)
+				ret -= iov_[i].iov_len;
+			if (ret)
 			{
-				for (int i = 0; i < w / 2; i++)
-					row[i] = ptr[(i << 2) + 3];
-				if (fwrite(&row[0], w / 2, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
+				iov_[i].iov_base = (uint8_t *)iov_[i].iov_base + ret;
+				iov_[i].iov_len -= ret;
 			}
-			fclose(fp);
-		}
-		catch (std::exception const &e)
-		{
-			fclose(fp);
-			throw;
 		}
+		iov_.clear();
 	}
-	else
-		throw std::runtime_error("output format " + options->encoding + " not supported");
+
+private:
+	std::string filename_;
+	int fd_;
+	std::vector<iovec> iov_;
+};
+
+void yuv420_save(std::vector<void *> const &mem, int w, int h, int stride, std::string const &filename,
+				 StillOptions const *options)
+{
+	if ((w & 1) || (h & 1))
+		throw std::runtime_error("both width and height must be even");
+	if (mem.size() != 1)
+		throw std::runtime_error("incorrect number of planes in YUV420 data");
+	IovecWriter writer(filename);
+	uint8_t *Y = (uint8_t *)mem[0];
+	for (int j = 0; j < h; j++)
+		writer.Add(Y + j * stride, w);
+	uint8_t *U = Y + stride * h;
+	h /= 2, w /= 2, stride /= 2;
+	for (int j = 0; j < h; j++)
+		writer.Add(U + j * stride, w);
+	uint8_t *V = U + stride * h;
+	for (int j = 0; j < h; j++)
+		writer.Add(V + j * stride, w);
+	writer.Flush();
 }
 
-static void rgb_save(std::vector<void *> const &mem, int w, int h, int stride, std::string const &filename,
-					 StillOptions const *options)
+void yuyv_save(std::vector<void *> const &mem, int w, int h, int stride, std::string const &filename,
+			   StillOptions const *options)
 {
-	if (options->encoding != "rgb")
-		throw std::runtime_error("encoding should be set to rgb");
-	FILE *fp = fopen(filename.c_str(), "w");
-	if (!fp)
-		throw std::runtime_error("failed to open file " + filename);
-	try
-	{
-		uint8_t *ptr = (uint8_t *)mem[0];
-		for (int j = 0; j < h; j++, ptr += stride)
+	if ((w & 1) || (h & 1))
+		throw std::runtime_error("both width and height must be even");
+	IovecWriter writer(filename);
+	// Make the whole I420 image, a pair of rows at a time (the chroma comes from
+	// the first of each pair), and then write it in one go.
+	std::vector<uint8_t> i420(w * h * 3 / 2);
+	uint8_t *Y = &i420[0], *U = Y + w * h, *V = U + w * h / 4;
+	uint8_t const *src = (uint8_t *)mem[0];
+	parallel_for(h / 2, [&](unsigned int begin, unsigned int end) {
+		for (unsigned int j = begin; j < end; j++)
 		{
-			if (fwrite(ptr, 3 * w, 1, fp) != 1)
-				throw std::runtime_error("failed to write file " + filename);
+			uint8_t const *row = src + 2 * j * stride;
+			yuyv_deinterleave_row(row, w, Y + 2 * j * w, U + j * w / 2, V + j * w / 2);
+			yuyv_deinterleave_row(row + stride, w, Y + (2 * j + 1) * w, nullptr, nullptr);
 		}
-		fclose(fp);
-	}
-	catch (std::exception const &e)
-	{
-		fclose(fp);
-		throw;
-	}
+	});
+	writer.Add(&i420[0], i420.size());
+	writer.Flush();
 }
 
-void yuv_save(std::vector<void *> const &mem, int w, int h, int stride, libcamera::PixelFormat const &pixel_format,
+void rgb_save(std::vector<void *> const &mem, int w, int h, int stride, libcamera::PixelFormat const &pixel_format,
 			  std::string const &filename, StillOptions const *options)
 {
-	if (pixel_format == libcamera::formats::YUYV)
-		yuyv_save(mem, w, h, stride, filename, options);
-	else if (pixel_format == libcamera::formats::YUV420)
-		yuv420_save(mem, w, h, stride, filename, options);
-	else if (pixel_format == libcamera::formats::BGR888 || pixel_format == libcamera::formats::RGB888)
-		rgb_save(mem, w, h, stride, filename, options);
-	else
-		throw std::runtime_error("unrecognised YUV/RGB save format");
+	// Write R, G, B in memory, as we always have done (libcamera calls this BGR888).
+	RgbRowReader reader(mem, w, h, stride, pixel_format, libcamera::formats::BGR888, options->colour_space);
+	IovecWriter writer(filename);
+
+	// Fetch (and convert, if need be) the whole image, with one set of threads each
+	// converting bands of rows, and then write it all at once. Formats that need no
+	// conversion hand back rows of the original image, so nothing is copied.
+	const int band_rows = 64;
+	int num_bands = (h + band_rows - 1) / band_rows;
+	std::vector<uint8_t> image(h * 3 * w);
+	std::vector<uint8_t const *> rows(h);
+	parallel_for(num_bands, [&](unsigned int begin, unsigned int end) {
+		for (unsigned int b = begin; b < end; b++)
+		{
+			for (int y = b * band_rows; y < std::min<int>((b + 1) * band_rows, h); y++)
+				rows[y] = reader.Row(y, &image[y * 3 * w]);
+		}
+	});
+	for (int y = 0; y < h; y++)
+		writer.Add(rows[y], 3 * w);
+	writer.Flush();
 }
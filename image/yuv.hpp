@@ -0,0 +1,17 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * yuv.hpp - helpers for saving uncompressed YUV data.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+// Split a row of w pixels of YUYV into its Y values and, unless u and v are null,
+// its w / 2 U and V values. This uses NEON or SSSE3 where available.
+void yuyv_deinterleave_row(uint8_t const *src, unsigned int w, uint8_t *y, uint8_t *u, uint8_t *v);
+
+// Plain C version of the above, used as the fallback and for benchmarking.
+void yuyv_deinterleave_row_scalar(uint8_t const *src, unsigned int w, uint8_t *y, uint8_t *u, uint8_t *v);
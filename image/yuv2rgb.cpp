@@ -0,0 +1,282 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * yuv2rgb.cpp - convert YUV images to RGB a row at a time.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+#include <libcamera/formats.h>
+
+#include "yuv2rgb.hpp"
+
+YuvCoeffs yuv_coeffs(std::string const &colour_space)
+{
+	if (colour_space == "jpeg")
+		return { 0, 64, 90, 22, 46, 113 };
+	else if (colour_space == "smpte170m")
+		return { 16, 75, 102, 25, 52, 129 };
+	else if (colour_space == "rec709")
+		return { 16, 75, 115, 14, 34, 135 };
+	else if (colour_space == "rec709full")
+		return { 0, 64, 101, 12, 30, 119 };
+	throw std::runtime_error("unknown colour space " + colour_space);
+}
+
+// All the arithmetic fits in 16 bits. The only place it can overflow is when a
+// result is far above 255, where the vector code saturates and we clamp anyway,
+// so the vector and scalar versions always give identical results.
+static inline uint8_t clamp(int x)
+{
+	x >>= 6;
+	return x < 0 ? 0 : (x > 255 ? 255 : x);
+}
+
+static inline void yuv_to_rgb_pair(int y0, int y1, int u, int v, YuvCoeffs const &c, bool bgr, uint8_t *dest)
+{
+	u -= 128, v -= 128;
+	int r = c.r_v * v, g = c.g_u * u + c.g_v * v, b = c.b_u * u;
+	int yt[2] = { (y0 - c.y_offset) * c.y_mul + 32, (y1 - c.y_offset) * c.y_mul + 32 };
+	for (int i = 0; i < 2; i++, dest += 3)
+	{
+		dest[bgr ? 2 : 0] = clamp(yt[i] + r);
+		dest[1] = clamp(yt[i] - g);
+		dest[bgr ? 0 : 2] = clamp(yt[i] + b);
+	}
+}
+
+void yuv420_to_rgb_row_scalar(uint8_t const *y, uint8_t const *u, uint8_t const *v, unsigned int w, uint8_t *dest,
+							  YuvCoeffs const &coeffs, bool bgr)
+{
+	unsigned int x = 0;
+	for (; x + 2 <= w; x += 2, dest += 6)
+		yuv_to_rgb_pair(y[x], y[x + 1], u[x >> 1], v[x >> 1], coeffs, bgr, dest);
+	if (x < w)
+	{
+		uint8_t pair[6];
+		yuv_to_rgb_pair(y[x], y[x], u[x >> 1], v[x >> 1], coeffs, bgr, pair);
+		memcpy(dest, pair, 3);
+	}
+}
+
+void yuyv_to_rgb_row_scalar(uint8_t const *src, unsigned int w, uint8_t *dest, YuvCoeffs const &coeffs, bool bgr)
+{
+	unsigned int x = 0;
+	for (; x + 2 <= w; x += 2, src += 4, dest += 6)
+		yuv_to_rgb_pair(src[0], src[2], src[1], src[3], coeffs, bgr, dest);
+	if (x < w)
+	{
+		uint8_t pair[6];
+		yuv_to_rgb_pair(src[0], src[0], src[1], src[3], coeffs, bgr, pair);
+		memcpy(dest, pair, 3);
+	}
+}
+
+// The vector versions convert 16 pixels at a time, sharing the chroma calculation
+// between each pair of pixels.
+
+#if defined(__ARM_NEON)
+
+// Convert 8 pairs of pixels, the even pixels' Y values in y0 and the odd ones in y1.
+static inline void convert16(uint8x8_t y0, uint8x8_t y1, uint8x8_t u8, uint8x8_t v8, YuvCoeffs const &c, bool bgr,
+							 uint8_t *dest)
+{
+	int16x8_t u = vreinterpretq_s16_u16(vsubl_u8(u8, vdup_n_u8(128)));
+	int16x8_t v = vreinterpretq_s16_u16(vsubl_u8(v8, vdup_n_u8(128)));
+	int16x8_t r = vmulq_n_s16(v, c.r_v);
+	int16x8_t g = vaddq_s16(vmulq_n_s16(u, c.g_u), vmulq_n_s16(v, c.g_v));
+	int16x8_t b = vmulq_n_s16(u, c.b_u);
+	int16x8_t offset = vdupq_n_s16(c.y_offset), round = vdupq_n_s16(32);
+	int16x8_t yt0 = vaddq_s16(vmulq_n_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(y0)), offset), c.y_mul), round);
+	int16x8_t yt1 = vaddq_s16(vmulq_n_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(y1)), offset), c.y_mul), round);
+
+	uint8x8x2_t rr = vzip_u8(vqshrun_n_s16(vqaddq_s16(yt0, r), 6), vqshrun_n_s16(vqaddq_s16(yt1, r), 6));
+	uint8x8x2_t gg = vzip_u8(vqshrun_n_s16(vqsubq_s16(yt0, g), 6), vqshrun_n_s16(vqsubq_s16(yt1, g), 6));
+	uint8x8x2_t bb = vzip_u8(vqshrun_n_s16(vqaddq_s16(yt0, b), 6), vqshrun_n_s16(vqaddq_s16(yt1, b), 6));
+	uint8x16_t red = vcombine_u8(rr.val[0], rr.val[1]), blue = vcombine_u8(bb.val[0], bb.val[1]);
+	uint8x16x3_t rgb = { { bgr ? blue : red, vcombine_u8(gg.val[0], gg.val[1]), bgr ? red : blue } };
+	vst3q_u8(dest, rgb);
+}
+
+void yuv420_to_rgb_row(uint8_t const *y, uint8_t const *u, uint8_t const *v, unsigned int w, uint8_t *dest,
+					   YuvCoeffs const &coeffs, bool bgr)
+{
+	unsigned int x = 0;
+	for (; x + 16 <= w; x += 16, dest += 48)
+	{
+		uint8x8x2_t y01 = vld2_u8(y + x);
+		convert16(y01.val[0], y01.val[1], vld1_u8(u + (x >> 1)), vld1_u8(v + (x >> 1)), coeffs, bgr, dest);
+	}
+	yuv420_to_rgb_row_scalar(y + x, u + (x >> 1), v + (x >> 1), w - x, dest, coeffs, bgr);
+}
+
+void yuyv_to_rgb_row(uint8_t const *src, unsigned int w, uint8_t *dest, YuvCoeffs const &coeffs, bool bgr)
+{
+	unsigned int x = 0;
+	for (; x + 16 <= w; x += 16, src += 32, dest += 48)
+	{
+		uint8x8x4_t yuyv = vld4_u8(src);
+		convert16(yuyv.val[0], yuyv.val[2], yuyv.val[1], yuyv.val[3], coeffs, bgr, dest);
+	}
+	yuyv_to_rgb_row_scalar(src, w - x, dest, coeffs, bgr);
+}
+
+#elif defined(__SSSE3__)
+
+// Shuffles to interleave three vectors of 16 bytes into 48 bytes of RGB triples.
+struct InterleaveMasks
+{
+	InterleaveMasks()
+	{
+		for (int block = 0; block < 3; block++)
+		{
+			for (int c = 0; c < 3; c++)
+			{
+				uint8_t idx[16];
+				for (int i = 0; i < 16; i++)
+					idx[i] = (block * 16 + i) % 3 == c ? (block * 16 + i) / 3 : 0x80;
+				mask[block][c] = _mm_loadu_si128((__m128i const *)idx);
+			}
+		}
+	}
+	__m128i mask[3][3];
+};
+
+// Convert 16 pixels, with the Y values in y and the 8 U and V values in the low
+// halves of u8 and v8.
+static inline void convert16(__m128i y, __m128i u8, __m128i v8, YuvCoeffs const &c, bool bgr, uint8_t *dest)
+{
+	static const InterleaveMasks masks;
+	const __m128i zero = _mm_setzero_si128();
+	__m128i u = _mm_sub_epi16(_mm_unpacklo_epi8(u8, zero), _mm_set1_epi16(128));
+	__m128i v = _mm_sub_epi16(_mm_unpacklo_epi8(v8, zero), _mm_set1_epi16(128));
+	__m128i r = _mm_mullo_epi16(v, _mm_set1_epi16(c.r_v));
+	__m128i g = _mm_add_epi16(_mm_mullo_epi16(u, _mm_set1_epi16(c.g_u)), _mm_mullo_epi16(v, _mm_set1_epi16(c.g_v)));
+	__m128i b = _mm_mullo_epi16(u, _mm_set1_epi16(c.b_u));
+	__m128i offset = _mm_set1_epi16(c.y_offset), mul = _mm_set1_epi16(c.y_mul), round = _mm_set1_epi16(32);
+	__m128i yt0 = _mm_add_epi16(_mm_mullo_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(y, zero), offset), mul), round);
+	__m128i yt1 = _mm_add_epi16(_mm_mullo_epi16(_mm_sub_epi16(_mm_unpackhi_epi8(y, zero), offset), mul), round);
+
+	// Each chroma term is shared by two neighbouring pixels.
+	__m128i r0 = _mm_unpacklo_epi16(r, r), r1 = _mm_unpackhi_epi16(r, r);
+	__m128i g0 = _mm_unpacklo_epi16(g, g), g1 = _mm_unpackhi_epi16(g, g);
+	__m128i b0 = _mm_unpacklo_epi16(b, b), b1 = _mm_unpackhi_epi16(b, b);
+	__m128i red = _mm_packus_epi16(_mm_srai_epi16(_mm_adds_epi16(yt0, r0), 6),
+								   _mm_srai_epi16(_mm_adds_epi16(yt1, r1), 6));
+	__m128i green = _mm_packus_epi16(_mm_srai_epi16(_mm_subs_epi16(yt0, g0), 6),
+									 _mm_srai_epi16(_mm_subs_epi16(yt1, g1), 6));
+	__m128i blue = _mm_packus_epi16(_mm_srai_epi16(_mm_adds_epi16(yt0, b0), 6),
+									_mm_srai_epi16(_mm_adds_epi16(yt1, b1), 6));
+	if (bgr)
+		std::swap(red, blue);
+
+	for (int block = 0; block < 3; block++)
+	{
+		__m128i out = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(red, masks.mask[block][0]),
+												_mm_shuffle_epi8(green, masks.mask[block][1])),
+								   _mm_shuffle_epi8(blue, masks.mask[block][2]));
+		_mm_storeu_si128((__m128i *)(dest + block * 16), out);
+	}
+}
+
+void yuv420_to_rgb_row(uint8_t const *y, uint8_t const *u, uint8_t const *v, unsigned int w, uint8_t *dest,
+					   YuvCoeffs const &coeffs, bool bgr)
+{
+	unsigned int x = 0;
+	for (; x + 16 <= w; x += 16, dest += 48)
+	{
+		convert16(_mm_loadu_si128((__m128i const *)(y + x)), _mm_loadl_epi64((__m128i const *)(u + (x >> 1))),
+				  _mm_loadl_epi64((__m128i const *)(v + (x >> 1))), coeffs, bgr, dest);
+	}
+	yuv420_to_rgb_row_scalar(y + x, u + (x >> 1), v + (x >> 1), w - x, dest, coeffs, bgr);
+}
+
+void yuyv_to_rgb_row(uint8_t const *src, unsigned int w, uint8_t *dest, YuvCoeffs const &coeffs, bool bgr)
+{
+	// Gather the 8 Y values of each 16 bytes into the low half, then the 4 Us and 4 Vs.
+	const __m128i split = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, 1, 5, 9, 13, 3, 7, 11, 15);
+	unsigned int x = 0;
+	for (; x + 16 <= w; x += 16, src += 32, dest += 48)
+	{
+		__m128i a = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)src), split);
+		__m128i b = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(src + 16)), split);
+		__m128i uv = _mm_unpackhi_epi32(a, b); // U0-3, U4-7, V0-3, V4-7
+		convert16(_mm_unpacklo_epi64(a, b), uv, _mm_srli_si128(uv, 8), coeffs, bgr, dest);
+	}
+	yuyv_to_rgb_row_scalar(src, w - x, dest, coeffs, bgr);
+}
+
+#else
+
+void yuv420_to_rgb_row(uint8_t const *y, uint8_t const *u, uint8_t const *v, unsigned int w, uint8_t *dest,
+					   YuvCoeffs const &coeffs, bool bgr)
+{
+	yuv420_to_rgb_row_scalar(y, u, v, w, dest, coeffs, bgr);
+}
+
+void yuyv_to_rgb_row(uint8_t const *src, unsigned int w, uint8_t *dest, YuvCoeffs const &coeffs, bool bgr)
+{
+	yuyv_to_rgb_row_scalar(src, w, dest, coeffs, bgr);
+}
+
+#endif
+
+RgbRowReader::RgbRowReader(std::vector<void *> const &mem, int w, int h, int stride,
+						   libcamera::PixelFormat const &pixel_format, libcamera::PixelFormat const &output_format,
+						   std::string const &colour_space)
+	: mem_((uint8_t const *)mem[0]), w_(w), h_(h), stride_(stride), coeffs_(yuv_coeffs(colour_space)),
+	  bgr_(output_format == libcamera::formats::RGB888)
+{
+	if (output_format != libcamera::formats::RGB888 && output_format != libcamera::formats::BGR888)
+		throw std::runtime_error("RGB output format should be RGB888 or BGR888");
+
+	if (pixel_format == output_format)
+		kind_ = Kind::Direct;
+	else if (pixel_format == libcamera::formats::RGB888 || pixel_format == libcamera::formats::BGR888)
+		kind_ = Kind::Swap;
+	else if (pixel_format == libcamera::formats::YUV420)
+	{
+		if (mem.size() != 1)
+			throw std::runtime_error("incorrect number of planes in YUV420 data");
+		kind_ = Kind::Yuv420;
+	}
+	else if (pixel_format == libcamera::formats::YUYV)
+		kind_ = Kind::Yuyv;
+	else
+		throw std::runtime_error("unsupported pixel format for RGB conversion");
+}
+
+uint8_t const *RgbRowReader::Row(int y, uint8_t *buf) const
+{
+	uint8_t const *row = mem_ + y * stride_;
+	switch (kind_)
+	{
+	case Kind::Direct:
+		return row;
+	case Kind::Swap:
+		for (int x = 0; x < 3 * w_; x += 3)
+			buf[x] = row[x + 2], buf[x + 1] = row[x + 1], buf[x + 2] = row[x];
+		break;
+	case Kind::Yuv420:
+	{
+		// The chroma planes have half the stride, and there's one row for every two rows of Y.
+		uint8_t const *u = mem_ + stride_ * h_ + (y >> 1) * (stride_ >> 1);
+		uint8_t const *v = u + (stride_ >> 1) * (h_ >> 1);
+		yuv420_to_rgb_row(row, u, v, w_, buf, coeffs_, bgr_);
+		break;
+	}
+	case Kind::Yuyv:
+		yuyv_to_rgb_row(row, w_, buf, coeffs_, bgr_);
+		break;
+	}
+	return buf;
+}
@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * yuv2rgb.hpp - convert YUV images to RGB a row at a time.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <libcamera/pixel_format.h>
+
+// Fixed point YUV to RGB coefficients, with 6 fractional bits. The conversion is
+//   R = (Y - y_offset) * y_mul + r_v * (V - 128)
+//   G = (Y - y_offset) * y_mul - g_u * (U - 128) - g_v * (V - 128)
+//   B = (Y - y_offset) * y_mul + b_u * (U - 128)
+struct YuvCoeffs
+{
+	int16_t y_offset;
+	int16_t y_mul;
+	int16_t r_v;
+	int16_t g_u;
+	int16_t g_v;
+	int16_t b_u;
+};
+
+// Return the coefficients for a named colour space: "jpeg" (BT.601 full range),
+// "smpte170m" (BT.601 limited range), "rec709" (BT.709 limited range) or "rec709full".
+YuvCoeffs yuv_coeffs(std::string const &colour_space);
+
+// Convert a row of w pixels to 3 bytes per pixel, stored in memory in R, G, B order,
+// or B, G, R if bgr is set. The YUV420 version takes the row's Y values and the
+// matching row of (half width) U and V values; the YUYV version takes the packed row.
+// These use NEON or SSSE3 where available.
+void yuv420_to_rgb_row(uint8_t const *y, uint8_t const *u, uint8_t const *v, unsigned int w, uint8_t *dest,
+					   YuvCoeffs const &coeffs, bool bgr);
+void yuyv_to_rgb_row(uint8_t const *src, unsigned int w, uint8_t *dest, YuvCoeffs const &coeffs, bool bgr);
+
+// Plain C versions of the above, used as the fallback and for benchmarking.
+void yuv420_to_rgb_row_scalar(uint8_t const *y, uint8_t const *u, uint8_t const *v, unsigned int w, uint8_t *dest,
+							  YuvCoeffs const &coeffs, bool bgr);
+void yuyv_to_rgb_row_scalar(uint8_t const *src, unsigned int w, uint8_t *dest, YuvCoeffs const &coeffs, bool bgr);
+
+// Gives savers the rows of an image in the 24-bit RGB layout they want, whatever
+// the image's own format. Rows that are already in the right layout are returned
+// in place; YUV420, YUYV and rows with the colour channels swapped are converted.
+// output_format is libcamera::formats::BGR888 (R, G, B in memory) or RGB888.
+class RgbRowReader
+{
+public:
+	RgbRowReader(std::vector<void *> const &mem, int w, int h, int stride, libcamera::PixelFormat const &pixel_format,
+				 libcamera::PixelFormat const &output_format, std::string const &colour_space);
+
+	// Return row y. buf must have room for a row of 3 * width bytes and may be used
+	// to hold the result. Different threads may read rows using their own buffers.
+	uint8_t const *Row(int y, uint8_t *buf) const;
+
+	int Width() const { return w_; }
+	int Height() const { return h_; }
+
+private:
+	enum class Kind { Direct, Swap, Yuv420, Yuyv };
+	Kind kind_;
+	uint8_t const *mem_;
+	int w_, h_, stride_;
+	YuvCoeffs coeffs_;
+	bool bgr_;
+};
@@ -0,0 +1,264 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * dmabuf_server.cpp - share camera buffers with local processes, without copying them.
+ */
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include "dmabuf_server.hpp"
+
+// Send a frame message, with the buffer's fds if they are given, never waiting.
+static bool send_message(int fd, DmaBufFrameMessage const &message, int const *fds)
+{
+	iovec iov = { (void *)&message, sizeof(message) };
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * DmaBufFrameMessage::MAX_PLANES)] = {};
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (fds)
+	{
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * message.num_fds);
+		cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * message.num_fds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * message.num_fds);
+	}
+	return sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) == sizeof(message);
+}
+
+DmaBufServer::DmaBufServer(VideoOptions const *options, unsigned int width, unsigned int height, unsigned int stride,
+						   uint32_t pixel_format, ReleaseCallback release_callback)
+	: options_(options), release_callback_(release_callback), next_frame_(0), abort_(false)
+{
+	socket_path_ = options->output.substr(strlen("dmabuf://"));
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (socket_path_.empty() || socket_path_.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error("bad dmabuf socket path " + options->output);
+	strcpy(addr.sun_path, socket_path_.c_str());
+
+	format_ = {};
+	format_.width = width;
+	format_.height = height;
+	format_.stride = stride;
+	format_.pixel_format = pixel_format;
+
+	// A socket left behind by an earlier run would stop us binding to the path.
+	struct stat st;
+	if (stat(socket_path_.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(socket_path_.c_str());
+	// Sequenced packets keep each message (and the fds that go with it) separate.
+	listen_fd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd_ < 0)
+		throw std::runtime_error("unable to open unix socket");
+	if (bind(listen_fd_, (sockaddr *)&addr, sizeof(addr)) < 0)
+		throw std::runtime_error("failed to bind unix socket to " + socket_path_);
+	if (listen(listen_fd_, 8) < 0)
+		throw std::runtime_error("failed to listen on unix socket");
+
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epoll_fd_ < 0 || event_fd_ < 0)
+		throw std::runtime_error("failed to create dmabuf server events");
+	for (int fd : { listen_fd_, event_fd_ })
+	{
+		epoll_event ev = {};
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0)
+			throw std::runtime_error("failed to add dmabuf server events");
+	}
+
+	if (options_->verbose)
+		std::cout << "DmaBufServer: sharing " << width << "x" << height << " buffers on " << socket_path_ << std::endl;
+	server_thread_ = std::thread(&DmaBufServer::serverThread, this);
+}
+
+DmaBufServer::~DmaBufServer()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	uint64_t one = 1;
+	if (write(event_fd_, &one, sizeof(one)) < 0)
+		std::cerr << "WARNING: failed to wake dmabuf server thread" << std::endl;
+	server_thread_.join();
+
+	// The camera has stopped by now, so the requests that clients still hold are simply
+	// dropped (the clients' fds keep the buffers themselves alive).
+	for (auto const &client : clients_)
+		close(client.first);
+	close(event_fd_);
+	close(epoll_fd_);
+	close(listen_fd_);
+	unlink(socket_path_.c_str());
+}
+
+void DmaBufServer::Send(CompletedRequest &completed_request, libcamera::FrameBuffer *buffer)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto it = buffers_.find(buffer);
+		if (it == buffers_.end())
+			it = buffers_.emplace(buffer, buffers_.size()).first;
+
+		DmaBufFrameMessage message = format_;
+		message.frame = next_frame_++;
+		message.sequence = completed_request.sequence;
+		message.buffer = it->second;
+		message.timestamp_us = buffer->metadata().timestamp / 1000;
+		message.num_planes = std::min<size_t>(buffer->planes().size(), DmaBufFrameMessage::MAX_PLANES);
+		int fds[DmaBufFrameMessage::MAX_PLANES];
+		for (unsigned int i = 0; i < message.num_planes; i++)
+		{
+			message.plane_length[i] = buffer->planes()[i].length;
+			fds[i] = buffer->planes()[i].fd.fd();
+		}
+
+		Frame frame;
+		for (auto &it : clients_)
+		{
+			Client &client = it.second;
+			bool send_fds = !client.buffers_sent.count(message.buffer);
+			message.num_fds = send_fds ? message.num_planes : 0;
+			if (client.frames_held >= MAX_FRAMES_PER_CLIENT ||
+				!send_message(it.first, message, send_fds ? fds : nullptr))
+			{
+				client.frames_dropped++;
+				continue;
+			}
+			if (send_fds)
+				client.buffers_sent.insert(message.buffer);
+			client.frames_held++;
+			client.frames_sent++;
+			frame.clients.insert(it.first);
+		}
+		if (!frame.clients.empty())
+		{
+			frame.completed_request = std::move(completed_request);
+			frames_.emplace(message.frame, std::move(frame));
+			return;
+		}
+	}
+	// No one wanted it, so it can go straight back.
+	release_callback_(completed_request);
+}
+
+void DmaBufServer::serverThread()
+{
+	epoll_event events[16];
+	while (true)
+	{
+		int n = epoll_wait(epoll_fd_, events, 16, -1);
+		if (n < 0 && errno != EINTR)
+		{
+			std::cerr << "ERROR: dmabuf server failed waiting for events" << std::endl;
+			return;
+		}
+
+		// Released requests go back to the camera once we've let go of the lock.
+		std::vector<CompletedRequest> released;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (abort_)
+				return;
+			for (int i = 0; i < n; i++)
+			{
+				int fd = events[i].data.fd;
+				if (fd == listen_fd_)
+					acceptClients();
+				else if (fd != event_fd_)
+					readClient(fd, released);
+			}
+		}
+		for (auto &completed_request : released)
+			release_callback_(completed_request);
+	}
+}
+
+void DmaBufServer::acceptClients()
+{
+	while (true)
+	{
+		int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				std::cerr << "WARNING: dmabuf server failed to accept client" << std::endl;
+			return;
+		}
+		epoll_event ev = {};
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0)
+		{
+			std::cerr << "WARNING: dmabuf server failed to add client" << std::endl;
+			close(fd);
+			continue;
+		}
+		clients_[fd] = {};
+		if (options_->verbose)
+			std::cout << "DmaBufServer: client " << fd << " connected" << std::endl;
+	}
+}
+
+// Read a client's release messages, closing it if it has gone away.
+void DmaBufServer::readClient(int fd, std::vector<CompletedRequest> &released)
+{
+	while (true)
+	{
+		DmaBufReleaseMessage message;
+		ssize_t ret = recv(fd, &message, sizeof(message), MSG_DONTWAIT);
+		if (ret == sizeof(message))
+			release(message.frame, fd, released);
+		else if (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EINTR))
+		{
+			closeClient(fd, released);
+			return;
+		}
+		else if (ret < 0 && errno == EAGAIN)
+			return;
+	}
+}
+
+void DmaBufServer::release(uint64_t frame, int fd, std::vector<CompletedRequest> &released)
+{
+	auto it = frames_.find(frame);
+	if (it == frames_.end() || !it->second.clients.erase(fd))
+		return;
+	clients_[fd].frames_held--;
+	if (it->second.clients.empty())
+	{
+		released.push_back(std::move(it->second.completed_request));
+		frames_.erase(it);
+	}
+}
+
+void DmaBufServer::closeClient(int fd, std::vector<CompletedRequest> &released)
+{
+	for (auto it = frames_.begin(); it != frames_.end();)
+		release((it++)->first, fd, released); // the frame may be erased
+	Client const &client = clients_[fd];
+	if (options_->verbose)
+		std::cout << "DmaBufServer: client " << fd << " disconnected, " << client.frames_sent << " frames sent, "
+				  << client.frames_dropped << " dropped" << std::endl;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+	close(fd);
+	clients_.erase(fd);
+}
@@ -0,0 +1,97 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * dmabuf_server.hpp - share camera buffers with local processes, without copying them.
+ */
+
+#pragma once
+
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core/libcamera_app.hpp"
+#include "core/video_options.hpp"
+
+// What clients receive, one SOCK_SEQPACKET message per frame. The first time a client is
+// sent a buffer, its planes' dmabuf fds come with the message (num_fds of them, by
+// SCM_RIGHTS), and the client should keep them, as the buffer will come round again with
+// the same buffer number but no fds.
+struct DmaBufFrameMessage
+{
+	static constexpr unsigned int MAX_PLANES = 4;
+	uint64_t frame; // the client sends this back when it has finished with the buffer
+	uint32_t sequence; // the camera's frame sequence number
+	uint32_t buffer;
+	int64_t timestamp_us;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t pixel_format; // a DRM fourcc
+	uint32_t num_planes;
+	uint32_t num_fds;
+	uint32_t plane_length[MAX_PLANES];
+};
+
+// What clients send back, one message per frame, when they are done with it.
+struct DmaBufReleaseMessage
+{
+	uint64_t frame;
+};
+
+// Serves camera buffers to any number of clients on a Unix socket, from a thread of its
+// own. Each frame is sent to every client, and the request goes back to the camera (by
+// the release callback) once they have all released it, or gone away. A client that is
+// still holding MAX_FRAMES_PER_CLIENT frames doesn't get any more until it releases one,
+// so slow clients miss frames rather than starving the camera of buffers.
+class DmaBufServer
+{
+public:
+	static constexpr unsigned int MAX_FRAMES_PER_CLIENT = 2;
+	typedef std::function<void(CompletedRequest &)> ReleaseCallback;
+
+	DmaBufServer(VideoOptions const *options, unsigned int width, unsigned int height, unsigned int stride,
+				 uint32_t pixel_format, ReleaseCallback release_callback);
+	~DmaBufServer();
+	// Send a frame to the clients, taking over the request until they release it.
+	void Send(CompletedRequest &completed_request, libcamera::FrameBuffer *buffer);
+
+private:
+	struct Client
+	{
+		std::set<uint32_t> buffers_sent;
+		unsigned int frames_held;
+		unsigned int frames_sent;
+		unsigned int frames_dropped;
+	};
+	struct Frame
+	{
+		CompletedRequest completed_request;
+		std::set<int> clients; // the ones still holding it
+	};
+	void serverThread();
+	void acceptClients();
+	void readClient(int fd, std::vector<CompletedRequest> &released);
+	void closeClient(int fd, std::vector<CompletedRequest> &released);
+	void release(uint64_t frame, int fd, std::vector<CompletedRequest> &released);
+
+	VideoOptions const *options_;
+	std::string socket_path_;
+	DmaBufFrameMessage format_;
+	ReleaseCallback release_callback_;
+	int listen_fd_;
+	int epoll_fd_;
+	int event_fd_; // wakes the server thread when it must stop
+	std::map<int, Client> clients_;
+	std::map<libcamera::FrameBuffer *, uint32_t> buffers_;
+	std::map<uint64_t, Frame> frames_;
+	uint64_t next_frame_;
+	std::mutex mutex_;
+	bool abort_;
+	std::thread server_thread_;
+};
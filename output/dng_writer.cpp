@@ -0,0 +1,164 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * dng_writer.cpp - write a sequence of raw frames as numbered DNG files.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include "image/dng.hpp"
+
+#include "dng_writer.hpp"
+
+DngWriter::DngWriter(VideoOptions const *options, std::string const &filename,
+					 libcamera::StreamConfiguration const &config, std::string const &cam_name)
+	: filename_(filename), verbose_(options->verbose), pixel_format_(config.pixelFormat), width_(config.size.width),
+	  height_(config.size.height), stride_(config.stride), cam_name_(cam_name), have_sequence_(false),
+	  last_sequence_(0), next_index_(0), next_write_(0), frames_written_(0), frames_dropped_(0), frames_missing_(0),
+	  abort_(false)
+{
+	// Each frame is encoded on a single thread, so one encoder per core keeps them all
+	// busy. A couple of extra frames in flight let the writer ride out slow writes.
+	unsigned int num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+	max_frames_in_flight_ = num_threads + 2;
+	for (unsigned int i = 0; i < num_threads; i++)
+		encode_threads_.emplace_back(&DngWriter::encodeThread, this);
+	writer_thread_ = std::thread(&DngWriter::writerThread, this);
+}
+
+DngWriter::~DngWriter()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+		encode_cond_var_.notify_all();
+		write_cond_var_.notify_one();
+	}
+	for (auto &t : encode_threads_)
+		t.join();
+	writer_thread_.join();
+	std::cout << "DNG output: " << frames_written_ << " frames written, " << frames_dropped_ << " dropped, "
+			  << frames_missing_ << " missing from the camera" << std::endl;
+}
+
+void DngWriter::Write(void const *mem, unsigned int sequence, libcamera::ControlList const &metadata)
+{
+	Frame frame;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (have_sequence_ && sequence > last_sequence_ + 1)
+			frames_missing_ += sequence - last_sequence_ - 1;
+		have_sequence_ = true;
+		last_sequence_ = sequence;
+		if (next_index_ - next_write_ >= max_frames_in_flight_)
+		{
+			frames_dropped_++;
+			return;
+		}
+		if (!free_buffers_.empty())
+		{
+			frame.data = std::move(free_buffers_.back());
+			free_buffers_.pop_back();
+		}
+		frame.index = next_index_++;
+	}
+	// Copy outside the lock so that the other threads are never kept waiting.
+	size_t size = stride_ * height_;
+	frame.data.resize(size);
+	memcpy(&frame.data[0], mem, size);
+	frame.metadata = metadata;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	encode_queue_.push(std::move(frame));
+	encode_cond_var_.notify_one();
+}
+
+void DngWriter::Resync()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	have_sequence_ = false;
+}
+
+void DngWriter::encodeThread()
+{
+	while (true)
+	{
+		Frame frame;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			encode_cond_var_.wait(lock, [this] { return abort_ || !encode_queue_.empty(); });
+			// Finish encoding anything that's queued before we stop.
+			if (encode_queue_.empty())
+				return;
+			frame = std::move(encode_queue_.front());
+			encode_queue_.pop();
+		}
+		std::vector<uint8_t> dng;
+		try
+		{
+			std::vector<void *> mem = { &frame.data[0] };
+			// Uncompressed, as compression would be too slow to keep up with the camera.
+			dng = dng_encode(mem, width_, height_, stride_, pixel_format_, frame.metadata, cam_name_, "none", verbose_,
+							 1);
+		}
+		catch (std::exception const &e)
+		{
+			// The writer counts the empty result as dropped, and keeps going.
+			std::cerr << "ERROR: frame " << frame.index << " not encoded: " << e.what() << std::endl;
+		}
+		std::lock_guard<std::mutex> lock(mutex_);
+		encoded_[frame.index] = std::move(dng);
+		free_buffers_.push_back(std::move(frame.data));
+		write_cond_var_.notify_one();
+	}
+}
+
+void DngWriter::writerThread()
+{
+	while (true)
+	{
+		std::vector<uint8_t> dng;
+		unsigned int index;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			// Frames finish encoding in any order, but are written strictly in sequence. The
+			// encoders drain their queue before stopping, so every frame we're waiting for turns up.
+			write_cond_var_.wait(lock, [this] {
+				return encoded_.count(next_write_) || (abort_ && next_write_ == next_index_);
+			});
+			if (next_write_ == next_index_)
+				return;
+			auto it = encoded_.find(next_write_);
+			dng = std::move(it->second);
+			encoded_.erase(it);
+			index = next_write_;
+		}
+
+		bool written = false;
+		if (!dng.empty())
+		{
+			char filename[256];
+			int n = snprintf(filename, sizeof(filename), filename_.c_str(), index);
+			FILE *fp = n >= 0 && n < (int)sizeof(filename) ? fopen(filename, "w") : nullptr;
+			if (fp)
+			{
+				written = fwrite(&dng[0], dng.size(), 1, fp) == 1;
+				written = fclose(fp) == 0 && written;
+			}
+			if (!written)
+				std::cerr << "ERROR: failed to write DNG for frame " << index << std::endl;
+		}
+
+		// Only now does the frame stop counting against the frames in flight.
+		std::lock_guard<std::mutex> lock(mutex_);
+		next_write_++;
+		if (written)
+			frames_written_++;
+		else
+			frames_dropped_++;
+	}
+}
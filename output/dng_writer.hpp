@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * dng_writer.hpp - write a sequence of raw frames as numbered DNG files.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include <libcamera/controls.h>
+#include <libcamera/stream.h>
+
+#include "core/video_options.hpp"
+
+// Writes each raw frame to its own DNG file, with that frame's exposure, gain, black
+// levels and colour metadata. The filename is a printf pattern given the frame number.
+// Frames are copied as they arrive so that camera buffers can go back at once. A pool
+// of threads, one per core, encodes the DNGs in memory, and a single writer thread puts
+// them back in order and writes them out. If the writer falls behind, new frames are
+// dropped. Frames dropped here, and any missing from the camera's sequence numbers,
+// are reported when we finish.
+class DngWriter
+{
+public:
+	DngWriter(VideoOptions const *options, std::string const &filename, libcamera::StreamConfiguration const &config,
+			  std::string const &cam_name);
+	~DngWriter();
+	void Write(void const *mem, unsigned int sequence, libcamera::ControlList const &metadata);
+	// Forget the last sequence number, so that frames skipped on purpose (for example
+	// while paused) aren't reported as missing.
+	void Resync();
+
+private:
+	struct Frame
+	{
+		unsigned int index;
+		std::vector<uint8_t> data;
+		libcamera::ControlList metadata;
+	};
+	void encodeThread();
+	void writerThread();
+
+	std::string filename_;
+	bool verbose_;
+	libcamera::PixelFormat pixel_format_;
+	int width_, height_, stride_;
+	std::string cam_name_;
+	unsigned int max_frames_in_flight_;
+	bool have_sequence_;
+	unsigned int last_sequence_;
+	unsigned int next_index_;
+	unsigned int next_write_;
+	unsigned int frames_written_;
+	unsigned int frames_dropped_;
+	unsigned int frames_missing_;
+	std::queue<Frame> encode_queue_;
+	// Encoded DNGs waiting to be written, by frame number. An empty one failed to encode.
+	std::map<unsigned int, std::vector<uint8_t>> encoded_;
+	std::vector<std::vector<uint8_t>> free_buffers_;
+	std::mutex mutex_;
+	std::condition_variable encode_cond_var_;
+	std::condition_variable write_cond_var_;
+	bool abort_;
+	std::vector<std::thread> encode_threads_;
+	std::thread writer_thread_;
+};
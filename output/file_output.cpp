@@ -5,16 +5,44 @@
  * file_output.cpp - Write output to file.
  */
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include "file_output.hpp"
 
 FileOutput::FileOutput(VideoOptions const *options)
-	: fp_(nullptr), count_(0), file_start_time_ms_(0), Output(options)
+	: fp_(nullptr), file_open_(false), count_(0), file_start_time_ms_(0), Output(options)
 {
+	if (options->write_buffer)
+	{
+		WriteBuffer::Policy policy = options->write_policy == "drop" ? WriteBuffer::Policy::Drop
+																	 : WriteBuffer::Policy::Block;
+		write_buffer_ = std::make_unique<WriteBuffer>((size_t)options->write_buffer << 20, policy);
+	}
+	else if (options->io_uring)
+	{
+		if (UringFile::Available())
+			uring_file_ = std::make_unique<UringFile>();
+		else
+			std::cerr << "WARNING: io_uring not available, using normal file output" << std::endl;
+	}
+	if (options->mpegts)
+		ts_muxer_ = std::make_unique<TsMuxer>();
 }
 
 FileOutput::~FileOutput()
 {
-	closeFile();
+	// Closing can still fail (the final io_uring fsync, say), but mustn't throw from here.
+	try
+	{
+		closeFile();
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "ERROR: " << e.what() << std::endl;
+	}
+	if (write_buffer_)
+		write_buffer_->ReportStats();
 }
 
 void FileOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
@@ -22,7 +50,7 @@ void FileOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint
 	// We need to open a new file if we're in "segment" mode and our segment is full
 	// (though we have to wait for the next I frame), or if we're in "split" mode
 	// and recording is being restarted (this is necessarily an I-frame already).
-	if (fp_ == nullptr ||
+	if (!file_open_ ||
 		(options_->segment && (flags & FLAG_KEYFRAME) &&
 		 timestamp_us / 1000 - file_start_time_ms_ > options_->segment) ||
 		(options_->split && (flags & FLAG_RESTART)))
@@ -33,6 +61,15 @@ void FileOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint
 
 	if (options_->verbose)
 		std::cout << "FileOutput: output buffer " << mem << " size " << size << "\n";
+	// Segments start on keyframes, where the muxer repeats the PAT and PMT, so each
+	// transport stream segment can be played on its own.
+	if (ts_muxer_ && size)
+	{
+		ts_buffer_.clear();
+		ts_muxer_->Mux(mem, size, timestamp_us, flags & FLAG_KEYFRAME, ts_buffer_);
+		mem = ts_buffer_.data();
+		size = ts_buffer_.size();
+	}
 	if (fp_ && size)
 	{
 		if (fwrite(mem, size, 1, fp_) != 1)
@@ -40,12 +77,25 @@ void FileOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint
 		if (options_->flush)
 			fflush(fp_);
 	}
+	else if (uring_file_ && file_open_ && size)
+		uring_file_->Write(mem, size);
+	else if (write_buffer_ && file_open_ && size)
+	{
+		if (!write_buffer_->Write(mem, size, flags & FLAG_KEYFRAME) && options_->verbose)
+			std::cout << "FileOutput: write buffer full, frame dropped" << std::endl;
+	}
 }
 
 void FileOutput::openFile(int64_t timestamp_us)
 {
 	if (options_->output == "-")
-		fp_ = stdout;
+	{
+		if (write_buffer_)
+			write_buffer_->SetFile(STDOUT_FILENO);
+		else
+			fp_ = stdout;
+		file_open_ = true;
+	}
 	else if (!options_->output.empty())
 	{
 		// Generate the next output file name.
@@ -57,9 +107,23 @@ void FileOutput::openFile(int64_t timestamp_us)
 		if (n < 0 || n >= sizeof(filename))
 			throw std::runtime_error("failed to generate filename");
 
-		fp_ = fopen(filename, "w");
-		if (!fp_)
-			throw std::runtime_error("failed to open output file " + std::string(filename));
+		// With a write buffer we still open the file here, so that any error is reported straight away.
+		if (uring_file_)
+			uring_file_->Open(filename, options_->direct_io);
+		else if (write_buffer_)
+		{
+			int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd < 0)
+				throw std::runtime_error("failed to open output file " + std::string(filename));
+			write_buffer_->SetFile(fd);
+		}
+		else
+		{
+			fp_ = fopen(filename, "w");
+			if (!fp_)
+				throw std::runtime_error("failed to open output file " + std::string(filename));
+		}
+		file_open_ = true;
 		if (options_->verbose)
 			std::cout << "FileOutput: opened output file " << filename << std::endl;
 
@@ -72,4 +136,9 @@ void FileOutput::closeFile()
 	if (fp_ && fp_ != stdout)
 		fclose(fp_);
 	fp_ = nullptr;
+	if (uring_file_ && file_open_)
+		uring_file_->Close();
+	if (write_buffer_ && file_open_)
+		write_buffer_->SetFile(-1);
+	file_open_ = false;
 }
@@ -7,7 +7,13 @@
 
 #pragma once
 
+#include <memory>
+#include <vector>
+
 #include "output.hpp"
+#include "ts_muxer.hpp"
+#include "uring_file.hpp"
+#include "write_buffer.hpp"
 
 class FileOutput : public Output
 {
@@ -22,6 +28,14 @@ private:
 	void openFile(int64_t timestamp_us);
 	void closeFile();
 	FILE *fp_;
+	// Used instead of fp_ when the output is written from a separate thread.
+	std::unique_ptr<WriteBuffer> write_buffer_;
+	// Or io_uring may be used for files (though never for stdout).
+	std::unique_ptr<UringFile> uring_file_;
+	// Set when writing an MPEG transport stream rather than bare frames.
+	std::unique_ptr<TsMuxer> ts_muxer_;
+	std::vector<uint8_t> ts_buffer_;
+	bool file_open_;
 	unsigned int count_;
 	int64_t file_start_time_ms_;
 };
@@ -0,0 +1,425 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * mp4_output.cpp - write H.264 video to fragmented MP4 files.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <iostream>
+#include <stdexcept>
+
+#include "mp4_output.hpp"
+#include "nal_units.hpp"
+
+// Media timestamps are in units of 1/90000s, as is usual for video.
+static constexpr uint32_t TIMESCALE = 90000;
+static constexpr uint32_t TRACK_ID = 1;
+
+// Sample flags for keyframes, and for frames that depend on others and so can't be seeked to.
+static constexpr uint32_t SYNC_SAMPLE_FLAGS = 0x02000000;
+static constexpr uint32_t NON_SYNC_SAMPLE_FLAGS = 0x01010000;
+
+static void put8(std::vector<uint8_t> &b, uint8_t v)
+{
+	b.push_back(v);
+}
+
+static void put16(std::vector<uint8_t> &b, uint16_t v)
+{
+	b.insert(b.end(), { (uint8_t)(v >> 8), (uint8_t)v });
+}
+
+static void put32(std::vector<uint8_t> &b, uint32_t v)
+{
+	b.insert(b.end(), { (uint8_t)(v >> 24), (uint8_t)(v >> 16), (uint8_t)(v >> 8), (uint8_t)v });
+}
+
+static void put64(std::vector<uint8_t> &b, uint64_t v)
+{
+	put32(b, v >> 32);
+	put32(b, v);
+}
+
+static void put_zeros(std::vector<uint8_t> &b, size_t n)
+{
+	b.insert(b.end(), n, 0);
+}
+
+static void patch32(std::vector<uint8_t> &b, size_t pos, uint32_t v)
+{
+	b[pos] = v >> 24, b[pos + 1] = v >> 16, b[pos + 2] = v >> 8, b[pos + 3] = v;
+}
+
+// Boxes are written with a placeholder size which end_box fills in once the contents are known.
+static size_t begin_box(std::vector<uint8_t> &b, char const *type)
+{
+	size_t pos = b.size();
+	put32(b, 0);
+	b.insert(b.end(), type, type + 4);
+	return pos;
+}
+
+static size_t begin_full_box(std::vector<uint8_t> &b, char const *type, uint8_t version, uint32_t flags)
+{
+	size_t pos = begin_box(b, type);
+	put32(b, (version << 24) | flags);
+	return pos;
+}
+
+static void end_box(std::vector<uint8_t> &b, size_t pos)
+{
+	patch32(b, pos, b.size() - pos);
+}
+
+static void put_matrix(std::vector<uint8_t> &b)
+{
+	for (uint32_t v : { 0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000 })
+		put32(b, v);
+}
+
+// The header of each file: the "ftyp" followed by a "moov" describing a single H.264
+// track whose samples will all be found in the fragments that follow.
+static std::vector<uint8_t> init_segment(unsigned int width, unsigned int height, std::vector<uint8_t> const &sps,
+										 std::vector<uint8_t> const &pps)
+{
+	std::vector<uint8_t> b;
+	size_t ftyp = begin_box(b, "ftyp");
+	b.insert(b.end(), { 'i', 's', 'o', 'm' });
+	put32(b, 0x200);
+	for (char const *brand : { "isom", "iso5", "avc1", "mp41" })
+		b.insert(b.end(), brand, brand + 4);
+	end_box(b, ftyp);
+
+	size_t moov = begin_box(b, "moov");
+	size_t mvhd = begin_full_box(b, "mvhd", 0, 0);
+	put32(b, 0); // creation time
+	put32(b, 0); // modification time
+	put32(b, 1000); // timescale
+	put32(b, 0); // duration, unknown until the fragments are read
+	put32(b, 0x00010000); // rate
+	put16(b, 0x0100); // volume
+	put_zeros(b, 10);
+	put_matrix(b);
+	put_zeros(b, 24);
+	put32(b, TRACK_ID + 1); // next track ID
+	end_box(b, mvhd);
+
+	size_t trak = begin_box(b, "trak");
+	size_t tkhd = begin_full_box(b, "tkhd", 0, 3); // enabled, in movie
+	put32(b, 0);
+	put32(b, 0);
+	put32(b, TRACK_ID);
+	put32(b, 0);
+	put32(b, 0); // duration
+	put_zeros(b, 8);
+	put16(b, 0); // layer
+	put16(b, 0); // alternate group
+	put16(b, 0); // volume
+	put16(b, 0);
+	put_matrix(b);
+	put32(b, width << 16);
+	put32(b, height << 16);
+	end_box(b, tkhd);
+
+	size_t mdia = begin_box(b, "mdia");
+	size_t mdhd = begin_full_box(b, "mdhd", 0, 0);
+	put32(b, 0);
+	put32(b, 0);
+	put32(b, TIMESCALE);
+	put32(b, 0);
+	put16(b, 0x55c4); // "und"
+	put16(b, 0);
+	end_box(b, mdhd);
+
+	size_t hdlr = begin_full_box(b, "hdlr", 0, 0);
+	put32(b, 0);
+	b.insert(b.end(), { 'v', 'i', 'd', 'e' });
+	put_zeros(b, 12);
+	static char const handler_name[] = "VideoHandler";
+	b.insert(b.end(), handler_name, handler_name + sizeof(handler_name));
+	end_box(b, hdlr);
+
+	size_t minf = begin_box(b, "minf");
+	size_t vmhd = begin_full_box(b, "vmhd", 0, 1);
+	put_zeros(b, 8); // graphics mode and opcolor
+	end_box(b, vmhd);
+	size_t dinf = begin_box(b, "dinf");
+	size_t dref = begin_full_box(b, "dref", 0, 0);
+	put32(b, 1);
+	end_box(b, begin_full_box(b, "url ", 0, 1)); // the data is in this file
+	end_box(b, dref);
+	end_box(b, dinf);
+
+	size_t stbl = begin_box(b, "stbl");
+	size_t stsd = begin_full_box(b, "stsd", 0, 0);
+	put32(b, 1);
+	size_t avc1 = begin_box(b, "avc1");
+	put_zeros(b, 6);
+	put16(b, 1); // data reference index
+	put_zeros(b, 16);
+	put16(b, width);
+	put16(b, height);
+	put32(b, 0x00480000); // 72dpi
+	put32(b, 0x00480000);
+	put32(b, 0);
+	put16(b, 1); // frame count
+	put_zeros(b, 32); // compressor name
+	put16(b, 0x0018); // depth
+	put16(b, 0xffff);
+
+	size_t avcc = begin_box(b, "avcC");
+	put8(b, 1);
+	put8(b, sps[1]); // profile
+	put8(b, sps[2]); // profile compatibility
+	put8(b, sps[3]); // level
+	put8(b, 0xff); // 4 byte NAL unit lengths
+	put8(b, 0xe1); // one SPS
+	put16(b, sps.size());
+	b.insert(b.end(), sps.begin(), sps.end());
+	put8(b, 1); // one PPS
+	put16(b, pps.size());
+	b.insert(b.end(), pps.begin(), pps.end());
+	if (sps[1] == 100 || sps[1] == 110 || sps[1] == 122 || sps[1] == 144)
+	{
+		// The high profiles want the chroma format and bit depths too. The encoder
+		// only ever produces 8-bit 4:2:0.
+		put8(b, 0xfc | 1);
+		put8(b, 0xf8 | 0);
+		put8(b, 0xf8 | 0);
+		put8(b, 0); // no SPS extensions
+	}
+	end_box(b, avcc);
+	end_box(b, avc1);
+	end_box(b, stsd);
+
+	// The sample tables are all empty; the samples are listed in the fragments.
+	for (char const *type : { "stts", "stsc", "stco" })
+	{
+		size_t box = begin_full_box(b, type, 0, 0);
+		put32(b, 0);
+		end_box(b, box);
+	}
+	size_t stsz = begin_full_box(b, "stsz", 0, 0);
+	put32(b, 0);
+	put32(b, 0);
+	end_box(b, stsz);
+	end_box(b, stbl);
+	end_box(b, minf);
+	end_box(b, mdia);
+	end_box(b, trak);
+
+	size_t mvex = begin_box(b, "mvex");
+	size_t trex = begin_full_box(b, "trex", 0, 0);
+	put32(b, TRACK_ID);
+	put32(b, 1); // sample description index
+	put32(b, 0); // default duration, size and flags, all given in each fragment
+	put32(b, 0);
+	put32(b, 0);
+	end_box(b, trex);
+	end_box(b, mvex);
+	end_box(b, moov);
+	return b;
+}
+
+Mp4Output::Mp4Output(VideoOptions const *options)
+	: Output(options), fd_(-1), count_(0), file_start_time_us_(0), width_(0), height_(0), sequence_(0),
+	  last_duration_(0)
+{
+	if (options->codec != "h264")
+		throw std::runtime_error("MP4 output only supports h264");
+}
+
+Mp4Output::~Mp4Output()
+{
+	closeFile();
+}
+
+void Mp4Output::SetVideoFormat(unsigned int width, unsigned int height, unsigned int stride)
+{
+	width_ = width;
+	height_ = height;
+}
+
+int64_t Mp4Output::mediaTime(int64_t timestamp_us) const
+{
+	return (timestamp_us - file_start_time_us_) * TIMESCALE / 1000000;
+}
+
+void Mp4Output::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	if (!width_)
+		throw std::runtime_error("MP4 output has not been given the frame format");
+
+	// The parameter sets go in the file header, not the samples, and we don't need
+	// access unit delimiters at all.
+	auto nal_units = split_nal_units((uint8_t const *)mem, size);
+	std::vector<std::pair<uint8_t const *, size_t>> frame_nal_units;
+	for (auto const &nal_unit : nal_units)
+	{
+		if (!nal_unit.second)
+			continue;
+		unsigned int type = nal_unit.first[0] & 0x1f;
+		if (type == 7)
+			sps_.assign(nal_unit.first, nal_unit.first + nal_unit.second);
+		else if (type == 8)
+			pps_.assign(nal_unit.first, nal_unit.first + nal_unit.second);
+		else if (type != 9)
+			frame_nal_units.push_back(nal_unit);
+	}
+	if (frame_nal_units.empty())
+		return;
+
+	bool keyframe = flags & FLAG_KEYFRAME;
+	bool new_file = fd_ < 0 ||
+					(options_->segment && keyframe &&
+					 timestamp_us / 1000 - file_start_time_us_ / 1000 > options_->segment) ||
+					(options_->split && (flags & FLAG_RESTART));
+
+	// Each keyframe starts a new fragment, at which point we know how long the last
+	// frame of the previous one lasted.
+	if (!samples_.empty() && (keyframe || new_file))
+		writeFragment(timestamp_us);
+	if (new_file)
+	{
+		closeFile();
+		openFile(timestamp_us);
+	}
+
+	if (options_->verbose)
+		std::cout << "Mp4Output: output buffer " << mem << " size " << size << "\n";
+
+	size_t start = mdat_.size();
+	for (auto const &nal_unit : frame_nal_units)
+	{
+		put32(mdat_, nal_unit.second);
+		mdat_.insert(mdat_.end(), nal_unit.first, nal_unit.first + nal_unit.second);
+	}
+	samples_.push_back({ (uint32_t)(mdat_.size() - start), timestamp_us, keyframe });
+}
+
+void Mp4Output::writeFragment(int64_t next_timestamp_us)
+{
+	// Each frame lasts until the next one starts. When there is no next frame (at the end
+	// of the file) we assume the last frame lasted as long as the one before it.
+	std::vector<uint32_t> durations(samples_.size());
+	auto duration = [this](int64_t from_us, int64_t to_us) {
+		return (uint32_t)std::max<int64_t>(mediaTime(to_us) - mediaTime(from_us), 0);
+	};
+	for (size_t i = 0; i + 1 < samples_.size(); i++)
+		durations[i] = duration(samples_[i].timestamp_us, samples_[i + 1].timestamp_us);
+	if (next_timestamp_us >= 0)
+		durations.back() = duration(samples_.back().timestamp_us, next_timestamp_us);
+	else if (samples_.size() > 1)
+		durations.back() = durations[samples_.size() - 2];
+	else if (last_duration_)
+		durations.back() = last_duration_;
+	else
+		durations.back() = std::lround(TIMESCALE / (options_->framerate > 0 ? options_->framerate : 30));
+	last_duration_ = durations.back();
+
+	std::vector<uint8_t> b;
+	size_t moof = begin_box(b, "moof");
+	size_t mfhd = begin_full_box(b, "mfhd", 0, 0);
+	put32(b, ++sequence_);
+	end_box(b, mfhd);
+	size_t traf = begin_box(b, "traf");
+	size_t tfhd = begin_full_box(b, "tfhd", 0, 0x020000); // offsets are relative to the moof
+	put32(b, TRACK_ID);
+	end_box(b, tfhd);
+	size_t tfdt = begin_full_box(b, "tfdt", 1, 0);
+	put64(b, mediaTime(samples_[0].timestamp_us));
+	end_box(b, tfdt);
+	size_t trun = begin_full_box(b, "trun", 0, 0x000701); // data offset, and each sample's duration, size and flags
+	put32(b, samples_.size());
+	size_t data_offset = b.size();
+	put32(b, 0);
+	for (size_t i = 0; i < samples_.size(); i++)
+	{
+		put32(b, durations[i]);
+		put32(b, samples_[i].size);
+		put32(b, samples_[i].keyframe ? SYNC_SAMPLE_FLAGS : NON_SYNC_SAMPLE_FLAGS);
+	}
+	end_box(b, trun);
+	end_box(b, traf);
+	end_box(b, moof);
+
+	if (mdat_.size() > UINT32_MAX - 8)
+		throw std::runtime_error("MP4 fragment too large");
+	patch32(b, data_offset, b.size() + 8); // the samples start after the mdat header
+	put32(b, mdat_.size() + 8);
+	b.insert(b.end(), { 'm', 'd', 'a', 't' });
+
+	writeAll(b.data(), b.size());
+	writeAll(mdat_.data(), mdat_.size());
+	if (options_->flush)
+		fdatasync(fd_);
+
+	samples_.clear();
+	mdat_.clear();
+}
+
+void Mp4Output::writeAll(void const *mem, size_t size)
+{
+	uint8_t const *ptr = (uint8_t const *)mem;
+	while (size)
+	{
+		ssize_t n = write(fd_, ptr, size);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error("failed to write output bytes");
+		}
+		ptr += n;
+		size -= n;
+	}
+}
+
+void Mp4Output::openFile(int64_t timestamp_us)
+{
+	if (sps_.size() < 4 || pps_.empty())
+		throw std::runtime_error("MP4 output has no SPS/PPS headers for the stream (try --inline)");
+
+	if (options_->output == "-")
+		fd_ = STDOUT_FILENO;
+	else
+	{
+		// Generate the next output file name.
+		char filename[256];
+		int n = snprintf(filename, sizeof(filename), options_->output.c_str(), count_);
+		count_++;
+		if (options_->wrap)
+			count_ = count_ % options_->wrap;
+		if (n < 0 || n >= (int)sizeof(filename))
+			throw std::runtime_error("failed to generate filename");
+
+		fd_ = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd_ < 0)
+			throw std::runtime_error("failed to open output file " + std::string(filename));
+		if (options_->verbose)
+			std::cout << "Mp4Output: opened output file " << filename << std::endl;
+	}
+
+	// Every file has its own header, and its media timeline starts from zero.
+	file_start_time_us_ = timestamp_us;
+	sequence_ = 0;
+	std::vector<uint8_t> header = init_segment(width_, height_, sps_, pps_);
+	writeAll(header.data(), header.size());
+}
+
+void Mp4Output::closeFile()
+{
+	if (fd_ < 0)
+		return;
+	if (!samples_.empty())
+		writeFragment(-1);
+	if (fd_ != STDOUT_FILENO)
+		close(fd_);
+	fd_ = -1;
+}
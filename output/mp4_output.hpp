@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * mp4_output.hpp - write H.264 video to fragmented MP4 files.
+ */
+
+#pragma once
+
+#include <vector>
+
+#include "output.hpp"
+
+// Writes H.264 into fragmented MP4 files. Each file starts with a header (the
+// "moov") describing the stream but listing no samples; after that, every GOP is
+// written as a "moof" giving each frame's size, duration and keyframe flag,
+// followed by an "mdat" holding the frames themselves. Durations come from the
+// frames' real timestamps, so variable framerates are recorded faithfully. A file
+// is playable up to the last complete GOP even if it's never closed properly.
+class Mp4Output : public Output
+{
+public:
+	Mp4Output(VideoOptions const *options);
+	~Mp4Output();
+	void SetVideoFormat(unsigned int width, unsigned int height, unsigned int stride) override;
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	struct Sample
+	{
+		uint32_t size;
+		int64_t timestamp_us;
+		bool keyframe;
+	};
+	void openFile(int64_t timestamp_us);
+	void closeFile();
+	void writeFragment(int64_t next_timestamp_us);
+	void writeAll(void const *mem, size_t size);
+	int64_t mediaTime(int64_t timestamp_us) const;
+	int fd_;
+	unsigned int count_;
+	int64_t file_start_time_us_;
+	unsigned int width_, height_;
+	std::vector<uint8_t> sps_, pps_;
+	// The frames of the GOP we're collecting, and their data (as length-prefixed NAL units).
+	std::vector<Sample> samples_;
+	std::vector<uint8_t> mdat_;
+	uint32_t sequence_;
+	uint32_t last_duration_;
+};
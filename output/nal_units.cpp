@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * nal_units.cpp - find the NAL units in H.264 output.
+ */
+
+#include "nal_units.hpp"
+
+std::vector<std::pair<uint8_t const *, size_t>> split_nal_units(uint8_t const *data, size_t size)
+{
+	std::vector<std::pair<uint8_t const *, size_t>> nal_units;
+	uint8_t const *start = nullptr;
+	for (size_t i = 0; i + 3 <= size; i++)
+	{
+		if (data[i] != 0 || data[i + 1] != 0 || data[i + 2] != 1)
+			continue;
+		if (start)
+			nal_units.emplace_back(start, data + i - start);
+		start = data + i + 3;
+		i += 2;
+	}
+	if (start)
+		nal_units.emplace_back(start, data + size - start);
+
+	// Trailing zeros belong to the next start code (or are padding), not to the NAL unit.
+	for (auto &nal_unit : nal_units)
+	{
+		while (nal_unit.second && nal_unit.first[nal_unit.second - 1] == 0)
+			nal_unit.second--;
+	}
+	return nal_units;
+}
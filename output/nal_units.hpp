@@ -0,0 +1,17 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * nal_units.hpp - find the NAL units in H.264 output.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Split an Annex B byte stream (as produced by the encoder) into its NAL units,
+// returning the start and size of each one, without its start code.
+std::vector<std::pair<uint8_t const *, size_t>> split_nal_units(uint8_t const *data, size_t size);
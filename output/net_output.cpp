@@ -7,18 +7,27 @@
 
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <cerrno>
 
 #include "net_output.hpp"
 
+// How far (in frames, so about a second) a client of the TCP server may fall behind
+// before we drop frames for it.
+static constexpr unsigned int MAX_QUEUED_FRAMES = 30;
+
 NetOutput::NetOutput(VideoOptions const *options) : Output(options)
 {
-	char protocol[4];
+	char protocol[5];
 	int start, end, a, b, c, d, port;
-	if (sscanf(options->output.c_str(), "%3s://%n%d.%d.%d.%d%n:%d", protocol, &start, &a, &b, &c, &d, &end, &port) != 6)
+	char const *format = "%4[a-z]://%n%d.%d.%d.%d%n:%d";
+	if (sscanf(options->output.c_str(), format, protocol, &start, &a, &b, &c, &d, &end, &port) != 6)
 		throw std::runtime_error("bad network address " + options->output);
 	std::string address = options->output.substr(start, end - start);
 
-	if (strcmp(protocol, "udp") == 0)
+	if (strcmp(protocol, "udp") == 0 || strcmp(protocol, "rtp") == 0)
 	{
 		saddr_ = {};
 		saddr_.sin_family = AF_INET;
@@ -35,32 +44,12 @@ NetOutput::NetOutput(VideoOptions const *options) : Output(options)
 	}
 	else if (strcmp(protocol, "tcp") == 0)
 	{
-		// WARNING: I've not actually tried this yet...
 		if (options->listen)
 		{
-			// We are the server.
-			int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-			if (listen_fd < 0)
-				throw std::runtime_error("unable to open listen socket");
-
-			sockaddr_in server_saddr = {};
-			server_saddr.sin_family = AF_INET;
-			server_saddr.sin_addr.s_addr = INADDR_ANY;
-			server_saddr.sin_port = htons(port);
-
-			if (bind(listen_fd, (struct sockaddr *)&server_saddr, sizeof(server_saddr)) < 0)
-				throw std::runtime_error("failed to bind listen socket");
-			listen(listen_fd, 1);
-
-			if (options->verbose)
-				std::cout << "Waiting for client to connect..." << std::endl;
-			fd_ = accept(listen_fd, (struct sockaddr *)&saddr_, &sockaddr_in_size_);
-			if (fd_ < 0)
-				throw std::runtime_error("accept socket failed");
-			if (options->verbose)
-				std::cout << "Client connection accepted" << std::endl;
-
-			close(listen_fd);
+			// We are the server. Clients come and go as they like, served from another thread.
+			server_ = std::make_unique<StreamServer>(port, StreamServer::Protocol::Raw, MAX_QUEUED_FRAMES,
+													 options->verbose);
+			fd_ = -1;
 		}
 		else
 		{
@@ -86,19 +75,122 @@ NetOutput::NetOutput(VideoOptions const *options) : Output(options)
 		saddr_ptr_ = NULL; // sendto doesn't want these for tcp
 		sockaddr_in_size_ = 0;
 	}
+	else if (strcmp(protocol, "http") == 0)
+	{
+		// An HTTP server for MJPEG. Every frame is a keyframe, and slow clients only ever
+		// have the newest frame waiting, so they skip straight to it.
+		if (options->codec != "mjpeg")
+			throw std::runtime_error("HTTP output only supports mjpeg");
+		server_ = std::make_unique<StreamServer>(port, StreamServer::Protocol::HttpMjpeg, 1, options->verbose);
+		fd_ = -1;
+		saddr_ptr_ = NULL;
+		sockaddr_in_size_ = 0;
+	}
+	else if (strcmp(protocol, "rtsp") == 0)
+	{
+		// An RTSP server. Each frame is packetised once, for all the clients.
+		if (options->codec != "h264")
+			throw std::runtime_error("RTSP output only supports h264");
+		if (options->mpegts)
+			throw std::runtime_error("MPEG-TS cannot be sent over RTSP");
+		server_ = std::make_unique<StreamServer>(port, StreamServer::Protocol::Rtsp, MAX_QUEUED_FRAMES,
+												 options->verbose);
+		fd_ = -1;
+		saddr_ptr_ = NULL;
+		sockaddr_in_size_ = 0;
+	}
 	else
 		throw std::runtime_error("unrecognised network protocol " + options->output);
+
+	if (strcmp(protocol, "rtp") == 0)
+	{
+		if (options->codec != "h264")
+			throw std::runtime_error("RTP output only supports h264");
+		if (options->mpegts)
+			throw std::runtime_error("MPEG-TS cannot be sent over RTP");
+		rtp_packetiser_ = std::make_unique<RtpPacketiser>();
+	}
+	else if (options->mpegts)
+		ts_muxer_ = std::make_unique<TsMuxer>();
 }
 
 NetOutput::~NetOutput()
 {
-	close(fd_);
+	if (server_)
+		server_->ReportStats();
+	if (fd_ >= 0)
+		close(fd_);
 }
 
-void NetOutput::outputBuffer(void *mem, size_t size, int64_t /*timestamp_us*/, uint32_t /*flags*/)
+void NetOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
 {
 	if (options_->verbose)
 		std::cout << "NetOutput: output buffer " << mem << " size " << size << "\n";
+
+	if (rtp_packetiser_)
+	{
+		iov_.clear();
+		for (auto const &packet : rtp_packetiser_->Packetise(mem, size, timestamp_us))
+		{
+			iov_.push_back({ (void *)packet.header, packet.header_size });
+			iov_.push_back({ (void *)packet.payload, packet.payload_size });
+		}
+		sendDatagrams(2);
+		return;
+	}
+
+	if (ts_muxer_)
+	{
+		ts_buffer_.clear();
+		ts_muxer_->Mux(mem, size, timestamp_us, flags & FLAG_KEYFRAME, ts_buffer_);
+		if (saddr_ptr_)
+		{
+			// Over UDP, each datagram holds a whole number of TS packets, so a lost
+			// datagram never leaves receivers with a partial packet.
+			size_t datagram_size = TsMuxer::PACKETS_PER_DATAGRAM * TsMuxer::PACKET_SIZE;
+			iov_.clear();
+			for (size_t pos = 0; pos < ts_buffer_.size(); pos += datagram_size)
+				iov_.push_back({ &ts_buffer_[pos], std::min(datagram_size, ts_buffer_.size() - pos) });
+			sendDatagrams(1);
+			return;
+		}
+		mem = ts_buffer_.data();
+		size = ts_buffer_.size();
+	}
+
+	if (server_)
+	{
+		server_->Send(mem, size, timestamp_us, flags & FLAG_KEYFRAME);
+		return;
+	}
 	if (sendto(fd_, mem, size, 0, saddr_ptr_, sockaddr_in_size_) < 0)
 		throw std::runtime_error("failed to send data on socket");
 }
+
+// Send the datagrams made from each consecutive group of iovecs in iov_, with as few
+// sendmmsg calls as possible (normally just one).
+void NetOutput::sendDatagrams(unsigned int iovs_per_datagram)
+{
+	unsigned int num_datagrams = iov_.size() / iovs_per_datagram;
+	msgs_.resize(num_datagrams);
+	for (unsigned int i = 0; i < num_datagrams; i++)
+	{
+		msgs_[i] = {};
+		msgs_[i].msg_hdr.msg_name = (void *)saddr_ptr_;
+		msgs_[i].msg_hdr.msg_namelen = sockaddr_in_size_;
+		msgs_[i].msg_hdr.msg_iov = &iov_[i * iovs_per_datagram];
+		msgs_[i].msg_hdr.msg_iovlen = iovs_per_datagram;
+	}
+
+	for (unsigned int sent = 0; sent < num_datagrams;)
+	{
+		int n = sendmmsg(fd_, &msgs_[sent], num_datagrams - sent, 0);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error("failed to send data on socket");
+		}
+		sent += n;
+	}
+}
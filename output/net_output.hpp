@@ -8,8 +8,15 @@
 #pragma once
 
 #include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <memory>
+#include <vector>
 
 #include "output.hpp"
+#include "rtp_packetiser.hpp"
+#include "stream_server.hpp"
+#include "ts_muxer.hpp"
 
 class NetOutput : public Output
 {
@@ -21,8 +28,19 @@ protected:
 	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
 
 private:
+	void sendDatagrams(unsigned int iovs_per_datagram);
 	int fd_;
 	sockaddr_in saddr_;
 	const sockaddr *saddr_ptr_;
 	socklen_t sockaddr_in_size_;
+	// Set when sending an MPEG transport stream rather than bare frames.
+	std::unique_ptr<TsMuxer> ts_muxer_;
+	std::vector<uint8_t> ts_buffer_;
+	// Or set when sending RTP, in place of bare frames.
+	std::unique_ptr<RtpPacketiser> rtp_packetiser_;
+	// The datagrams for each frame, all sent at once.
+	std::vector<iovec> iov_;
+	std::vector<mmsghdr> msgs_;
+	// Used in place of fd_ when we listen for TCP clients.
+	std::unique_ptr<StreamServer> server_;
 };
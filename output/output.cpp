@@ -6,12 +6,16 @@
  */
 
 #include <cinttypes>
+#include <cstring>
 #include <stdexcept>
 
 #include "circular_output.hpp"
 #include "file_output.hpp"
+#include "mp4_output.hpp"
 #include "net_output.hpp"
 #include "output.hpp"
+#include "shm_output.hpp"
+#include "y4m_output.hpp"
 
 Output::Output(VideoOptions const *options)
 	: state_(WAITING_KEYFRAME), options_(options), fp_timestamps_(nullptr), time_offset_(0), last_timestamp_(0)
@@ -70,10 +74,19 @@ void Output::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t
 
 Output *Output::Create(VideoOptions const *options)
 {
-	if (strncmp(options->output.c_str(), "udp://", 6) == 0 || strncmp(options->output.c_str(), "tcp://", 6) == 0)
+	if (strncmp(options->output.c_str(), "udp://", 6) == 0 || strncmp(options->output.c_str(), "tcp://", 6) == 0 ||
+		strncmp(options->output.c_str(), "rtp://", 6) == 0 || strncmp(options->output.c_str(), "http://", 7) == 0 ||
+		strncmp(options->output.c_str(), "rtsp://", 7) == 0)
 		return new NetOutput(options);
+	else if (strncmp(options->output.c_str(), "shm://", 6) == 0)
+		return new ShmOutput(options);
 	else if (options->circular)
 		return new CircularOutput(options);
+	else if (options->y4m)
+		return new Y4mOutput(options);
+	else if (options->output.size() >= 4 &&
+			 strcasecmp(options->output.c_str() + options->output.size() - 4, ".mp4") == 0)
+		return new Mp4Output(options);
 	else if (!options->output.empty())
 		return new FileOutput(options);
 	else
@@ -21,6 +21,9 @@ public:
 	Output(VideoOptions const *options);
 	virtual ~Output();
 	virtual void Signal(); // a derived class might redefine what this means
+	// Uncompressed (yuv420) outputs may need to know the frame dimensions. This is
+	// called once the camera is configured, before any buffers arrive.
+	virtual void SetVideoFormat(unsigned int width, unsigned int height, unsigned int stride) {}
 	void OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe);
 
 protected:
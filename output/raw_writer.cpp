@@ -0,0 +1,134 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * raw_writer.cpp - write the raw stream alongside the encoded video.
+ */
+
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include "output.hpp"
+#include "raw_writer.hpp"
+
+RawWriter::RawWriter(VideoOptions const *options, libcamera::StreamConfiguration const &config,
+					 std::string const &cam_name)
+	: raw_options_(*options), height_(config.size.height), stride_(config.stride), enable_(!options->pause),
+	  frames_written_(0), frames_dropped_(0), abort_(false)
+{
+	std::string const &filename = options->raw_output;
+	if (filename.size() >= 4 && strcasecmp(filename.c_str() + filename.size() - 4, ".dng") == 0)
+	{
+		// The DngWriter has threads of its own and does its own reporting.
+		dng_writer_ = std::make_unique<DngWriter>(options, filename, config, cam_name);
+		return;
+	}
+
+	// The raw output gets its own copy of the options, naming its own file. Pausing is
+	// handled here, the video output keeps the timestamp file to itself, and the raw
+	// frames are never wrapped in a transport stream or Y4M. (The options check the name
+	// is a plain file or a socket, so none of the other containers get chosen either.)
+	raw_options_.output = filename;
+	raw_options_.save_pts.clear();
+	raw_options_.circular = false;
+	raw_options_.pause = false;
+	raw_options_.mpegts = false;
+	raw_options_.y4m = false;
+	output_ = std::unique_ptr<Output>(Output::Create(&raw_options_));
+	writer_thread_ = std::thread(&RawWriter::writerThread, this);
+}
+
+RawWriter::~RawWriter()
+{
+	if (dng_writer_)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+		cond_var_.notify_one();
+	}
+	writer_thread_.join();
+	std::cout << "Raw output: " << frames_written_ << " frames written, " << frames_dropped_ << " dropped (stride "
+			  << stride_ << ", height " << height_ << ")" << std::endl;
+}
+
+void RawWriter::Signal()
+{
+	enable_ = !enable_;
+	// Frames skipped while paused are not dropped frames.
+	if (enable_ && dng_writer_)
+		dng_writer_->Resync();
+}
+
+void RawWriter::Write(void const *mem, unsigned int sequence, int64_t timestamp_us,
+					  libcamera::ControlList const &metadata)
+{
+	if (!enable_)
+		return;
+
+	if (dng_writer_)
+	{
+		dng_writer_->Write(mem, sequence, metadata);
+		return;
+	}
+
+	Frame frame;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (queue_.size() >= MAX_QUEUED_FRAMES)
+		{
+			frames_dropped_++;
+			return;
+		}
+		if (!free_buffers_.empty())
+		{
+			frame.data = std::move(free_buffers_.back());
+			free_buffers_.pop_back();
+		}
+	}
+	// Copy outside the lock so that the writer thread is never kept waiting.
+	size_t size = stride_ * height_;
+	frame.data.resize(size);
+	memcpy(&frame.data[0], mem, size);
+	frame.timestamp_us = timestamp_us;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	queue_.push(std::move(frame));
+	cond_var_.notify_one();
+}
+
+void RawWriter::writerThread()
+{
+	while (true)
+	{
+		Frame frame;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			cond_var_.wait(lock, [this] { return abort_ || !queue_.empty(); });
+			// Finish writing anything that's queued before we stop.
+			if (queue_.empty())
+				return;
+			frame = std::move(queue_.front());
+			queue_.pop();
+		}
+		bool written = true;
+		try
+		{
+			output_->OutputReady(&frame.data[0], frame.data.size(), frame.timestamp_us, true);
+		}
+		catch (std::exception const &e)
+		{
+			// A bad raw frame shouldn't stop the video recording.
+			std::cerr << "ERROR: raw frame not written: " << e.what() << std::endl;
+			written = false;
+		}
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (written)
+			frames_written_++;
+		else
+			frames_dropped_++;
+		free_buffers_.push_back(std::move(frame.data));
+	}
+}
@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * raw_writer.hpp - write the raw stream alongside the encoded video.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include <libcamera/controls.h>
+#include <libcamera/stream.h>
+
+#include "core/video_options.hpp"
+
+#include "dng_writer.hpp"
+
+class Output;
+
+// Sends raw frames to their own output, either a flat file (or network socket),
+// on a thread of its own, or a DNG file per frame (using a DngWriter) when the output
+// name ends in ".dng". Each frame is copied as it arrives so that the camera buffer
+// can go back straight away. If the writer falls behind, frames are dropped and
+// counted rather than holding up the video.
+class RawWriter
+{
+public:
+	RawWriter(VideoOptions const *options, libcamera::StreamConfiguration const &config, std::string const &cam_name);
+	~RawWriter();
+	void Write(void const *mem, unsigned int sequence, int64_t timestamp_us, libcamera::ControlList const &metadata);
+	// Pause or resume writing, like the video output.
+	void Signal();
+
+private:
+	static constexpr unsigned int MAX_QUEUED_FRAMES = 8;
+	struct Frame
+	{
+		std::vector<uint8_t> data;
+		int64_t timestamp_us;
+	};
+	void writerThread();
+
+	VideoOptions raw_options_;
+	int height_, stride_;
+	std::unique_ptr<Output> output_;
+	std::unique_ptr<DngWriter> dng_writer_;
+	std::atomic<bool> enable_;
+	unsigned int frames_written_;
+	unsigned int frames_dropped_;
+	std::queue<Frame> queue_;
+	std::vector<std::vector<uint8_t>> free_buffers_;
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	bool abort_;
+	std::thread writer_thread_;
+};
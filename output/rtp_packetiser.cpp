@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * rtp_packetiser.cpp - split H.264 frames into RTP packets (RFC 6184).
+ */
+
+#include <algorithm>
+#include <random>
+
+#include "nal_units.hpp"
+#include "rtp_packetiser.hpp"
+
+static constexpr size_t RTP_HEADER_SIZE = 12;
+static constexpr uint8_t NAL_TYPE_FU_A = 28;
+
+RtpPacketiser::RtpPacketiser()
+{
+	// RFC 3550 wants the SSRC, and the starting sequence number and timestamp, to be random.
+	std::random_device rd;
+	sequence_ = rd();
+	ssrc_ = rd();
+	timestamp_offset_ = rd();
+}
+
+std::vector<RtpPacketiser::Packet> const &RtpPacketiser::Packetise(void const *mem, size_t size, int64_t timestamp_us)
+{
+	headers_.clear();
+	packets_.clear();
+	uint32_t timestamp = timestamp_offset_ + (uint32_t)(timestamp_us * 9 / 100);
+	size_t max_payload = MAX_PACKET_SIZE - RTP_HEADER_SIZE;
+
+	for (auto const &nal_unit : split_nal_units((uint8_t const *)mem, size))
+	{
+		uint8_t const *data = nal_unit.first;
+		size_t remaining = nal_unit.second;
+		if (!remaining)
+			continue;
+		if (remaining <= max_payload)
+		{
+			addPacket(timestamp, nullptr, data, remaining);
+			continue;
+		}
+
+		// Fragments replace the NAL unit header with the FU indicator and FU header.
+		uint8_t fu[2] = { (uint8_t)((data[0] & 0xe0) | NAL_TYPE_FU_A), (uint8_t)(0x80 | (data[0] & 0x1f)) };
+		data++, remaining--;
+		while (remaining)
+		{
+			size_t n = std::min(remaining, max_payload - sizeof(fu));
+			if (n == remaining)
+				fu[1] |= 0x40;
+			addPacket(timestamp, fu, data, n);
+			fu[1] &= ~0x80;
+			data += n, remaining -= n;
+		}
+	}
+	if (packets_.empty())
+		return packets_;
+
+	headers_[headers_.size() - packets_.back().header_size + 1] |= 0x80; // marker bit on the frame's last packet
+	size_t offset = 0;
+	for (auto &packet : packets_)
+	{
+		packet.header = &headers_[offset];
+		offset += packet.header_size;
+	}
+	return packets_;
+}
+
+// The headers are gathered in headers_, which may move as it grows, so the packets are
+// only pointed at them once they're all there.
+void RtpPacketiser::addPacket(uint32_t timestamp, uint8_t const *fu, uint8_t const *payload, size_t payload_size)
+{
+	headers_.insert(headers_.end(), { 0x80, PAYLOAD_TYPE, (uint8_t)(sequence_ >> 8), (uint8_t)sequence_,
+									  (uint8_t)(timestamp >> 24), (uint8_t)(timestamp >> 16),
+									  (uint8_t)(timestamp >> 8), (uint8_t)timestamp, (uint8_t)(ssrc_ >> 24),
+									  (uint8_t)(ssrc_ >> 16), (uint8_t)(ssrc_ >> 8), (uint8_t)ssrc_ });
+	if (fu)
+		headers_.insert(headers_.end(), fu, fu + 2);
+	sequence_++;
+	packets_.push_back({ nullptr, fu ? RTP_HEADER_SIZE + 2 : RTP_HEADER_SIZE, payload, payload_size });
+}
@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * rtp_packetiser.hpp - split H.264 frames into RTP packets (RFC 6184).
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Turns H.264 frames into RTP packets, in RFC 6184's non-interleaved mode. NAL
+// units that fit in a packet are sent whole; larger ones are split into FU-A
+// fragments. Every packet of a frame has the frame's timestamp (on the 90kHz RTP
+// clock), and the last one has the marker bit set.
+class RtpPacketiser
+{
+public:
+	// Small enough to leave room for IP and UDP headers (and a little tunnelling)
+	// within a 1500 byte MTU.
+	static constexpr size_t MAX_PACKET_SIZE = 1400;
+	static constexpr uint8_t PAYLOAD_TYPE = 96;
+
+	// Each packet is a header (the RTP header, plus the FU-A indicator and header
+	// for fragments) followed by a piece of the frame.
+	struct Packet
+	{
+		uint8_t const *header;
+		size_t header_size;
+		uint8_t const *payload;
+		size_t payload_size;
+	};
+
+	RtpPacketiser();
+
+	// Split one frame of Annex B H.264 into packets. These point into the frame and into
+	// the packetiser's own memory, so they're only valid until the next call.
+	std::vector<Packet> const &Packetise(void const *mem, size_t size, int64_t timestamp_us);
+
+private:
+	void addPacket(uint32_t timestamp, uint8_t const *fu, uint8_t const *payload, size_t payload_size);
+	uint16_t sequence_;
+	uint32_t ssrc_;
+	uint32_t timestamp_offset_;
+	std::vector<uint8_t> headers_;
+	std::vector<Packet> packets_;
+};
@@ -0,0 +1,174 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * shm_output.cpp - publish frames in shared memory for local readers.
+ */
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <stdexcept>
+
+#include "shm_output.hpp"
+
+ShmOutput::ShmOutput(VideoOptions const *options) : Output(options), sequence_(0), position_(0)
+{
+	socket_path_ = options->output.substr(strlen("shm://"));
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (socket_path_.empty() || socket_path_.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error("bad shared memory socket path " + options->output);
+	strcpy(addr.sun_path, socket_path_.c_str());
+
+	// The frame data starts on a page boundary after the header.
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t header_size = (sizeof(ShmRingHeader) + page_size - 1) / page_size * page_size;
+	size_t data_size = (size_t)options->shm_size << 20;
+	map_size_ = header_size + data_size;
+
+	memfd_ = memfd_create("libcamera-vid", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd_ < 0)
+		throw std::runtime_error("failed to create shared memory");
+	if (ftruncate(memfd_, map_size_) < 0)
+		throw std::runtime_error("failed to size shared memory");
+	void *map = mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED, memfd_, 0);
+	if (map == MAP_FAILED)
+		throw std::runtime_error("failed to map shared memory");
+	// Readers may rely on the size never changing, and (where the kernel allows) only we can write.
+	int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+#ifdef F_SEAL_FUTURE_WRITE
+	if (fcntl(memfd_, F_ADD_SEALS, seals | F_SEAL_FUTURE_WRITE) < 0)
+#endif
+		if (fcntl(memfd_, F_ADD_SEALS, seals) < 0)
+			throw std::runtime_error("failed to seal shared memory");
+
+	header_ = new (map) ShmRingHeader();
+	header_->magic = ShmRingHeader::MAGIC;
+	header_->version = ShmRingHeader::VERSION;
+	header_->header_size = header_size;
+	header_->data_size = data_size;
+	strncpy(header_->codec, options->codec.c_str(), sizeof(header_->codec) - 1);
+	data_ = (uint8_t *)map + header_size;
+
+	// A socket left behind by an earlier run would stop us binding to the path.
+	struct stat st;
+	if (stat(socket_path_.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(socket_path_.c_str());
+	listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listen_fd_ < 0)
+		throw std::runtime_error("unable to open unix socket");
+	if (bind(listen_fd_, (sockaddr *)&addr, sizeof(addr)) < 0)
+		throw std::runtime_error("failed to bind unix socket to " + socket_path_);
+	if (listen(listen_fd_, 8) < 0)
+		throw std::runtime_error("failed to listen on unix socket");
+
+	if (options_->verbose)
+		std::cout << "ShmOutput: " << data_size << " byte ring, readers connect to " << socket_path_ << std::endl;
+	socket_thread_ = std::thread(&ShmOutput::socketThread, this);
+}
+
+ShmOutput::~ShmOutput()
+{
+	// Shutting down the listening socket wakes the thread from accept.
+	shutdown(listen_fd_, SHUT_RDWR);
+	socket_thread_.join();
+	close(listen_fd_);
+	unlink(socket_path_.c_str());
+
+	// Readers keep their own mappings, so tell them there will be no more frames.
+	header_->closed.store(1, std::memory_order_release);
+	header_->futex.fetch_add(1, std::memory_order_release);
+	syscall(SYS_futex, &header_->futex, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+	munmap(header_, map_size_);
+	close(memfd_);
+}
+
+void ShmOutput::SetVideoFormat(unsigned int width, unsigned int height, unsigned int stride)
+{
+	header_->width = width;
+	header_->height = height;
+	header_->stride = stride;
+}
+
+void ShmOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	if (options_->verbose)
+		std::cout << "ShmOutput: output buffer " << mem << " size " << size << "\n";
+	size_t data_size = header_->data_size;
+	if (size > data_size)
+		throw std::runtime_error("frame of " + std::to_string(size) +
+								 " bytes doesn't fit in the shared memory ring (try a bigger --shm-size)");
+
+	// Frames never wrap around the end of the ring, so readers always find them in one piece.
+	uint64_t position = position_;
+	size_t offset = position % data_size;
+	if (offset + size > data_size)
+		position += data_size - offset, offset = 0;
+
+	// Let readers see which data is about to change before any of it does.
+	header_->write_end.store(position + size, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(data_ + offset, mem, size);
+
+	uint64_t sequence = ++sequence_;
+	ShmRingEntry &entry = header_->entries[sequence % ShmRingHeader::NUM_ENTRIES];
+	entry.sequence.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	entry.position.store(position, std::memory_order_relaxed);
+	entry.size.store(size, std::memory_order_relaxed);
+	entry.timestamp_us.store(timestamp_us, std::memory_order_relaxed);
+	entry.flags.store(flags, std::memory_order_relaxed);
+	entry.sequence.store(sequence, std::memory_order_release);
+	header_->sequence.store(sequence, std::memory_order_release);
+	position_ = position + size;
+
+	header_->futex.store((uint32_t)sequence, std::memory_order_release);
+	if (syscall(SYS_futex, &header_->futex, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0) < 0)
+		throw std::runtime_error("failed to wake shared memory readers");
+}
+
+// Hand each reader that connects the ring's memfd.
+void ShmOutput::socketThread()
+{
+	while (true)
+	{
+		int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return;
+		}
+
+		char byte = 0;
+		iovec iov = { &byte, 1 };
+		alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+		msghdr msg = {};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &memfd_, sizeof(int));
+		if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0)
+			std::cerr << "WARNING: failed to send shared memory to reader" << std::endl;
+		else if (options_->verbose)
+			std::cout << "ShmOutput: reader connected" << std::endl;
+		close(fd);
+	}
+}
@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * shm_output.hpp - publish frames in shared memory for local readers.
+ */
+
+#pragma once
+
+#include <thread>
+
+#include "output.hpp"
+#include "shm_ring.hpp"
+
+// Copies each frame into a ring in shared memory (see shm_ring.hpp), where any number of
+// local processes can read the newest frames without copying them out, and without ever
+// holding up the camera. Readers fetch the ring's memfd from a Unix socket, which is
+// served from a thread of our own.
+class ShmOutput : public Output
+{
+public:
+	ShmOutput(VideoOptions const *options);
+	~ShmOutput();
+	void SetVideoFormat(unsigned int width, unsigned int height, unsigned int stride) override;
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	void socketThread();
+	std::string socket_path_;
+	int memfd_;
+	int listen_fd_;
+	size_t map_size_;
+	ShmRingHeader *header_;
+	uint8_t *data_;
+	uint64_t sequence_;
+	uint64_t position_;
+	std::thread socket_thread_;
+};
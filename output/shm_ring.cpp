@@ -0,0 +1,143 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * shm_ring.cpp - a ring of frames in shared memory, for local readers.
+ */
+
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+
+#include "shm_ring.hpp"
+
+// Receive the ring's memfd from the output's socket.
+static int receive_fd(std::string const &socket_path)
+{
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (socket_path.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error("socket path too long: " + socket_path);
+	strcpy(addr.sun_path, socket_path.c_str());
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		throw std::runtime_error("unable to open unix socket");
+	if (connect(sock, (sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		close(sock);
+		throw std::runtime_error("failed to connect to " + socket_path);
+	}
+
+	char byte;
+	iovec iov = { &byte, 1 };
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	ssize_t ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	close(sock);
+	cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (ret != 1 || !cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+		throw std::runtime_error("no shared memory received from " + socket_path);
+	int fd;
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+	return fd;
+}
+
+ShmRingReader::ShmRingReader(std::string const &socket_path)
+{
+	int fd = receive_fd(socket_path);
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(ShmRingHeader))
+	{
+		close(fd);
+		throw std::runtime_error("bad shared memory from " + socket_path);
+	}
+	map_size_ = st.st_size;
+	void *map = mmap(nullptr, map_size_, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		throw std::runtime_error("failed to map shared memory from " + socket_path);
+
+	header_ = (ShmRingHeader const *)map;
+	if (header_->magic != ShmRingHeader::MAGIC || header_->version != ShmRingHeader::VERSION ||
+		header_->header_size + header_->data_size != map_size_)
+	{
+		munmap(map, map_size_);
+		throw std::runtime_error("unrecognised shared memory from " + socket_path);
+	}
+	data_ = (uint8_t const *)map + header_->header_size;
+}
+
+ShmRingReader::~ShmRingReader()
+{
+	munmap((void *)header_, map_size_);
+}
+
+bool ShmRingReader::Wait(uint64_t sequence, int timeout_ms) const
+{
+	timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_sec += timeout_ms / 1000;
+	end.tv_nsec += (timeout_ms % 1000) * 1000000;
+	if (end.tv_nsec >= 1000000000)
+		end.tv_sec++, end.tv_nsec -= 1000000000;
+
+	while (true)
+	{
+		// Read the futex word first, so that we can't miss a wake-up for a newer frame.
+		uint32_t futex = header_->futex.load(std::memory_order_acquire);
+		if (Newest() > sequence)
+			return true;
+		if (header_->closed.load(std::memory_order_acquire))
+			return false;
+
+		timespec now, timeout;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timeout.tv_sec = end.tv_sec - now.tv_sec;
+		timeout.tv_nsec = end.tv_nsec - now.tv_nsec;
+		if (timeout.tv_nsec < 0)
+			timeout.tv_sec--, timeout.tv_nsec += 1000000000;
+		if (timeout.tv_sec < 0)
+			return false;
+		// Not FUTEX_PRIVATE_FLAG, as the writer is in another process.
+		if (syscall(SYS_futex, &header_->futex, FUTEX_WAIT, futex, &timeout, nullptr, 0) < 0 && errno == ETIMEDOUT)
+			return false;
+	}
+}
+
+bool ShmRingReader::Get(uint64_t sequence, Frame &frame) const
+{
+	if (sequence == 0)
+		return false;
+	ShmRingEntry const &entry = header_->entries[sequence % ShmRingHeader::NUM_ENTRIES];
+	if (entry.sequence.load(std::memory_order_acquire) != sequence)
+		return false;
+	frame.sequence = sequence;
+	frame.position = entry.position.load(std::memory_order_relaxed);
+	frame.size = entry.size.load(std::memory_order_relaxed);
+	frame.timestamp_us = entry.timestamp_us.load(std::memory_order_relaxed);
+	frame.flags = entry.flags.load(std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (entry.sequence.load(std::memory_order_relaxed) != sequence)
+		return false;
+	frame.data = data_ + frame.position % header_->data_size;
+	return Valid(frame);
+}
+
+bool ShmRingReader::Valid(Frame const &frame) const
+{
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return header_->write_end.load(std::memory_order_relaxed) - frame.position <= header_->data_size;
+}
@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * shm_ring.hpp - a ring of frames in shared memory, for local readers.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// The layout of the shared memory that a "shm://" output publishes its frames in, and
+// a reader for it. The memory is a memfd, which readers get from the Unix socket named
+// by the output, and which they map read-only. The header is followed by the frame data,
+// a ring of data_size bytes into which frames are copied one after another (never
+// wrapping around the end). Frames are numbered from 1, and the most recent NUM_ENTRIES
+// of them are described by entries[sequence % NUM_ENTRIES].
+//
+// The writer never waits for readers. Each entry is written like a seqlock (its sequence
+// is zero while it changes), and write_end is moved on before any data is overwritten,
+// so readers can use frames where they are and check afterwards that they weren't
+// overwritten in the meantime. Readers wait for new frames with a futex on the futex
+// word, which holds the low 32 bits of the newest sequence number.
+struct ShmRingEntry
+{
+	std::atomic<uint64_t> sequence;
+	std::atomic<uint64_t> position; // counting every byte ever written to the ring
+	std::atomic<uint64_t> size;
+	std::atomic<int64_t> timestamp_us;
+	std::atomic<uint32_t> flags;
+};
+
+struct ShmRingHeader
+{
+	static constexpr uint32_t MAGIC = 0x4d485343; // "CSHM"
+	static constexpr uint32_t VERSION = 1;
+	static constexpr unsigned int NUM_ENTRIES = 64;
+	// The same flags that outputs get with each frame.
+	static constexpr uint32_t FLAG_KEYFRAME = 1;
+	static constexpr uint32_t FLAG_RESTART = 2;
+
+	uint32_t magic;
+	uint32_t version;
+	uint64_t header_size; // the frame data starts here
+	uint64_t data_size;
+	char codec[16];
+	std::atomic<uint32_t> width; // for uncompressed frames
+	std::atomic<uint32_t> height;
+	std::atomic<uint32_t> stride;
+	alignas(64) std::atomic<uint32_t> futex;
+	std::atomic<uint32_t> closed; // set when the writer has gone
+	std::atomic<uint64_t> sequence; // of the newest frame, or zero
+	std::atomic<uint64_t> write_end; // ring data before here may be changing
+	alignas(64) ShmRingEntry entries[NUM_ENTRIES];
+};
+
+// Connects to a "shm://" output and maps its ring, so that frames can be read straight
+// out of the shared memory. Frames are only valid until the writer laps them, which
+// Valid() checks.
+class ShmRingReader
+{
+public:
+	struct Frame
+	{
+		uint64_t sequence;
+		uint8_t const *data;
+		size_t size;
+		int64_t timestamp_us;
+		uint32_t flags;
+		uint64_t position;
+	};
+
+	ShmRingReader(std::string const &socket_path);
+	~ShmRingReader();
+	ShmRingHeader const &Header() const { return *header_; }
+	uint64_t Newest() const { return header_->sequence.load(std::memory_order_acquire); }
+	// Wait until there is a frame newer than the given one, returning false on timeout,
+	// or if the writer has gone.
+	bool Wait(uint64_t sequence, int timeout_ms) const;
+	// Find a frame, returning false if it isn't in the ring (any more).
+	bool Get(uint64_t sequence, Frame &frame) const;
+	// Check, once a frame has been used, that it wasn't being overwritten at the time.
+	bool Valid(Frame const &frame) const;
+
+private:
+	ShmRingHeader const *header_;
+	uint8_t const *data_;
+	size_t map_size_;
+};
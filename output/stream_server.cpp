@@ -0,0 +1,679 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * stream_server.cpp - send the output stream to any number of TCP clients.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+
+#include "nal_units.hpp"
+#include "stream_server.hpp"
+
+// Each HTTP client's stream is a series of parts separated by this boundary.
+static char const BOUNDARY[] = "frame";
+// We give up on HTTP clients whose requests are bigger than this.
+static constexpr size_t MAX_REQUEST_SIZE = 8192;
+// RTP packets sent on an RTSP connection are each preceded by '$', the channel and the length.
+static constexpr size_t INTERLEAVED_HEADER_SIZE = 4;
+static char const RTSP_METHODS[] = "OPTIONS, DESCRIBE, SETUP, PLAY, PAUSE, TEARDOWN, GET_PARAMETER, SET_PARAMETER";
+
+static int open_udp_socket(unsigned int port)
+{
+	int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		throw std::runtime_error("unable to open udp socket");
+	sockaddr_in saddr = {};
+	saddr.sin_family = AF_INET;
+	saddr.sin_addr.s_addr = INADDR_ANY;
+	saddr.sin_port = htons(port);
+	if (bind(fd, (sockaddr *)&saddr, sizeof(saddr)) < 0)
+		throw std::runtime_error("failed to bind udp socket to port " + std::to_string(port));
+	return fd;
+}
+
+static std::string base64(std::vector<uint8_t> const &data)
+{
+	static char const chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	std::string encoded;
+	for (size_t i = 0; i < data.size(); i += 3)
+	{
+		uint32_t bits = data[i] << 16;
+		if (i + 1 < data.size())
+			bits |= data[i + 1] << 8;
+		if (i + 2 < data.size())
+			bits |= data[i + 2];
+		encoded += chars[bits >> 18];
+		encoded += chars[(bits >> 12) & 63];
+		encoded += i + 1 < data.size() ? chars[(bits >> 6) & 63] : '=';
+		encoded += i + 2 < data.size() ? chars[bits & 63] : '=';
+	}
+	return encoded;
+}
+
+StreamServer::StreamServer(unsigned int port, Protocol protocol, unsigned int max_queued_frames, bool verbose)
+	: protocol_(protocol), rtp_fd_(-1), rtcp_fd_(-1), rtp_port_(port), max_queued_frames_(max_queued_frames),
+	  verbose_(verbose), abort_(false)
+{
+	listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd_ < 0)
+		throw std::runtime_error("unable to open listen socket");
+	int one = 1;
+	setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	sockaddr_in server_saddr = {};
+	server_saddr.sin_family = AF_INET;
+	server_saddr.sin_addr.s_addr = INADDR_ANY;
+	server_saddr.sin_port = htons(port);
+	if (bind(listen_fd_, (sockaddr *)&server_saddr, sizeof(server_saddr)) < 0)
+		throw std::runtime_error("failed to bind listen socket");
+	if (listen(listen_fd_, 8) < 0)
+		throw std::runtime_error("failed to listen on socket");
+
+	if (protocol_ == Protocol::Rtsp)
+	{
+		// RTP goes out from the UDP port with the same number as the RTSP server's (so
+		// it's easy to open up in a firewall), and clients send RTCP to the next one.
+		rtp_fd_ = open_udp_socket(rtp_port_);
+		rtcp_fd_ = open_udp_socket(rtp_port_ + 1);
+		rtp_packetiser_ = std::make_unique<RtpPacketiser>();
+	}
+
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epoll_fd_ < 0 || event_fd_ < 0)
+		throw std::runtime_error("failed to create stream server events");
+	for (int fd : { listen_fd_, event_fd_, rtp_fd_, rtcp_fd_ })
+	{
+		if (fd < 0)
+			continue;
+		epoll_event ev = {};
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0)
+			throw std::runtime_error("failed to add stream server events");
+	}
+
+	if (verbose_)
+		std::cout << "StreamServer: listening on port " << port << std::endl;
+	server_thread_ = std::thread(&StreamServer::serverThread, this);
+}
+
+StreamServer::~StreamServer()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	uint64_t one = 1;
+	if (write(event_fd_, &one, sizeof(one)) < 0)
+		std::cerr << "WARNING: failed to wake stream server thread" << std::endl;
+	server_thread_.join();
+
+	for (auto const &client : clients_)
+		close(client.first);
+	for (int fd : { rtp_fd_, rtcp_fd_ })
+	{
+		if (fd >= 0)
+			close(fd);
+	}
+	close(event_fd_);
+	close(epoll_fd_);
+	close(listen_fd_);
+}
+
+void StreamServer::Send(void const *mem, size_t size, int64_t timestamp_us, bool keyframe)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	// RTSP clients need the SPS and PPS whenever they join, even if no one is watching now.
+	bool add_parameter_sets = protocol_ == Protocol::Rtsp && keyframe && !saveParameterSets(mem, size);
+	if (clients_.empty())
+		return;
+
+	// HTTP clients get each frame as one part of a multipart response, all of which we
+	// make here, once, for everyone.
+	auto frame = std::make_shared<Frame>();
+	if (protocol_ == Protocol::HttpMjpeg)
+	{
+		std::string header = std::string("--") + BOUNDARY + "\r\nContent-Type: image/jpeg\r\nContent-Length: " +
+							 std::to_string(size) + "\r\n\r\n";
+		frame->data.reserve(header.size() + size + 2);
+		frame->data.assign(header.begin(), header.end());
+		frame->data.insert(frame->data.end(), (uint8_t const *)mem, (uint8_t const *)mem + size);
+		frame->data.insert(frame->data.end(), { '\r', '\n' });
+	}
+	else if (protocol_ == Protocol::Rtsp)
+		makeRtpFrame(frame->data, mem, size, timestamp_us, add_parameter_sets);
+	else
+		frame->data.assign((uint8_t const *)mem, (uint8_t const *)mem + size);
+	frame->keyframe = keyframe;
+	frame->response = false;
+
+	for (auto &it : clients_)
+	{
+		Client &client = it.second;
+		if (!client.streaming)
+			continue;
+		if (client.queue.size() >= max_queued_frames_)
+		{
+			// The client can't keep up. Throw away everything it hasn't started receiving,
+			// and start again from a keyframe when it's ready. When every frame is a keyframe
+			// and only one frame may be queued, this means slow clients skip to the newest one.
+			dropFrames(client);
+			client.waiting_keyframe = true;
+		}
+		if (client.waiting_keyframe && !keyframe)
+		{
+			client.frames_dropped++;
+			continue;
+		}
+		client.waiting_keyframe = false;
+		client.queue.push_back(frame);
+	}
+	lock.unlock();
+
+	uint64_t one = 1;
+	if (write(event_fd_, &one, sizeof(one)) < 0)
+		throw std::runtime_error("failed to wake stream server thread");
+}
+
+// Remember the SPS and PPS from a keyframe, returning true if it had them both.
+bool StreamServer::saveParameterSets(void const *mem, size_t size)
+{
+	bool sps = false, pps = false;
+	for (auto const &nal_unit : split_nal_units((uint8_t const *)mem, size))
+	{
+		uint8_t type = nal_unit.second ? nal_unit.first[0] & 0x1f : 0;
+		if (type == 7)
+			sps_.assign(nal_unit.first, nal_unit.first + nal_unit.second), sps = true;
+		else if (type == 8)
+			pps_.assign(nal_unit.first, nal_unit.first + nal_unit.second), pps = true;
+	}
+	return sps && pps;
+}
+
+// Packetise a frame for RTSP clients, as it would be sent on an RTSP connection. The
+// packets can be picked out of this again to send over UDP.
+void StreamServer::makeRtpFrame(std::vector<uint8_t> &data, void const *mem, size_t size, int64_t timestamp_us,
+								bool add_parameter_sets)
+{
+	if (add_parameter_sets && !sps_.empty() && !pps_.empty())
+	{
+		static uint8_t const start_code[] = { 0, 0, 0, 1 };
+		keyframe_buffer_.clear();
+		for (auto const *nal_unit : { &sps_, &pps_ })
+		{
+			keyframe_buffer_.insert(keyframe_buffer_.end(), start_code, start_code + sizeof(start_code));
+			keyframe_buffer_.insert(keyframe_buffer_.end(), nal_unit->begin(), nal_unit->end());
+		}
+		keyframe_buffer_.insert(keyframe_buffer_.end(), (uint8_t const *)mem, (uint8_t const *)mem + size);
+		mem = keyframe_buffer_.data();
+		size = keyframe_buffer_.size();
+	}
+
+	auto const &packets = rtp_packetiser_->Packetise(mem, size, timestamp_us);
+	size_t total = 0;
+	for (auto const &packet : packets)
+		total += INTERLEAVED_HEADER_SIZE + packet.header_size + packet.payload_size;
+	data.reserve(total);
+	for (auto const &packet : packets)
+	{
+		size_t length = packet.header_size + packet.payload_size;
+		data.insert(data.end(), { '$', 0, (uint8_t)(length >> 8), (uint8_t)length });
+		data.insert(data.end(), packet.header, packet.header + packet.header_size);
+		data.insert(data.end(), packet.payload, packet.payload + packet.payload_size);
+	}
+}
+
+void StreamServer::ReportStats() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (auto const &client : clients_)
+		reportClient(client.second);
+}
+
+void StreamServer::reportClient(Client const &client) const
+{
+	std::chrono::duration<double> time = std::chrono::steady_clock::now() - client.connect_time;
+	std::cout << "StreamServer: client " << client.name << ": " << client.frames_sent << " frames, "
+			  << client.bytes_sent << " bytes sent in " << time.count() << "s ("
+			  << client.bytes_sent * 8 / time.count() / 1e6 << " Mbps), " << client.frames_dropped
+			  << " frames dropped" << std::endl;
+}
+
+void StreamServer::serverThread()
+{
+	epoll_event events[16];
+	while (true)
+	{
+		int n = epoll_wait(epoll_fd_, events, 16, -1);
+		if (n < 0 && errno != EINTR)
+		{
+			std::cerr << "ERROR: stream server failed waiting for events" << std::endl;
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (abort_)
+			return;
+		for (int i = 0; i < n; i++)
+		{
+			int fd = events[i].data.fd;
+			if (fd == listen_fd_)
+				acceptClients();
+			else if (fd == rtp_fd_ || fd == rtcp_fd_)
+			{
+				// Nothing that RTSP clients send us over UDP (mostly RTCP reports) is used.
+				char buf[1500];
+				while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+				{
+				}
+			}
+			else if (fd == event_fd_)
+			{
+				uint64_t count;
+				if (read(event_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+					std::cerr << "WARNING: stream server failed to read event" << std::endl;
+				for (auto it = clients_.begin(); it != clients_.end();)
+				{
+					int client_fd = (it++)->first; // the client may be closed and erased
+					if (!writeClient(clients_.at(client_fd)))
+						closeClient(client_fd);
+				}
+			}
+			else
+			{
+				auto it = clients_.find(fd);
+				if (it == clients_.end())
+					continue;
+				bool ok = !(events[i].events & (EPOLLERR | EPOLLHUP));
+				if (ok && (events[i].events & EPOLLIN))
+				{
+					// Raw clients aren't expected to say anything, but they may hang up. A client
+					// that has only shut down its sending side can carry on receiving.
+					char buf[1024];
+					ssize_t ret = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+					if (ret == 0)
+					{
+						it->second.reading = false;
+						ok = updateEvents(it->second);
+					}
+					else if (ret < 0 && errno != EAGAIN && errno != EINTR)
+						ok = false;
+					else if (ret > 0 && protocol_ != Protocol::Raw)
+					{
+						it->second.request.append(buf, ret);
+						ok = protocol_ == Protocol::Rtsp ? handleRtspRequest(it->second)
+														 : handleHttpRequest(it->second);
+					}
+				}
+				if (ok && (events[i].events & EPOLLOUT))
+					ok = writeClient(it->second);
+				if (!ok)
+					closeClient(fd);
+			}
+		}
+	}
+}
+
+void StreamServer::acceptClients()
+{
+	while (true)
+	{
+		sockaddr_in saddr;
+		socklen_t saddr_size = sizeof(saddr);
+		int fd = accept4(listen_fd_, (sockaddr *)&saddr, &saddr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				std::cerr << "WARNING: stream server failed to accept client" << std::endl;
+			return;
+		}
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		epoll_event ev = {};
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0)
+		{
+			std::cerr << "WARNING: stream server failed to add client" << std::endl;
+			close(fd);
+			continue;
+		}
+
+		Client &client = clients_[fd];
+		client = {};
+		client.fd = fd;
+		client.address = saddr;
+		client.name = std::string(inet_ntoa(saddr.sin_addr)) + ":" + std::to_string(ntohs(saddr.sin_port));
+		client.waiting_keyframe = true;
+		client.streaming = protocol_ == Protocol::Raw;
+		client.reading = true;
+		client.events = EPOLLIN;
+		client.connect_time = std::chrono::steady_clock::now();
+		if (verbose_)
+			std::cout << "StreamServer: client " << client.name << " connected" << std::endl;
+	}
+}
+
+// Look for a complete request from an HTTP client, and answer it. Only GET requests
+// for the stream itself are allowed; after that, anything else the client sends is
+// ignored. Returns false if the client should be dropped.
+bool StreamServer::handleHttpRequest(Client &client)
+{
+	if (client.streaming || client.close_when_sent)
+	{
+		client.request.clear();
+		return true;
+	}
+	size_t end = client.request.find("\r\n\r\n");
+	if (end == std::string::npos)
+		return client.request.size() <= MAX_REQUEST_SIZE;
+
+	std::string request_line = client.request.substr(0, client.request.find("\r\n"));
+	client.request.clear();
+	size_t method_end = request_line.find(' ');
+	size_t path_end = request_line.find(' ', method_end + 1);
+	std::string method = request_line.substr(0, method_end);
+	std::string path;
+	if (method_end != std::string::npos)
+		path = request_line.substr(method_end + 1, path_end - method_end - 1);
+	if (verbose_)
+		std::cout << "StreamServer: client " << client.name << " requested " << request_line << std::endl;
+
+	if (method != "GET")
+		queueResponse(client, "HTTP/1.0 405 Method Not Allowed\r\nAllow: GET\r\nContent-Length: 0\r\n\r\n", true);
+	else if (path != "/" && path != "/stream.mjpg")
+		queueResponse(client, "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n", true);
+	else
+	{
+		queueResponse(client,
+					  std::string("HTTP/1.0 200 OK\r\nCache-Control: no-cache, no-store\r\nPragma: no-cache\r\n"
+								  "Connection: close\r\nContent-Type: multipart/x-mixed-replace; boundary=") +
+						  BOUNDARY + "\r\n\r\n",
+					  false);
+		client.streaming = true;
+	}
+	return writeClient(client);
+}
+
+// Answer each complete request from an RTSP client. There is only one stream, so the
+// URLs in the requests aren't checked. Clients receiving RTP on the connection may send
+// RTCP on it too, which is skipped. Returns false if the client should be dropped.
+bool StreamServer::handleRtspRequest(Client &client)
+{
+	std::string &input = client.request;
+	while (!input.empty())
+	{
+		if (input[0] == '$')
+		{
+			if (input.size() < INTERLEAVED_HEADER_SIZE)
+				break;
+			size_t length = INTERLEAVED_HEADER_SIZE + ((uint8_t)input[2] << 8 | (uint8_t)input[3]);
+			if (input.size() < length)
+				break;
+			input.erase(0, length);
+			continue;
+		}
+
+		size_t end = input.find("\r\n\r\n");
+		if (end == std::string::npos)
+			return input.size() <= MAX_REQUEST_SIZE;
+		std::string request_line = input.substr(0, input.find("\r\n"));
+		std::map<std::string, std::string> headers;
+		for (size_t pos = request_line.size() + 2; pos < end;)
+		{
+			size_t line_end = input.find("\r\n", pos);
+			size_t colon = input.find(':', pos);
+			if (colon < line_end)
+			{
+				std::string name = input.substr(pos, colon - pos);
+				std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+				size_t value = std::min(input.find_first_not_of(' ', colon + 1), line_end);
+				headers[name] = input.substr(value, line_end - value);
+			}
+			pos = line_end + 2;
+		}
+		// We don't want a body, but must skip over any that is sent.
+		size_t content_length = strtoul(headers["content-length"].c_str(), nullptr, 10);
+		if (content_length > MAX_REQUEST_SIZE)
+			return false;
+		size_t request_size = end + 4 + content_length;
+		if (input.size() < request_size)
+			break;
+		input.erase(0, request_size);
+
+		if (verbose_)
+			std::cout << "StreamServer: client " << client.name << " requested " << request_line << std::endl;
+		size_t method_end = request_line.find(' ');
+		size_t url_end = request_line.rfind(' ');
+		if (method_end == std::string::npos || url_end <= method_end + 1)
+			return false;
+		std::string method = request_line.substr(0, method_end);
+		std::string url = request_line.substr(method_end + 1, url_end - method_end - 1);
+		std::string status = "200 OK", extra_headers, body;
+
+		if (method == "OPTIONS")
+			extra_headers = std::string("Public: ") + RTSP_METHODS + "\r\n";
+		else if (method == "DESCRIBE")
+		{
+			body = sdp();
+			extra_headers = "Content-Base: " + url + (url.back() == '/' ? "" : "/") +
+							"\r\nContent-Type: application/sdp\r\n";
+		}
+		else if (method == "SETUP")
+		{
+			std::string const &transport = headers["transport"];
+			size_t client_port = transport.find("client_port=");
+			unsigned int port;
+			if (transport.find("RTP/AVP/TCP") != std::string::npos)
+			{
+				// We always use channels 0 and 1, whatever the client asked for.
+				client.udp = false;
+				extra_headers = "Transport: RTP/AVP/TCP;unicast;interleaved=0-1\r\n";
+			}
+			else if (transport.find("multicast") == std::string::npos && client_port != std::string::npos &&
+					 sscanf(transport.c_str() + client_port, "client_port=%u", &port) == 1)
+			{
+				client.udp = true;
+				client.address.sin_port = htons(port);
+				extra_headers = "Transport: RTP/AVP;unicast;client_port=" + std::to_string(port) + "-" +
+								std::to_string(port + 1) + ";server_port=" + std::to_string(rtp_port_) + "-" +
+								std::to_string(rtp_port_ + 1) + "\r\n";
+			}
+			else
+				status = "461 Unsupported Transport";
+			if (client.session.empty() && status == "200 OK")
+			{
+				std::random_device rd;
+				char session[17];
+				snprintf(session, sizeof(session), "%08x%08x", rd(), rd());
+				client.session = session;
+			}
+		}
+		else if (method == "PLAY" || method == "PAUSE" || method == "TEARDOWN")
+		{
+			std::string const &session = headers["session"];
+			if (client.session.empty() || (!session.empty() && session.substr(0, session.find(';')) != client.session))
+				status = "454 Session Not Found";
+			else if (method == "PLAY")
+			{
+				extra_headers = "Range: npt=0.000-\r\n";
+				client.waiting_keyframe |= !client.streaming;
+				client.streaming = true;
+			}
+			else
+			{
+				client.streaming = false;
+				dropFrames(client);
+			}
+		}
+		else if (method != "GET_PARAMETER" && method != "SET_PARAMETER") // these keep sessions alive
+		{
+			status = "405 Method Not Allowed";
+			extra_headers = std::string("Allow: ") + RTSP_METHODS + "\r\n";
+		}
+
+		std::string response = "RTSP/1.0 " + status + "\r\nCSeq: " + headers["cseq"] + "\r\n" + extra_headers;
+		if (!client.session.empty())
+			response += "Session: " + client.session + ";timeout=60\r\n";
+		if (!body.empty())
+			response += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+		queueResponse(client, response + "\r\n" + body, false);
+		if (method == "TEARDOWN" && status == "200 OK")
+			client.session.clear();
+	}
+	return writeClient(client);
+}
+
+std::string StreamServer::sdp() const
+{
+	std::string fmtp = "packetization-mode=1";
+	if (sps_.size() >= 4 && !pps_.empty())
+	{
+		char profile_level_id[7];
+		snprintf(profile_level_id, sizeof(profile_level_id), "%02x%02x%02x", sps_[1], sps_[2], sps_[3]);
+		fmtp += std::string(";profile-level-id=") + profile_level_id + ";sprop-parameter-sets=" + base64(sps_) + "," +
+				base64(pps_);
+	}
+	std::string payload_type = std::to_string(RtpPacketiser::PAYLOAD_TYPE);
+	return "v=0\r\no=- 0 0 IN IP4 0.0.0.0\r\ns=libcamera-vid\r\nc=IN IP4 0.0.0.0\r\nt=0 0\r\n"
+		   "m=video 0 RTP/AVP " + payload_type + "\r\na=rtpmap:" + payload_type + " H264/90000\r\n"
+		   "a=fmtp:" + payload_type + " " + fmtp + "\r\na=control:track0\r\n";
+}
+
+void StreamServer::queueResponse(Client &client, std::string const &response, bool close)
+{
+	auto frame = std::make_shared<Frame>();
+	frame->data.assign(response.begin(), response.end());
+	frame->keyframe = false;
+	frame->response = true;
+	client.queue.push_back(frame);
+	client.close_when_sent = close;
+}
+
+// Throw away the frames the client hasn't started receiving, keeping any responses.
+void StreamServer::dropFrames(Client &client)
+{
+	auto start = client.queue.begin() + (client.offset ? 1 : 0);
+	auto end = std::remove_if(start, client.queue.end(),
+							  [](std::shared_ptr<Frame const> const &frame) { return !frame->response; });
+	client.frames_dropped += client.queue.end() - end;
+	client.queue.erase(end, client.queue.end());
+}
+
+// Send as much of the client's queue as the socket will take, returning false if the
+// client has gone away.
+bool StreamServer::writeClient(Client &client)
+{
+	while (!client.queue.empty())
+	{
+		Frame const &frame = *client.queue.front();
+		if (client.udp && !frame.response)
+		{
+			sendDatagrams(client, frame);
+			client.queue.pop_front();
+			continue;
+		}
+		ssize_t n = send(client.fd, frame.data.data() + client.offset, frame.data.size() - client.offset,
+						 MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return false;
+			break;
+		}
+		client.offset += n;
+		client.bytes_sent += n;
+		if (client.offset == frame.data.size())
+		{
+			client.frames_sent += !frame.response;
+			client.queue.pop_front();
+			client.offset = 0;
+		}
+	}
+	if (client.queue.empty() && client.close_when_sent)
+		return false;
+	return updateEvents(client);
+}
+
+// Send an RTSP client the RTP packets of a frame over UDP. This mustn't block either,
+// so if the socket is full, the rest of the frame is lost.
+void StreamServer::sendDatagrams(Client &client, Frame const &frame)
+{
+	iov_.clear();
+	for (size_t pos = 0; pos + INTERLEAVED_HEADER_SIZE <= frame.data.size();)
+	{
+		size_t length = frame.data[pos + 2] << 8 | frame.data[pos + 3];
+		iov_.push_back({ (void *)&frame.data[pos + INTERLEAVED_HEADER_SIZE], length });
+		pos += INTERLEAVED_HEADER_SIZE + length;
+	}
+	msgs_.resize(iov_.size());
+	for (unsigned int i = 0; i < iov_.size(); i++)
+	{
+		msgs_[i] = {};
+		msgs_[i].msg_hdr.msg_name = &client.address;
+		msgs_[i].msg_hdr.msg_namelen = sizeof(client.address);
+		msgs_[i].msg_hdr.msg_iov = &iov_[i];
+		msgs_[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	for (unsigned int sent = 0; sent < msgs_.size();)
+	{
+		int n = sendmmsg(rtp_fd_, &msgs_[sent], msgs_.size() - sent, MSG_DONTWAIT);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			client.frames_dropped++;
+			return;
+		}
+		for (int i = 0; i < n; i++)
+			client.bytes_sent += msgs_[sent + i].msg_len;
+		sent += n;
+	}
+	client.frames_sent++;
+}
+
+// Wait for the socket to have space only when there's something left to send.
+bool StreamServer::updateEvents(Client &client)
+{
+	uint32_t events = (client.reading ? (uint32_t)EPOLLIN : 0u) | (client.queue.empty() ? 0u : (uint32_t)EPOLLOUT);
+	if (events == client.events)
+		return true;
+	epoll_event ev = {};
+	ev.events = events;
+	ev.data.fd = client.fd;
+	if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, client.fd, &ev) < 0)
+		return false;
+	client.events = events;
+	return true;
+}
+
+void StreamServer::closeClient(int fd)
+{
+	auto it = clients_.find(fd);
+	if (it == clients_.end())
+		return;
+	if (verbose_)
+		std::cout << "StreamServer: client " << it->second.name << " disconnected" << std::endl;
+	reportClient(it->second);
+	epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+	close(fd);
+	clients_.erase(it);
+}
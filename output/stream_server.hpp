@@ -0,0 +1,117 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * stream_server.hpp - send the output stream to any number of TCP clients.
+ */
+
+#pragma once
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rtp_packetiser.hpp"
+
+// A TCP server, running in a thread of its own, which accepts clients at any time
+// and sends them every frame from then on (starting at the next keyframe). Each
+// frame is copied once and shared by all the clients' queues. Sockets are never
+// allowed to block: a client that falls so far behind that its queue fills up has
+// the rest of its queue thrown away, and gets nothing more until the next keyframe.
+//
+// The stream may be sent just as it is, or as an HTTP multipart/x-mixed-replace
+// response (for MJPEG), which clients get once they have sent a GET request.
+//
+// Or the server may be an RTSP server for H.264. Each frame is turned into RTP packets
+// once, and these go to every client that has asked to PLAY the stream, over UDP or
+// interleaved on the RTSP connection. A session lasts as long as its connection. We
+// keep the most recent SPS and PPS, which go into the SDP and in front of any keyframe
+// that doesn't have them, so that new clients can always start at the next keyframe.
+class StreamServer
+{
+public:
+	enum class Protocol
+	{
+		Raw,
+		HttpMjpeg,
+		Rtsp
+	};
+	StreamServer(unsigned int port, Protocol protocol, unsigned int max_queued_frames, bool verbose);
+	~StreamServer();
+	// Queue a frame for all the clients. This never waits for them.
+	void Send(void const *mem, size_t size, int64_t timestamp_us, bool keyframe);
+	// Print the statistics for each client still connected.
+	void ReportStats() const;
+
+private:
+	struct Frame
+	{
+		std::vector<uint8_t> data;
+		bool keyframe;
+		bool response; // an HTTP or RTSP response, rather than part of the stream
+	};
+	struct Client
+	{
+		int fd;
+		std::string name;
+		std::deque<std::shared_ptr<Frame const>> queue;
+		size_t offset; // how much of the frame at the front of the queue has been sent
+		bool waiting_keyframe;
+		bool streaming; // cleared until an HTTP or RTSP client has asked for the stream
+		bool close_when_sent; // for HTTP clients that get an error response
+		std::string request; // what an HTTP or RTSP client has sent so far
+		std::string session; // an RTSP client's session, once it has been set up
+		bool udp; // for RTSP clients that want RTP over UDP rather than on the connection
+		sockaddr_in address;
+		bool reading; // cleared once the client has stopped sending (it may still be receiving)
+		uint32_t events; // the epoll events we're waiting for
+		uint64_t bytes_sent;
+		unsigned int frames_sent;
+		unsigned int frames_dropped;
+		std::chrono::steady_clock::time_point connect_time;
+	};
+	void serverThread();
+	void acceptClients();
+	bool handleHttpRequest(Client &client);
+	bool handleRtspRequest(Client &client);
+	void queueResponse(Client &client, std::string const &response, bool close);
+	void dropFrames(Client &client);
+	bool saveParameterSets(void const *mem, size_t size);
+	void makeRtpFrame(std::vector<uint8_t> &data, void const *mem, size_t size, int64_t timestamp_us,
+					  bool add_parameter_sets);
+	std::string sdp() const;
+	bool writeClient(Client &client);
+	void sendDatagrams(Client &client, Frame const &frame);
+	bool updateEvents(Client &client);
+	void closeClient(int fd);
+	void reportClient(Client const &client) const;
+
+	int listen_fd_;
+	int epoll_fd_;
+	int event_fd_; // wakes the server thread when there are new frames, or it must stop
+	Protocol protocol_;
+	// For RTSP, RTP goes out of one UDP socket, and RTCP comes back (and is ignored) on the next.
+	int rtp_fd_;
+	int rtcp_fd_;
+	unsigned int rtp_port_;
+	std::unique_ptr<RtpPacketiser> rtp_packetiser_;
+	std::vector<uint8_t> sps_;
+	std::vector<uint8_t> pps_;
+	std::vector<uint8_t> keyframe_buffer_;
+	std::vector<iovec> iov_;
+	std::vector<mmsghdr> msgs_;
+	unsigned int max_queued_frames_;
+	bool verbose_;
+	std::map<int, Client> clients_;
+	mutable std::mutex mutex_;
+	bool abort_;
+	std::thread server_thread_;
+};
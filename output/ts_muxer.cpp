@@ -0,0 +1,167 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * ts_muxer.cpp - pack H.264 frames into an MPEG transport stream.
+ */
+
+#include <cstring>
+
+#include "ts_muxer.hpp"
+
+static constexpr uint8_t STREAM_TYPE_H264 = 0x1b;
+static constexpr uint8_t STREAM_ID_VIDEO = 0xe0;
+static constexpr int64_t TABLE_INTERVAL_US = 100000;
+// How far the PTS of each frame is ahead of the PCR sent with it, giving receivers
+// time to get the whole frame before they must show it.
+static constexpr int64_t PTS_DELAY_US = 100000;
+
+// The CRC used by PSI sections (MSB first, polynomial 0x04c11db7, no final inversion).
+static uint32_t crc32_mpeg(uint8_t const *data, size_t size)
+{
+	uint32_t crc = 0xffffffff;
+	for (size_t i = 0; i < size; i++)
+	{
+		crc ^= (uint32_t)data[i] << 24;
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+	}
+	return crc;
+}
+
+// Fill in the section length and append the CRC.
+static void finish_section(std::vector<uint8_t> &section)
+{
+	unsigned int length = section.size() - 3 + 4;
+	section[1] = 0xb0 | (length >> 8);
+	section[2] = length;
+	uint32_t crc = crc32_mpeg(section.data(), section.size());
+	section.insert(section.end(), { (uint8_t)(crc >> 24), (uint8_t)(crc >> 16), (uint8_t)(crc >> 8), (uint8_t)crc });
+}
+
+static bool starts_with_aud(uint8_t const *data, size_t size)
+{
+	size_t i = 0;
+	while (i < size && data[i] == 0)
+		i++;
+	return i >= 2 && i + 1 < size && data[i] == 1 && (data[i + 1] & 0x1f) == 9;
+}
+
+TsMuxer::TsMuxer() : pat_continuity_(0), pmt_continuity_(0), video_continuity_(0), last_tables_us_(-1)
+{
+}
+
+void TsMuxer::Mux(void const *mem, size_t size, int64_t timestamp_us, bool keyframe, std::vector<uint8_t> &out)
+{
+	if (keyframe || last_tables_us_ < 0 || timestamp_us - last_tables_us_ >= TABLE_INTERVAL_US)
+	{
+		writeTables(out);
+		last_tables_us_ = timestamp_us;
+	}
+
+	// One PES packet per frame. Video PES packets may leave their length unspecified.
+	int64_t pts = (timestamp_us + PTS_DELAY_US) * 9 / 100;
+	pes_.assign({ 0, 0, 1, STREAM_ID_VIDEO, 0, 0, 0x80, 0x80, 5 });
+	pes_.insert(pes_.end(), { (uint8_t)(0x21 | ((pts >> 29) & 0x0e)), (uint8_t)(pts >> 22),
+							  (uint8_t)(0x01 | ((pts >> 14) & 0xfe)), (uint8_t)(pts >> 7),
+							  (uint8_t)(0x01 | ((pts << 1) & 0xfe)) });
+	// H.264 in a transport stream must have an access unit delimiter at the start of
+	// every frame. The encoder doesn't normally make them, so add one if necessary.
+	if (!starts_with_aud((uint8_t const *)mem, size))
+		pes_.insert(pes_.end(), { 0, 0, 0, 1, 0x09, 0xf0 });
+	pes_.insert(pes_.end(), (uint8_t const *)mem, (uint8_t const *)mem + size);
+
+	writePes(timestamp_us, keyframe, out);
+}
+
+void TsMuxer::writeTables(std::vector<uint8_t> &out)
+{
+	// A single program, whose PMT lists a single H.264 stream that also carries the PCR.
+	uint8_t pmt_pid_hi = 0xe0 | (PMT_PID >> 8), pmt_pid_lo = PMT_PID & 0xff;
+	uint8_t video_pid_hi = 0xe0 | (VIDEO_PID >> 8), video_pid_lo = VIDEO_PID & 0xff;
+	std::vector<uint8_t> pat = { 0x00, 0, 0, 0x00, 0x01, 0xc1, 0, 0, 0x00, 0x01, pmt_pid_hi, pmt_pid_lo };
+	finish_section(pat);
+	writeSection(0, pat_continuity_, pat, out);
+
+	std::vector<uint8_t> pmt = { 0x02, 0, 0, 0x00, 0x01, 0xc1, 0, 0, video_pid_hi, video_pid_lo, 0xf0, 0 };
+	pmt.insert(pmt.end(), { STREAM_TYPE_H264, video_pid_hi, video_pid_lo, 0xf0, 0 });
+	finish_section(pmt);
+	writeSection(PMT_PID, pmt_continuity_, pmt, out);
+}
+
+void TsMuxer::writeSection(uint16_t pid, uint8_t &continuity, std::vector<uint8_t> const &section,
+						   std::vector<uint8_t> &out)
+{
+	size_t pos = out.size();
+	out.resize(pos + PACKET_SIZE, 0xff);
+	uint8_t *packet = &out[pos];
+	packet[0] = 0x47;
+	packet[1] = 0x40 | (pid >> 8);
+	packet[2] = pid;
+	packet[3] = 0x10 | continuity;
+	packet[4] = 0; // pointer field
+	memcpy(packet + 5, section.data(), section.size());
+	continuity = (continuity + 1) & 0xf;
+}
+
+void TsMuxer::writePes(int64_t timestamp_us, bool keyframe, std::vector<uint8_t> &out)
+{
+	size_t num_packets = (pes_.size() + 183) / 184 + 1;
+	out.reserve(out.size() + num_packets * PACKET_SIZE);
+
+	for (size_t pos = 0; pos < pes_.size();)
+	{
+		bool first = pos == 0;
+		uint8_t adaptation[184];
+		size_t adaptation_size = 0; // including the length byte, when there is an adaptation field
+
+		// The first packet of a frame carries the PCR, and marks keyframes as random access points.
+		if (first)
+		{
+			int64_t pcr = timestamp_us * 27;
+			uint64_t base = pcr / 300, ext = pcr % 300;
+			adaptation[1] = 0x10 | (keyframe ? 0x40 : 0);
+			adaptation[2] = base >> 25;
+			adaptation[3] = base >> 17;
+			adaptation[4] = base >> 9;
+			adaptation[5] = base >> 1;
+			adaptation[6] = ((base & 1) << 7) | 0x7e | (ext >> 8);
+			adaptation[7] = ext;
+			adaptation_size = 8;
+		}
+
+		// The last packet is padded out with stuffing bytes in the adaptation field.
+		size_t remaining = pes_.size() - pos;
+		if (remaining < 184 - adaptation_size)
+		{
+			size_t stuffing = 184 - adaptation_size - remaining;
+			if (!adaptation_size)
+			{
+				adaptation_size = 1;
+				stuffing--;
+				if (stuffing)
+				{
+					adaptation[adaptation_size++] = 0; // no flags
+					stuffing--;
+				}
+			}
+			memset(adaptation + adaptation_size, 0xff, stuffing);
+			adaptation_size += stuffing;
+		}
+		if (adaptation_size)
+			adaptation[0] = adaptation_size - 1;
+		size_t payload = 184 - adaptation_size;
+
+		size_t out_pos = out.size();
+		out.resize(out_pos + PACKET_SIZE);
+		uint8_t *packet = &out[out_pos];
+		packet[0] = 0x47;
+		packet[1] = (first ? 0x40 : 0) | (VIDEO_PID >> 8);
+		packet[2] = VIDEO_PID & 0xff;
+		packet[3] = (adaptation_size ? 0x30 : 0x10) | video_continuity_;
+		memcpy(packet + 4, adaptation, adaptation_size);
+		memcpy(packet + 4 + adaptation_size, &pes_[pos], payload);
+		video_continuity_ = (video_continuity_ + 1) & 0xf;
+		pos += payload;
+	}
+}
@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * ts_muxer.hpp - pack H.264 frames into an MPEG transport stream.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Turns H.264 frames into MPEG-2 transport stream packets. Each frame becomes one
+// PES packet, with a PTS from its timestamp, and the first TS packet of each frame
+// carries a PCR. The PAT and PMT are repeated before every keyframe (and at least
+// every 100ms) so that receivers can join, or resync, at any keyframe. A stream
+// can be cut into separately playable pieces at any keyframe.
+class TsMuxer
+{
+public:
+	static constexpr size_t PACKET_SIZE = 188;
+	// UDP datagrams normally carry 7 packets, which fits a 1500 byte MTU.
+	static constexpr size_t PACKETS_PER_DATAGRAM = 7;
+	static constexpr uint16_t PMT_PID = 0x1000;
+	static constexpr uint16_t VIDEO_PID = 0x100;
+
+	TsMuxer();
+
+	// Append the packets for one frame of Annex B H.264 to out.
+	void Mux(void const *mem, size_t size, int64_t timestamp_us, bool keyframe, std::vector<uint8_t> &out);
+
+private:
+	void writeTables(std::vector<uint8_t> &out);
+	void writeSection(uint16_t pid, uint8_t &continuity, std::vector<uint8_t> const &section,
+					  std::vector<uint8_t> &out);
+	void writePes(int64_t timestamp_us, bool keyframe, std::vector<uint8_t> &out);
+	uint8_t pat_continuity_;
+	uint8_t pmt_continuity_;
+	uint8_t video_continuity_;
+	int64_t last_tables_us_;
+	std::vector<uint8_t> pes_;
+};
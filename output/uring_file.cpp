@@ -0,0 +1,336 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * uring_file.cpp - write files using io_uring.
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+
+#include "uring_file.hpp"
+
+// Direct I/O needs the memory, file offsets and lengths all aligned to (at least) this.
+static constexpr size_t ALIGN = 4096;
+
+#if HAVE_IO_URING
+
+static constexpr uint64_t FSYNC_USER_DATA = ~0ULL;
+
+static int io_uring_setup(unsigned int entries, io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+bool UringFile::Available()
+{
+	static int available = -1;
+	if (available < 0)
+	{
+		io_uring_params params = {};
+		int fd = io_uring_setup(1, &params);
+		available = fd >= 0;
+		if (fd >= 0)
+			close(fd);
+	}
+	return available;
+}
+
+UringFile::UringFile(unsigned int num_buffers, size_t buffer_size)
+	: ring_fd_(-1), sq_ring_(MAP_FAILED), cq_ring_(MAP_FAILED), sqes_(MAP_FAILED), to_submit_(0), in_flight_(0),
+	  buffer_size_(buffer_size), registered_(false), current_(0), fill_(0), fd_(-1), direct_(false), offset_(0)
+{
+	if (buffer_size % ALIGN)
+		throw std::runtime_error("io_uring buffer size must be a multiple of " + std::to_string(ALIGN));
+
+	// Room for every buffer to be in flight, plus the fsync.
+	io_uring_params params = {};
+	ring_fd_ = io_uring_setup(num_buffers + 1, &params);
+	if (ring_fd_ < 0)
+		throw std::runtime_error("io_uring_setup failed: " + std::string(strerror(errno)));
+
+	sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+	sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+					IORING_OFF_SQ_RING);
+	if (sq_ring_ == MAP_FAILED)
+		throw std::runtime_error("failed to map io_uring submission ring");
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		cq_ring_ = sq_ring_;
+	else
+	{
+		cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+						IORING_OFF_CQ_RING);
+		if (cq_ring_ == MAP_FAILED)
+			throw std::runtime_error("failed to map io_uring completion ring");
+	}
+	sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+	sqes_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+	if (sqes_ == MAP_FAILED)
+		throw std::runtime_error("failed to map io_uring submission entries");
+
+	uint8_t *sq = (uint8_t *)sq_ring_, *cq = (uint8_t *)cq_ring_;
+	sq_head_ = (unsigned int *)(sq + params.sq_off.head);
+	sq_tail_ = (unsigned int *)(sq + params.sq_off.tail);
+	sq_mask_ = (unsigned int *)(sq + params.sq_off.ring_mask);
+	sq_array_ = (unsigned int *)(sq + params.sq_off.array);
+	cq_head_ = (unsigned int *)(cq + params.cq_off.head);
+	cq_tail_ = (unsigned int *)(cq + params.cq_off.tail);
+	cq_mask_ = (unsigned int *)(cq + params.cq_off.ring_mask);
+	cqes_ = cq + params.cq_off.cqes;
+
+	std::vector<iovec> iovs;
+	for (unsigned int i = 0; i < num_buffers; i++)
+	{
+		void *buf;
+		if (posix_memalign(&buf, ALIGN, buffer_size))
+			throw std::runtime_error("failed to allocate io_uring buffers");
+		buffers_.push_back((uint8_t *)buf);
+		iovs.push_back({ buf, buffer_size });
+	}
+	busy_.assign(num_buffers, false);
+	// Registering the buffers saves the kernel mapping them for every write, but counts
+	// against the locked memory limit. If we're not allowed, plain writes still work.
+	registered_ = io_uring_register(ring_fd_, IORING_REGISTER_BUFFERS, &iovs[0], num_buffers) == 0;
+	iovs_ = iovs;
+}
+
+UringFile::~UringFile()
+{
+	try
+	{
+		Close();
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "ERROR: " << e.what() << std::endl;
+	}
+	if (sqes_ != MAP_FAILED)
+		munmap(sqes_, sqes_size_);
+	if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_)
+		munmap(cq_ring_, cq_ring_size_);
+	if (sq_ring_ != MAP_FAILED)
+		munmap(sq_ring_, sq_ring_size_);
+	if (ring_fd_ >= 0)
+		close(ring_fd_);
+	for (auto buf : buffers_)
+		free(buf);
+}
+
+void UringFile::Open(std::string const &filename, bool direct)
+{
+	Close();
+	direct_ = direct;
+	fd_ = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | (direct ? O_DIRECT : 0), 0644);
+	if (fd_ < 0 && direct && errno == EINVAL)
+	{
+		// Some filesystems (such as tmpfs) don't do direct I/O.
+		std::cerr << "WARNING: direct I/O not available for " << filename << std::endl;
+		direct_ = false;
+		fd_ = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	if (fd_ < 0)
+		throw std::runtime_error("failed to open output file " + filename);
+	filename_ = filename;
+	offset_ = 0;
+	fill_ = 0;
+}
+
+void UringFile::Write(void const *mem, size_t size)
+{
+	uint8_t const *src = (uint8_t const *)mem;
+	while (size)
+	{
+		size_t n = std::min(size, buffer_size_ - fill_);
+		memcpy(buffers_[current_] + fill_, src, n);
+		fill_ += n, src += n, size -= n;
+		if (fill_ == buffer_size_)
+			queueBuffer();
+	}
+	// One system call sends all the writes this frame filled, and collects any that finished.
+	submit(0);
+}
+
+void UringFile::Close()
+{
+	if (fd_ < 0)
+		return;
+
+	// Whatever goes wrong, the file gets closed, so that a failed Close doesn't leak it.
+	try
+	{
+		uint64_t file_size = offset_ + fill_;
+		if (fill_)
+		{
+			// Direct I/O can only write whole blocks, so we pad, and trim the file afterwards.
+			size_t len = direct_ ? (fill_ + ALIGN - 1) & ~(ALIGN - 1) : fill_;
+			memset(buffers_[current_] + fill_, 0, len - fill_);
+			fill_ = len;
+			queueBuffer();
+		}
+
+		// The fsync waits for all the writes before it, and we wait for everything.
+		unsigned int tail = *sq_tail_, index = tail & *sq_mask_;
+		io_uring_sqe *sqe = (io_uring_sqe *)sqes_ + index;
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->fd = fd_;
+		sqe->flags = IOSQE_IO_DRAIN;
+		sqe->user_data = FSYNC_USER_DATA;
+		sq_array_[index] = index;
+		__atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+		to_submit_++;
+		in_flight_++;
+
+		submit(in_flight_);
+		if (direct_ && ftruncate(fd_, file_size) < 0)
+			throw std::runtime_error("failed to set the size of " + filename_);
+	}
+	catch (std::exception const &)
+	{
+		close(fd_);
+		fd_ = -1;
+		throw;
+	}
+	close(fd_);
+	fd_ = -1;
+}
+
+// Queue a write of the current buffer, and move on to the next one, which may mean
+// waiting for its previous write to finish.
+void UringFile::queueBuffer()
+{
+	unsigned int tail = *sq_tail_, index = tail & *sq_mask_;
+	io_uring_sqe *sqe = (io_uring_sqe *)sqes_ + index;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = fd_;
+	sqe->off = offset_;
+	sqe->user_data = current_;
+	iovs_[current_].iov_len = fill_;
+	if (registered_)
+	{
+		sqe->opcode = IORING_OP_WRITE_FIXED;
+		sqe->addr = (uint64_t)buffers_[current_];
+		sqe->len = fill_;
+		sqe->buf_index = current_;
+	}
+	else
+	{
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->addr = (uint64_t)&iovs_[current_];
+		sqe->len = 1;
+	}
+	sq_array_[index] = index;
+	__atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+	to_submit_++;
+	in_flight_++;
+	busy_[current_] = true;
+	offset_ += fill_;
+	fill_ = 0;
+
+	current_ = (current_ + 1) % buffers_.size();
+	while (busy_[current_])
+		submit(1);
+}
+
+// Submit everything queued, wait for at least wait_for completions, and handle all the
+// completions that are there.
+void UringFile::submit(unsigned int wait_for)
+{
+	while (to_submit_ || wait_for)
+	{
+		int ret = io_uring_enter(ring_fd_, to_submit_, wait_for, wait_for ? IORING_ENTER_GETEVENTS : 0);
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error("io_uring_enter failed: " + std::string(strerror(errno)));
+		}
+		to_submit_ -= ret;
+		wait_for -= std::min(wait_for, reap());
+	}
+	reap();
+}
+
+unsigned int UringFile::reap()
+{
+	unsigned int head = *cq_head_, tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE), count = 0;
+	std::string error;
+	for (; head != tail; head++, count++)
+	{
+		io_uring_cqe const &cqe = ((io_uring_cqe const *)cqes_)[head & *cq_mask_];
+		in_flight_--;
+		if (cqe.user_data == FSYNC_USER_DATA)
+		{
+			if (cqe.res < 0 && error.empty())
+				error = "fsync failed: " + std::string(strerror(-cqe.res));
+			continue;
+		}
+		busy_[cqe.user_data] = false;
+		if (cqe.res < 0 && error.empty())
+			error = "write failed: " + std::string(strerror(-cqe.res));
+		else if (cqe.res >= 0 && (size_t)cqe.res != iovs_[cqe.user_data].iov_len && error.empty())
+			error = "short write";
+	}
+	__atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+	if (!error.empty())
+		throw std::runtime_error("io_uring " + error + " on " + filename_);
+	return count;
+}
+
+#else
+
+bool UringFile::Available()
+{
+	return false;
+}
+
+UringFile::UringFile(unsigned int num_buffers, size_t buffer_size)
+{
+	throw std::runtime_error("io_uring not supported in this build");
+}
+
+UringFile::~UringFile()
+{
+}
+
+void UringFile::Open(std::string const &filename, bool direct)
+{
+}
+
+void UringFile::Write(void const *mem, size_t size)
+{
+}
+
+void UringFile::Close()
+{
+}
+
+#endif
@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * uring_file.hpp - write files using io_uring.
+ */
+
+#pragma once
+
+#include <sys/uio.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Writes a file through io_uring. Data is gathered into a few large, page aligned
+// buffers (registered with the kernel where the memlock limit allows), and each
+// full buffer is queued as a single write at its own file offset. Queued writes are
+// submitted together at most once per Write call, and the final write and an fsync
+// go in together when the file is closed. With direct I/O (O_DIRECT) the data
+// bypasses the page cache altogether.
+class UringFile
+{
+public:
+	// Returns false if the kernel (or the headers we were built with) lack io_uring.
+	static bool Available();
+
+	UringFile(unsigned int num_buffers = 8, size_t buffer_size = 1 << 20);
+	~UringFile();
+	// Open a new file, closing any previous one. If direct I/O isn't possible for this
+	// file we carry on without it.
+	void Open(std::string const &filename, bool direct);
+	void Write(void const *mem, size_t size);
+	// Write out what's left, fsync and close the file.
+	void Close();
+
+private:
+	void queueBuffer();
+	void submit(unsigned int wait_for);
+	unsigned int reap();
+
+	int ring_fd_;
+	void *sq_ring_, *cq_ring_, *sqes_;
+	size_t sq_ring_size_, cq_ring_size_, sqes_size_;
+	unsigned int *sq_head_, *sq_tail_, *sq_mask_, *sq_array_;
+	unsigned int *cq_head_, *cq_tail_, *cq_mask_;
+	void *cqes_;
+	unsigned int to_submit_;
+	unsigned int in_flight_;
+
+	size_t buffer_size_;
+	std::vector<uint8_t *> buffers_;
+	// Also records the length of each buffer's write.
+	std::vector<iovec> iovs_;
+	std::vector<bool> busy_;
+	bool registered_;
+	unsigned int current_;
+	size_t fill_;
+
+	int fd_;
+	bool direct_;
+	uint64_t offset_;
+	std::string filename_;
+};
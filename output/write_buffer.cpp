@@ -0,0 +1,158 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * write_buffer.cpp - write output files from a thread of their own.
+ */
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include "write_buffer.hpp"
+
+// The most we hand to a single write call.
+static constexpr size_t MAX_WRITE = 4 << 20;
+
+WriteBuffer::WriteBuffer(size_t size, Policy policy)
+	: buf_(size), policy_(policy), queued_(0), written_(0), fd_(-1), dropping_(false), high_water_(0),
+	  frames_dropped_(0), blocked_time_(0), abort_(false)
+{
+	writer_thread_ = std::thread(&WriteBuffer::writerThread, this);
+}
+
+WriteBuffer::~WriteBuffer()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+		data_cond_var_.notify_one();
+	}
+	writer_thread_.join();
+	if (fd_ >= 0 && fd_ != STDOUT_FILENO)
+		close(fd_);
+}
+
+void WriteBuffer::SetFile(int fd)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	file_changes_.push({ queued_, fd });
+	data_cond_var_.notify_one();
+}
+
+bool WriteBuffer::Write(void const *mem, size_t size, bool keyframe)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	if (!error_.empty())
+		throw std::runtime_error(error_);
+
+	// Once we've dropped a frame, the ones that depend on it are no use either.
+	if (dropping_ && !keyframe)
+	{
+		frames_dropped_++;
+		return false;
+	}
+	if (size > buf_.size())
+	{
+		if (policy_ == Policy::Block)
+			throw std::runtime_error("frame of " + std::to_string(size) + " bytes is too big for the write buffer");
+		dropping_ = true;
+		frames_dropped_++;
+		return false;
+	}
+	if (queued_ - written_ + size > buf_.size())
+	{
+		if (policy_ == Policy::Drop)
+		{
+			dropping_ = true;
+			frames_dropped_++;
+			return false;
+		}
+		auto start = std::chrono::high_resolution_clock::now();
+		space_cond_var_.wait(lock, [&] { return queued_ - written_ + size <= buf_.size() || !error_.empty(); });
+		blocked_time_ += std::chrono::high_resolution_clock::now() - start;
+		if (!error_.empty())
+			throw std::runtime_error(error_);
+	}
+	dropping_ = false;
+
+	// Only this thread adds data, and the writer never touches the free space, so we can
+	// copy without holding the lock.
+	size_t pos = queued_ % buf_.size();
+	lock.unlock();
+	size_t n = std::min(size, buf_.size() - pos);
+	memcpy(&buf_[pos], mem, n);
+	memcpy(&buf_[0], (uint8_t const *)mem + n, size - n);
+	lock.lock();
+
+	queued_ += size;
+	high_water_ = std::max<size_t>(high_water_, queued_ - written_);
+	data_cond_var_.notify_one();
+	return true;
+}
+
+void WriteBuffer::ReportStats() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	std::cout << "Write buffer: peaked at " << high_water_ << " of " << buf_.size() << " bytes, " << frames_dropped_
+			  << " frames dropped, blocked for " << (int)(blocked_time_.count() * 1000) << "ms" << std::endl;
+}
+
+void WriteBuffer::writerThread()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (true)
+	{
+		data_cond_var_.wait(lock, [this] { return abort_ || queued_ != written_ || !file_changes_.empty(); });
+		if (!file_changes_.empty() && file_changes_.front().position == written_)
+		{
+			int old_fd = fd_;
+			fd_ = file_changes_.front().fd;
+			file_changes_.pop();
+			if (old_fd >= 0 && old_fd != STDOUT_FILENO)
+				close(old_fd);
+			continue;
+		}
+		if (queued_ == written_)
+		{
+			// Finish writing anything that's queued before we stop.
+			if (abort_)
+				return;
+			continue;
+		}
+
+		// Write as much as we can in one go, stopping at the end of the ring or at the
+		// next change of file.
+		uint64_t end = queued_;
+		if (!file_changes_.empty())
+			end = file_changes_.front().position;
+		size_t pos = written_ % buf_.size();
+		size_t n = std::min<uint64_t>({ end - written_, buf_.size() - pos, MAX_WRITE });
+		int fd = fd_;
+		lock.unlock();
+		std::string error;
+		for (size_t done = 0; done < n && fd >= 0;)
+		{
+			ssize_t ret = write(fd, &buf_[pos + done], n - done);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret < 0)
+			{
+				error = std::string("failed to write output bytes: ") + strerror(errno);
+				break;
+			}
+			done += ret;
+		}
+		lock.lock();
+
+		// After an error we keep discarding data, so that nothing waits forever.
+		if (!error.empty() && error_.empty())
+			error_ = error;
+		written_ += n;
+		space_cond_var_.notify_one();
+	}
+}
@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * write_buffer.hpp - write output files from a thread of their own.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Copies output data into a fixed size byte ring, from which its own thread writes
+// it to the current file in large chunks. The caller never waits for the disk
+// unless the ring fills up, in which case it either waits for space (the "block"
+// policy) or drops frames until the next keyframe that fits ("drop").
+class WriteBuffer
+{
+public:
+	enum class Policy
+	{
+		Block,
+		Drop
+	};
+	WriteBuffer(size_t size, Policy policy);
+	~WriteBuffer();
+	// Everything written from now on goes to this file descriptor, once the data already
+	// queued has gone to the previous one (which is then closed, unless it is stdout).
+	// An fd of -1 just closes the previous file.
+	void SetFile(int fd);
+	// Queue a frame for writing, returning false if it had to be dropped. Errors from
+	// the writer thread are thrown from here.
+	bool Write(void const *mem, size_t size, bool keyframe);
+	// Print how full the ring got, and what we had to do about it.
+	void ReportStats() const;
+
+private:
+	void writerThread();
+
+	std::vector<uint8_t> buf_;
+	Policy policy_;
+	// Byte counts since we started. The data in the ring is [written_, queued_).
+	uint64_t queued_;
+	uint64_t written_;
+	struct FileChange
+	{
+		uint64_t position;
+		int fd;
+	};
+	std::queue<FileChange> file_changes_;
+	int fd_;
+	bool dropping_;
+	std::string error_;
+	// Statistics.
+	size_t high_water_;
+	unsigned int frames_dropped_;
+	std::chrono::duration<double> blocked_time_;
+	mutable std::mutex mutex_;
+	std::condition_variable data_cond_var_;
+	std::condition_variable space_cond_var_;
+	bool abort_;
+	std::thread writer_thread_;
+};
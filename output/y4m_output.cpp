@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * y4m_output.cpp - write uncompressed YUV420 video to Y4M files.
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <iostream>
+#include <numeric>
+#include <stdexcept>
+
+#include "y4m_output.hpp"
+
+Y4mOutput::Y4mOutput(VideoOptions const *options)
+	: Output(options), fd_(-1), count_(0), file_start_time_ms_(0), width_(0), height_(0), stride_(0)
+{
+}
+
+Y4mOutput::~Y4mOutput()
+{
+	closeFile();
+}
+
+void Y4mOutput::SetVideoFormat(unsigned int width, unsigned int height, unsigned int stride)
+{
+	if ((width | height) & 1)
+		throw std::runtime_error("Y4M output needs even frame dimensions");
+	width_ = width;
+	height_ = height;
+	stride_ = stride;
+
+	// The framerate goes in as a fraction, to the nearest 1/1000fps. Without a fixed
+	// framerate, claim the usual 30fps rather than writing an invalid F0:1.
+	float framerate = options_->framerate > 0 ? options_->framerate : 30;
+	unsigned int num = std::lround(framerate * 1000), den = 1000;
+	unsigned int gcd = std::gcd(num, den);
+	header_ = "YUV4MPEG2 W" + std::to_string(width) + " H" + std::to_string(height) + " F" +
+			  std::to_string(num / gcd) + ":" + std::to_string(den / gcd) + " Ip A1:1 C420jpeg\n";
+}
+
+void Y4mOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	if (!width_)
+		throw std::runtime_error("Y4M output has not been given the frame format");
+	if (size < stride_ * height_ * 3 / 2)
+		throw std::runtime_error("Y4M output buffer too small");
+
+	// Every frame is a "keyframe", so segments can change on any frame. On stdout there
+	// is only the one stream, and a second header in the middle of it would be invalid,
+	// so we never start a new segment there.
+	bool new_segment = (options_->segment && timestamp_us / 1000 - file_start_time_ms_ > options_->segment) ||
+					   (options_->split && (flags & FLAG_RESTART));
+	if (fd_ < 0 || (new_segment && fd_ != STDOUT_FILENO))
+	{
+		closeFile();
+		openFile(timestamp_us);
+	}
+
+	if (options_->verbose)
+		std::cout << "Y4mOutput: output buffer " << mem << " size " << size << "\n";
+
+	// The iovecs point at the frame header and at each visible row of the frame (or each
+	// whole plane when there is no padding). They don't outlive this call.
+	std::string frame_header = "FRAME";
+	if (options_->y4m_timestamps)
+		frame_header += " Xts=" + std::to_string(timestamp_us);
+	frame_header += "\n";
+	std::vector<iovec> iov;
+	iov.reserve(height_ * 2 + 1);
+	iov.push_back({ (void *)frame_header.data(), frame_header.size() });
+	uint8_t *plane = (uint8_t *)mem;
+	for (unsigned int p = 0; p < 3; p++)
+	{
+		unsigned int w = p ? width_ / 2 : width_, h = p ? height_ / 2 : height_, stride = p ? stride_ / 2 : stride_;
+		if (stride == w)
+			iov.push_back({ plane, w * h });
+		else
+		{
+			for (unsigned int y = 0; y < h; y++)
+				iov.push_back({ plane + y * stride, w });
+		}
+		plane += stride * h;
+	}
+	writeAll(iov);
+	if (options_->flush)
+		fdatasync(fd_);
+}
+
+// Write everything, in as few writev calls as IOV_MAX allows, coping with short writes.
+void Y4mOutput::writeAll(std::vector<iovec> &iov)
+{
+	for (size_t i = 0; i < iov.size();)
+	{
+		ssize_t n = writev(fd_, &iov[i], std::min<size_t>(iov.size() - i, IOV_MAX));
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error("failed to write output bytes");
+		}
+		for (; i < iov.size() && (size_t)n >= iov[i].iov_len; i++)
+			n -= iov[i].iov_len;
+		if (n)
+		{
+			iov[i].iov_base = (uint8_t *)iov[i].iov_base + n;
+			iov[i].iov_len -= n;
+		}
+	}
+}
+
+void Y4mOutput::openFile(int64_t timestamp_us)
+{
+	if (options_->output == "-")
+		fd_ = STDOUT_FILENO;
+	else
+	{
+		// Generate the next output file name.
+		char filename[256];
+		int n = snprintf(filename, sizeof(filename), options_->output.c_str(), count_);
+		count_++;
+		if (options_->wrap)
+			count_ = count_ % options_->wrap;
+		if (n < 0 || n >= (int)sizeof(filename))
+			throw std::runtime_error("failed to generate filename");
+
+		fd_ = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd_ < 0)
+			throw std::runtime_error("failed to open output file " + std::string(filename));
+		if (options_->verbose)
+			std::cout << "Y4mOutput: opened output file " << filename << std::endl;
+	}
+	file_start_time_ms_ = timestamp_us / 1000;
+
+	// Each file (and so each segment) starts with its own stream header.
+	std::vector<iovec> iov = { { (void *)header_.data(), header_.size() } };
+	writeAll(iov);
+}
+
+void Y4mOutput::closeFile()
+{
+	if (fd_ >= 0 && fd_ != STDOUT_FILENO)
+		close(fd_);
+	fd_ = -1;
+}
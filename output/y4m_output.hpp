@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * y4m_output.hpp - write uncompressed YUV420 video to Y4M files.
+ */
+
+#pragma once
+
+#include <sys/uio.h>
+
+#include <vector>
+
+#include "output.hpp"
+
+// Writes yuv420 frames in the YUV4MPEG2 container (for a .y4m output, or any output,
+// stdout included, with --y4m), which records the frame size and rate in a header at
+// the start of each file (and each segment, except on stdout, which is always a single
+// stream with a single header). Only the visible
+// pixels are written, straight from the frame buffer with writev, so the row
+// padding never reaches the disk. Optionally, each frame header carries the
+// frame's timestamp in microseconds as an "Xts=" parameter.
+class Y4mOutput : public Output
+{
+public:
+	Y4mOutput(VideoOptions const *options);
+	~Y4mOutput();
+	void SetVideoFormat(unsigned int width, unsigned int height, unsigned int stride) override;
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	void openFile(int64_t timestamp_us);
+	void closeFile();
+	void writeAll(std::vector<iovec> &iov);
+	int fd_;
+	unsigned int count_;
+	int64_t file_start_time_ms_;
+	unsigned int width_, height_, stride_;
+	std::string header_;
+};
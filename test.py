@@ -12,9 +12,19 @@
 # get a test in here.
 
 import argparse
+import array
+import ctypes
+import ctypes.util
+import mmap
 import os
 import os.path
+import re
+import signal
+import socket
+import struct
 import subprocess
+import time
+import zlib
 from timeit import default_timer as timer
 
 class TestFailure(Exception):
@@ -26,7 +36,8 @@ def check_exists(file, preamble):
     if not os.path.isfile(file):
         raise TestFailure(preamble + ": " + file + " not found")
 
-def clean_dir(dir, exts = ('.jpg', '.png', '.bmp', '.dng', '.h264', '.mjpeg', '.raw', '.txt')):
+def clean_dir(dir, exts = ('.jpg', '.png', '.bmp', '.dng', '.h264', '.mjpeg', '.raw', '.rice', '.yuv', '.y4m', '.mp4',
+                           '.ts', '.txt')):
     for file in os.listdir(dir):
         if file.endswith(exts):
             os.remove(os.path.join(dir, file))
@@ -39,6 +50,17 @@ def run_executable(args, logfile):
     time_taken = timer() - start_time
     return p.returncode, time_taken
 
+def run_executable_with_signal(args, logfile, delay, signal_number):
+    # As run_executable, but send the process a signal after delay seconds.
+    start_time = timer()
+    with open(logfile, 'w') as logfile:
+        p = subprocess.Popen(args, stdout = logfile, stderr = subprocess.STDOUT)
+        time.sleep(delay)
+        p.send_signal(signal_number)
+        p.communicate()
+    time_taken = timer() - start_time
+    return p.returncode, time_taken
+
 def check_retcode(retcode, preamble):
     if retcode:
         raise TestFailure(preamble + " failed, return code " + str(retcode))
@@ -96,6 +118,178 @@ def check_size(file, limit, presamble):
     if os.path.getsize(file) < limit:
         raise TestFailure(preamble + " failed, file " + file + " too small")
 
+def open_libtiff():
+    # We read DNGs back through libtiff itself, if we can find it.
+    name = ctypes.util.find_library('tiff')
+    if not name:
+        return None
+    libtiff = ctypes.CDLL(name)
+    libtiff.TIFFOpen.restype = ctypes.c_void_p
+    libtiff.TIFFOpen.argtypes = [ctypes.c_char_p, ctypes.c_char_p]
+    libtiff.TIFFClose.argtypes = [ctypes.c_void_p]
+    libtiff.TIFFSetSubDirectory.argtypes = [ctypes.c_void_p, ctypes.c_uint64]
+    libtiff.TIFFComputeTile.restype = ctypes.c_uint32
+    libtiff.TIFFComputeTile.argtypes = [ctypes.c_void_p, ctypes.c_uint32, ctypes.c_uint32, ctypes.c_uint32,
+                                        ctypes.c_uint16]
+    libtiff.TIFFReadRawTile.restype = ctypes.c_ssize_t
+    libtiff.TIFFReadRawTile.argtypes = [ctypes.c_void_p, ctypes.c_uint32, ctypes.c_void_p, ctypes.c_ssize_t]
+    libtiff.TIFFReadScanline.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint32, ctypes.c_uint16]
+    libtiff.TIFFScanlineSize.restype = ctypes.c_ssize_t
+    libtiff.TIFFScanlineSize.argtypes = [ctypes.c_void_p]
+    # libtiff can't decode DNG's lossless JPEG or predictor itself, and warns about them.
+    libtiff.TIFFSetWarningHandler.argtypes = [ctypes.c_void_p]
+    libtiff.TIFFSetWarningHandler(None)
+    return libtiff
+
+def tiff_field(libtiff, tif, tag, ctype):
+    value = ctype()
+    if not libtiff.TIFFGetField(ctypes.c_void_p(tif), ctypes.c_uint32(tag), ctypes.byref(value)):
+        return None
+    return value.value
+
+def ljpeg_decode_tile(data, preamble):
+    # Decode one lossless JPEG DNG tile, as we write them: a single Huffman table, and
+    # two interleaved components using predictor 1.
+    huffman = {}
+    pos = 2
+    while True:
+        if data[pos] != 0xff:
+            raise TestFailure(preamble + " failed, bad lossless JPEG marker")
+        marker = data[pos + 1]
+        length = data[pos + 2] << 8 | data[pos + 3]
+        segment = data[pos + 4:pos + 2 + length]
+        pos += 2 + length
+        if marker == 0xc4:
+            code = 0
+            values = iter(segment[17:])
+            for size in range(1, 17):
+                for n in range(segment[size]):
+                    huffman[format(code, '0' + str(size) + 'b')] = next(values)
+                    code += 1
+                code <<= 1
+        elif marker == 0xc3:
+            bits = segment[0]
+            height = segment[1] << 8 | segment[2]
+            width = 2 * (segment[3] << 8 | segment[4])
+        elif marker == 0xda:
+            break
+
+    stream = data[pos:data.index(b'\xff\xd9', pos)].replace(b'\xff\x00', b'\xff')
+    bitstring = bin(int.from_bytes(b'\x01' + stream, 'big'))[3:]
+    samples = array.array('H', bytes(2 * width * height))
+    p = 0
+    for i in range(width * height):
+        size = 1
+        while bitstring[p:p + size] not in huffman:
+            size += 1
+            if size > 16 or p + size > len(bitstring):
+                raise TestFailure(preamble + " failed, bad lossless JPEG data")
+        category = huffman[bitstring[p:p + size]]
+        p += size
+        diff = 32768 if category == 16 else 0
+        if category and category < 16:
+            diff = int(bitstring[p:p + category], 2)
+            p += category
+            if diff < 1 << (category - 1):
+                diff -= (1 << category) - 1
+        if i % width >= 2:
+            pred = samples[i - 2]
+        else:
+            pred = samples[i - width] if i >= width else 1 << (bits - 1)
+        samples[i] = (pred + diff) & 0xffff
+    if len(bitstring) - p >= 8:
+        raise TestFailure(preamble + " failed, lossless JPEG data left over")
+    return width, height, bits, samples
+
+def deflate_decode_tile(data, tile_width):
+    # Inflate a DNG tile and undo the "horizontal difference X2" predictor.
+    samples = array.array('H', zlib.decompress(data))
+    for start in range(0, len(samples), tile_width):
+        for i in range(start + 2, start + tile_width):
+            samples[i] = (samples[i] + samples[i - 2]) & 0xffff
+    return samples
+
+def read_dng_regions(file, preamble):
+    # Read the top left, top right and bottom right corners of a DNG's raw image back
+    # through libtiff, returning each as a list of rows of samples, or None if there's no
+    # libtiff. Compressed DNGs are tiled, each corner being one tile, which we decompress
+    # ourselves, checking the padding outside the image as we go.
+    libtiff = open_libtiff()
+    if not libtiff:
+        print("WARNING:", preamble, "- libtiff not found")
+        return None
+    tif = libtiff.TIFFOpen(file.encode(), b'r')
+    if not tif:
+        raise TestFailure(preamble + " failed, libtiff could not open " + file)
+    try:
+        count = ctypes.c_uint16()
+        offsets = ctypes.POINTER(ctypes.c_uint64)()
+        if not libtiff.TIFFGetField(ctypes.c_void_p(tif), ctypes.c_uint32(330), ctypes.byref(count),
+                                    ctypes.byref(offsets)) or not count.value:
+            raise TestFailure(preamble + " failed, " + file + " has no raw image")
+        if not libtiff.TIFFSetSubDirectory(tif, offsets[0]):
+            raise TestFailure(preamble + " failed, libtiff could not read the raw image of " + file)
+        width = tiff_field(libtiff, tif, 256, ctypes.c_uint32)
+        height = tiff_field(libtiff, tif, 257, ctypes.c_uint32)
+        compression = tiff_field(libtiff, tif, 259, ctypes.c_uint16)
+        tile_size = tiff_field(libtiff, tif, 322, ctypes.c_uint32) or 256
+        corners = [(0, 0), ((width - 1) // tile_size * tile_size, 0),
+                   ((width - 1) // tile_size * tile_size, (height - 1) // tile_size * tile_size)]
+
+        regions = []
+        if compression == 1:
+            line = ctypes.create_string_buffer(libtiff.TIFFScanlineSize(tif))
+            for x, y in corners:
+                rows = []
+                for row in range(y, min(y + tile_size, height)):
+                    if libtiff.TIFFReadScanline(tif, line, row, 0) < 0:
+                        raise TestFailure(preamble + " failed, libtiff could not read " + file)
+                    rows.append(array.array('H', line.raw)[x:min(x + tile_size, width)])
+                regions.append(rows)
+            return regions
+
+        buf = ctypes.create_string_buffer(tile_size * tile_size * 4)
+        for x, y in corners:
+            tile = libtiff.TIFFComputeTile(tif, x, y, 0, 0)
+            size = libtiff.TIFFReadRawTile(tif, tile, buf, len(buf))
+            if size <= 0:
+                raise TestFailure(preamble + " failed, libtiff could not read tile " + str(tile) + " of " + file)
+            if compression == 7:
+                w, h, bits, samples = ljpeg_decode_tile(buf.raw[:size], preamble)
+                if (w, h) != (tile_size, tile_size) or bits != tiff_field(libtiff, tif, 258, ctypes.c_uint16) or \
+                   max(samples) >= 1 << bits:
+                    raise TestFailure(preamble + " failed, bad lossless JPEG tile " + str(tile) + " in " + file)
+            else:
+                samples = deflate_decode_tile(buf.raw[:size], tile_size)
+                if len(samples) != tile_size * tile_size:
+                    raise TestFailure(preamble + " failed, bad deflate tile " + str(tile) + " in " + file)
+            # Padding repeats the pixel two to the left, or the row two above.
+            cols, rows = min(tile_size, width - x), min(tile_size, height - y)
+            tile_rows = [samples[i:i + tile_size] for i in range(0, len(samples), tile_size)]
+            for i, row in enumerate(tile_rows):
+                if any(row[j] != row[j - 2] for j in range(cols, tile_size)) or \
+                   (i >= rows and row != tile_rows[i - 2]):
+                    raise TestFailure(preamble + " failed, bad padding in tile " + str(tile) + " of " + file)
+            regions.append([row[:cols] for row in tile_rows[:rows]])
+        return regions
+    finally:
+        libtiff.TIFFClose(tif)
+
+def check_dng_regions(file, reference, preamble):
+    # Check a compressed DNG's corner tiles against those of an uncompressed capture of the
+    # same scene. They're different frames, so only the average levels should match.
+    regions = read_dng_regions(file, preamble)
+    if regions is None or reference is None:
+        return
+    for region, ref in zip(regions, reference):
+        if len(region) != len(ref) or len(region[0]) != len(ref[0]):
+            raise TestFailure(preamble + " failed, tile size mismatch in " + file)
+        mean = sum(sum(row) for row in region) / (len(region) * len(region[0]))
+        ref_mean = sum(sum(row) for row in ref) / (len(ref) * len(ref[0]))
+        if abs(mean - ref_mean) > 0.25 * ref_mean + 64:
+            raise TestFailure(preamble + " failed, " + file + " tile level " + str(mean) + " doesn't match " +
+                              str(ref_mean))
+
 def test_still(dir):
     executable = os.path.join(dir, 'libcamera-still')
     output_jpg = os.path.join(dir, 'test.jpg')
@@ -130,6 +324,25 @@ def test_still(dir):
     check_time(time_taken, 2, 8, "test_still: bmp test")
     check_size(output_png, 1024, "test_still: bmp test")
 
+    # "yuv420 test". Write an uncompressed yuv420 frame, which should be exactly width * height * 3 / 2 bytes.
+    print("    yuv420 test")
+    output_yuv = os.path.join(dir, 'test.yuv')
+    retcode, time_taken = run_executable(
+        [executable, '-t', '1000', '-e', 'yuv420', '--width', '640', '--height', '480', '-o', output_yuv], logfile)
+    check_retcode(retcode, "test_still: yuv420 test")
+    check_time(time_taken, 2, 8, "test_still: yuv420 test")
+    check_size(output_yuv, 640 * 480 * 3 // 2, "test_still: yuv420 test")
+    if os.path.getsize(output_yuv) != 640 * 480 * 3 // 2:
+        raise TestFailure("test_still: yuv420 test failed, file " + output_yuv + " has the wrong size")
+
+    # "colour space test". Write a png converting from YUV with a different colour space.
+    print("    colour space test")
+    retcode, time_taken = run_executable(
+        [executable, '-t', '1000', '-e', 'png', '--colour-space', 'rec709', '-o', output_png], logfile)
+    check_retcode(retcode, "test_still: colour space test")
+    check_time(time_taken, 2, 8, "test_still: colour space test")
+    check_size(output_png, 1024, "test_still: colour space test")
+
     # "dng test". Write a dng along with the jpg.
     print("    dng test")
     retcode, time_taken = run_executable(
@@ -139,6 +352,18 @@ def test_still(dir):
     check_size(output_jpg, 1024, "test_still: dng test")
     check_size(output_dng, 1024 * 1024, "test_still: dng test")
 
+    # "dng compression test". Write lossless JPEG and deflate compressed dngs, and read their
+    # tiles back to compare with the uncompressed dng.
+    print("    dng compression test")
+    reference = read_dng_regions(output_dng, "test_still: dng compression test")
+    for compression in ('ljpeg', 'deflate'):
+        retcode, time_taken = run_executable(
+            [executable, '-t', '1000', '-o', output_jpg, '-r', '--raw-compression', compression], logfile)
+        check_retcode(retcode, "test_still: dng compression test")
+        check_time(time_taken, 2, 8, "test_still: dng compression test")
+        check_size(output_dng, 1024, "test_still: dng compression test")
+        check_dng_regions(output_dng, reference, "test_still: dng compression test")
+
     # "timelapse test". Check that a timelapse sequence captures more than one jpg.
     print("    timelapse test")
     retcode, time_taken = run_executable(
@@ -151,6 +376,36 @@ def test_still(dir):
     if os.path.isfile(os.path.join(dir, 'test002.jpg')):
                raise("test_still: timelapse test, unexpected output file")
 
+    # "burst test". Check that a burst captures the requested number of jpgs.
+    print("    burst test")
+    retcode, time_taken = run_executable(
+        [executable, '-t', '1000', '--burst', '3', '-o', os.path.join(dir, 'burst%03d.jpg')], logfile)
+    check_retcode(retcode, "test_still: burst test")
+    check_time(time_taken, 2, 12, "test_still: burst test")
+    for i in range(3):
+        check_size(os.path.join(dir, 'burst{:03d}.jpg'.format(i)), 1024, "test_still: burst test")
+    if os.path.isfile(os.path.join(dir, 'burst003.jpg')):
+        raise TestFailure("test_still: burst test, unexpected output file")
+
+    # "stack test". Check that stacking raw frames writes a jpg and a dng, in both modes.
+    print("    stack test")
+    for mode in ('average', 'sum'):
+        retcode, time_taken = run_executable(
+            [executable, '-t', '1000', '-o', output_jpg, '--stack', '4', '--stack-mode', mode], logfile)
+        check_retcode(retcode, "test_still: stack test")
+        check_time(time_taken, 2, 12, "test_still: stack test")
+        check_size(output_jpg, 1024, "test_still: stack test")
+        check_size(output_dng, 1024 * 1024, "test_still: stack test")
+
+    # "bracket test". Check that a fused exposure bracket writes a jpg and a dng.
+    print("    bracket test")
+    retcode, time_taken = run_executable(
+        [executable, '-t', '1000', '-o', output_jpg, '-r', '--bracket', '-2,0,2'], logfile)
+    check_retcode(retcode, "test_still: bracket test")
+    check_time(time_taken, 2, 12, "test_still: bracket test")
+    check_size(output_jpg, 1024, "test_still: bracket test")
+    check_size(output_dng, 1024 * 1024, "test_still: bracket test")
+
     print("libcamera-still tests passed")
     
 def check_jpeg_shutter(file, shutter_string, iso_string, preamble):
@@ -221,6 +476,89 @@ def check_timestamps(file, preamble):
     if t2 >= t3:
         raise TestFailure(preamble + " - timestamps not increasing")
 
+def check_frame_rate(file, framerate, preamble):
+    # The typical spacing of the timestamps should match the frame rate we asked for.
+    try:
+        with open(file) as f:
+            timestamps = [float(line) for line in f.readlines()[1:]]
+    except:
+        raise TestFailure(preamble + " - could not read timestamps from file")
+    if len(timestamps) < 3:
+        raise TestFailure(preamble + " - too few timestamps")
+    deltas = sorted(t2 - t1 for t1, t2 in zip(timestamps, timestamps[1:]))
+    median = deltas[len(deltas) // 2]
+    if abs(median - 1000 / framerate) > 0.1 * 1000 / framerate:
+        raise TestFailure(preamble + " - frame interval " + str(median) + "ms doesn't match " +
+                          str(framerate) + "fps")
+
+def crc32_mpeg(data):
+    crc = 0xffffffff
+    for byte in data:
+        crc ^= byte << 24
+        for bit in range(8):
+            crc = ((crc << 1) ^ 0x04c11db7 if crc & 0x80000000 else crc << 1) & 0xffffffff
+    return crc
+
+def demux_mpegts(file, preamble):
+    # Check the packets, tables and continuity counters of a transport stream, returning
+    # the PTS and contents of each video PES packet.
+    with open(file, 'rb') as f:
+        data = f.read()
+    if not data or len(data) % 188:
+        raise TestFailure(preamble + " failed, " + file + " is not a whole number of packets")
+    continuity = {}
+    pmt_pid = video_pid = None
+    pes_packets = []
+    for i in range(0, len(data), 188):
+        packet = data[i:i + 188]
+        if packet[0] != 0x47:
+            raise TestFailure(preamble + " failed, lost sync at byte " + str(i))
+        pid = ((packet[1] & 0x1f) << 8) | packet[2]
+        if pid in continuity and packet[3] & 0xf != (continuity[pid] + 1) & 0xf:
+            raise TestFailure(preamble + " failed, continuity error at byte " + str(i))
+        continuity[pid] = packet[3] & 0xf
+        payload = packet[4:] if packet[3] & 0x10 else b''
+        if packet[3] & 0x20:
+            payload = payload[1 + packet[4]:]
+        if pid == 0 or pid == pmt_pid:
+            section = payload[1 + payload[0]:]
+            section = section[:3 + (((section[1] & 0xf) << 8) | section[2])]
+            if crc32_mpeg(section):
+                raise TestFailure(preamble + " failed, bad CRC in table on pid " + str(pid))
+            if pid == 0:
+                pmt_pid = ((section[10] & 0x1f) << 8) | section[11]
+            elif section[12] == 0x1b:
+                video_pid = ((section[13] & 0x1f) << 8) | section[14]
+        elif pid == video_pid:
+            if packet[1] & 0x40:
+                pes_packets.append(bytearray())
+            elif not pes_packets:
+                raise TestFailure(preamble + " failed, video data before the start of a PES packet")
+            pes_packets[-1] += payload
+    if not pes_packets:
+        raise TestFailure(preamble + " failed, no video found in " + file)
+    frames = []
+    for pes in pes_packets:
+        if pes[0:4] != b'\x00\x00\x01\xe0' or not pes[7] & 0x80:
+            raise TestFailure(preamble + " failed, bad PES header")
+        pts = ((pes[9] >> 1) & 7) << 30 | pes[10] << 22 | (pes[11] >> 1) << 15 | pes[12] << 7 | pes[13] >> 1
+        frames.append((pts, bytes(pes[9 + pes[8]:])))
+    return frames
+
+def check_mpegts(file, timestamps_file, preamble):
+    # Demux the file, and check each frame's PTS against the saved timestamps (to within a 90kHz tick).
+    frames = demux_mpegts(file, preamble)
+    with open(timestamps_file) as f:
+        timestamps = [float(line) for line in f if not line.startswith('#')]
+    if len(frames) != len(timestamps):
+        raise TestFailure(preamble + " failed, " + str(len(frames)) + " frames but " +
+                          str(len(timestamps)) + " timestamps")
+    for (pts, es), timestamp in zip(frames, timestamps):
+        if abs((pts - frames[0][0]) - (timestamp - timestamps[0]) * 90) > 1:
+            raise TestFailure(preamble + " failed, PTS " + str(pts) + " doesn't match timestamp " + str(timestamp))
+        if not es.startswith(b'\x00\x00\x00\x01\x09'):
+            raise TestFailure(preamble + " failed, frame doesn't start with an access unit delimiter")
+
 def test_vid(dir):
     executable = os.path.join(dir, 'libcamera-vid')
     output_h264 = os.path.join(dir, 'test.h264')
@@ -228,6 +566,8 @@ def test_vid(dir):
     output_circular = os.path.join(dir, 'circular.h264')
     output_pause = os.path.join(dir, 'pause.h264')
     output_timestamps = os.path.join(dir, 'timestamps.txt')
+    output_snapshot = os.path.join(dir, 'snapshot.jpg')
+    output_raw = os.path.join(dir, 'test.raw')
     logfile = os.path.join(dir, 'log.txt')
     print("Testing", executable)
     check_exists(executable, 'test_vid')
@@ -241,6 +581,29 @@ def test_vid(dir):
     check_time(time_taken, 2, 5, "test_vid: h264 test")
     check_size(output_h264, 1024, "test_vid: h264 test")
 
+    # "write buffer test". As above, but write the file from a separate thread.
+    print("    write buffer test")
+    for policy in ('block', 'drop'):
+        retcode, time_taken = run_executable([executable, '-t', '2000', '--write-buffer', '8',
+                                              '--write-policy', policy, '-o', output_h264], logfile)
+        check_retcode(retcode, "test_vid: write buffer test")
+        check_time(time_taken, 2, 5, "test_vid: write buffer test")
+        check_size(output_h264, 1024, "test_vid: write buffer test")
+    # The write buffer can't flush every frame, so asking it to must fail.
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--write-buffer', '8', '--flush',
+                                          '-o', output_h264], logfile)
+    if retcode == 0:
+        raise TestFailure("test_vid: write buffer test failed, --flush was accepted with a write buffer")
+
+    # "io_uring test". As above, but write the file through io_uring, with and without direct I/O.
+    print("    io_uring test")
+    for direct in ([], ['--direct-io']):
+        retcode, time_taken = run_executable([executable, '-t', '2000', '--io-uring'] + direct +
+                                             ['-o', output_h264], logfile)
+        check_retcode(retcode, "test_vid: io_uring test")
+        check_time(time_taken, 2, 5, "test_vid: io_uring test")
+        check_size(output_h264, 1024, "test_vid: io_uring test")
+
     # "mjpeg test". As above, but write an mjpeg file.
     print("    mjpeg test")
     retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'mjpeg',
@@ -260,6 +623,265 @@ def test_vid(dir):
     # A bug in commit b20dc097621a trunctated each jpg to 4096 bytes, so check against 4100:
     check_size(os.path.join(dir, 'test035.jpg'), 4100, "test_vid: segment test")
 
+    # "y4m test". Write yuv420 to a Y4M file, and check the header and the frame size.
+    print("    y4m test")
+    output_y4m = os.path.join(dir, 'test.y4m')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'yuv420', '--width', '642',
+                                          '--height', '480', '--y4m-timestamps', '-o', output_y4m], logfile)
+    check_retcode(retcode, "test_vid: y4m test")
+    check_time(time_taken, 2, 5, "test_vid: y4m test")
+    with open(output_y4m, 'rb') as f:
+        # The width may not match the stride, so the frames must not include any row padding.
+        header = f.readline().split()
+        if header[0] != b'YUV4MPEG2' or header[1][0:1] != b'W' or header[2][0:1] != b'H':
+            raise TestFailure("test_vid: y4m test failed, bad header " + str(header))
+        frame_header = f.readline()
+        if not frame_header.startswith(b'FRAME Xts='):
+            raise TestFailure("test_vid: y4m test failed, bad frame header " + str(frame_header))
+        f.seek(int(header[1][1:]) * int(header[2][1:]) * 3 // 2, os.SEEK_CUR)
+        if not f.readline().startswith(b'FRAME'):
+            raise TestFailure("test_vid: y4m test failed, frames are the wrong size")
+    # With --y4m any output name gets Y4M, and with no fixed framerate the header still
+    # needs a valid rate.
+    output_yuv = os.path.join(dir, 'test.yuv')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'yuv420', '--y4m',
+                                          '--framerate', '0', '-o', output_yuv], logfile)
+    check_retcode(retcode, "test_vid: y4m test")
+    with open(output_yuv, 'rb') as f:
+        header = f.readline().split()
+        if header[0] != b'YUV4MPEG2' or b'F30:1' not in header:
+            raise TestFailure("test_vid: y4m test failed, bad --y4m header " + str(header))
+
+    # "mp4 test". Write a fragmented MP4 file, and check its top level boxes.
+    print("    mp4 test")
+    output_mp4 = os.path.join(dir, 'test.mp4')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '-o', output_mp4], logfile)
+    check_retcode(retcode, "test_vid: mp4 test")
+    check_time(time_taken, 2, 5, "test_vid: mp4 test")
+    check_size(output_mp4, 1024, "test_vid: mp4 test")
+    boxes = []
+    with open(output_mp4, 'rb') as f:
+        while True:
+            box_header = f.read(8)
+            if len(box_header) < 8:
+                break
+            boxes.append(box_header[4:8])
+            f.seek(int.from_bytes(box_header[0:4], 'big') - 8, os.SEEK_CUR)
+    if boxes[0:2] != [b'ftyp', b'moov'] or b'moof' not in boxes or boxes[-1] != b'mdat':
+        raise TestFailure("test_vid: mp4 test failed, unexpected boxes " + str(boxes))
+
+    # "mpegts test". Write a transport stream, demux it, and check the PTS values against
+    # the saved timestamps. Then write it in segments, each of which should stand alone.
+    print("    mpegts test")
+    output_ts = os.path.join(dir, 'test.ts')
+    output_pts = os.path.join(dir, 'pts.txt')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--save-pts', output_pts,
+                                          '-o', output_ts], logfile)
+    check_retcode(retcode, "test_vid: mpegts test")
+    check_time(time_taken, 2, 5, "test_vid: mpegts test")
+    check_mpegts(output_ts, output_pts, "test_vid: mpegts test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--inline', '--segment', '500',
+                                          '-o', os.path.join(dir, 'test%03d.ts')], logfile)
+    check_retcode(retcode, "test_vid: mpegts test")
+    check_time(time_taken, 2, 5, "test_vid: mpegts test")
+    for segment in ('test000.ts', 'test001.ts'):
+        frames = demux_mpegts(os.path.join(dir, segment), "test_vid: mpegts test")
+        if b'\x00\x00\x01\x67' not in frames[0][1]:
+            raise TestFailure("test_vid: mpegts test failed, " + segment + " doesn't start with a keyframe")
+
+    # "rtp test". Send RTP to ourselves, and check that the packets are valid, MTU-sized
+    # and that some of them end frames.
+    print("    rtp test")
+    with socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as sock:
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4 << 20)
+        sock.bind(('127.0.0.1', 0))
+        port = sock.getsockname()[1]
+        retcode, time_taken = run_executable([executable, '-t', '2000', '--inline',
+                                              '-o', 'rtp://127.0.0.1:' + str(port)], logfile)
+        check_retcode(retcode, "test_vid: rtp test")
+        check_time(time_taken, 2, 5, "test_vid: rtp test")
+        sock.setblocking(False)
+        packets = []
+        try:
+            while True:
+                packets.append(sock.recv(65536))
+        except BlockingIOError:
+            pass
+    if not packets:
+        raise TestFailure("test_vid: rtp test failed, no packets received")
+    if any(len(packet) > 1400 or packet[0] != 0x80 or packet[1] & 0x7f != 96 for packet in packets):
+        raise TestFailure("test_vid: rtp test failed, bad packet")
+    if not any(packet[1] & 0x80 for packet in packets):
+        raise TestFailure("test_vid: rtp test failed, no frames ended")
+
+    # "listen test". Run a TCP server that two clients join part way through. Neither should
+    # delay startup, and both should start receiving at a keyframe.
+    print("    listen test")
+    with socket.socket() as sock:
+        sock.bind(('127.0.0.1', 0))
+        port = sock.getsockname()[1]
+    start_time = timer()
+    with open(logfile, 'w') as log:
+        p = subprocess.Popen([executable, '-t', '3000', '--inline', '--listen', '-o', 'tcp://0.0.0.0:' + str(port)],
+                             stdout = log, stderr = subprocess.STDOUT)
+        time.sleep(1.5)
+        clients = [socket.create_connection(('127.0.0.1', port)) for i in range(2)]
+        received = [bytearray() for client in clients]
+        for client, data in zip(clients, received):
+            client.settimeout(5)
+            try:
+                while True:
+                    chunk = client.recv(65536)
+                    if not chunk:
+                        break
+                    data += chunk
+            except socket.timeout:
+                pass
+            client.close()
+        p.communicate()
+    time_taken = timer() - start_time
+    check_retcode(p.returncode, "test_vid: listen test")
+    check_time(time_taken, 2, 8, "test_vid: listen test")
+    for data in received:
+        if len(data) < 1024 or not data.startswith(b'\x00\x00\x00\x01\x67'):
+            raise TestFailure("test_vid: listen test failed, client didn't receive a stream starting at a keyframe")
+
+    # "http test". Serve MJPEG over HTTP, and check that a client gets a multipart stream of JPEGs,
+    # and that anything but the stream is refused.
+    print("    http test")
+    with socket.socket() as sock:
+        sock.bind(('127.0.0.1', 0))
+        port = sock.getsockname()[1]
+    with open(logfile, 'w') as log:
+        p = subprocess.Popen([executable, '-t', '3000', '--codec', 'mjpeg', '-o', 'http://0.0.0.0:' + str(port)],
+                             stdout = log, stderr = subprocess.STDOUT)
+        time.sleep(1.5)
+        responses = []
+        for path in ['/nothing', '/stream.mjpg']:
+            with socket.create_connection(('127.0.0.1', port)) as client:
+                client.settimeout(5)
+                client.sendall(b'GET ' + path.encode() + b' HTTP/1.1\r\nHost: localhost\r\n\r\n')
+                data = bytearray()
+                try:
+                    while len(data) < 256 * 1024:
+                        chunk = client.recv(65536)
+                        if not chunk:
+                            break
+                        data += chunk
+                except socket.timeout:
+                    pass
+                responses.append(bytes(data))
+        p.communicate()
+    check_retcode(p.returncode, "test_vid: http test")
+    if responses[0].split(b' ')[1:2] != [b'404']:
+        raise TestFailure("test_vid: http test failed, unknown path was not refused")
+    header, _, body = responses[1].partition(b'\r\n\r\n')
+    if header.split(b' ')[1:2] != [b'200'] or b'multipart/x-mixed-replace; boundary=frame' not in header:
+        raise TestFailure("test_vid: http test failed, bad response header")
+    part_header, _, part = body.partition(b'\r\n\r\n')
+    if not part_header.startswith(b'--frame\r\n') or not part.startswith(b'\xff\xd8'):
+        raise TestFailure("test_vid: http test failed, stream doesn't start with a JPEG")
+
+    # "rtsp test". Run an RTSP server (without --inline), and check that a client joining part
+    # way through gets RTP on its connection that starts with the SPS.
+    print("    rtsp test")
+    with socket.socket() as sock:
+        sock.bind(('127.0.0.1', 0))
+        port = sock.getsockname()[1]
+    url = 'rtsp://127.0.0.1:' + str(port) + '/'
+    with open(logfile, 'w') as log:
+        p = subprocess.Popen([executable, '-t', '3000', '-o', 'rtsp://0.0.0.0:' + str(port)],
+                             stdout = log, stderr = subprocess.STDOUT)
+        time.sleep(1.5)
+        data = bytearray()
+        with socket.create_connection(('127.0.0.1', port)) as client:
+            client.settimeout(5)
+            requests = [('DESCRIBE', ''), ('SETUP', 'Transport: RTP/AVP/TCP;unicast;interleaved=0-1\r\n'),
+                        ('PLAY', '')]
+            for cseq, (method, headers) in enumerate(requests):
+                if b'Session: ' in data:
+                    headers += 'Session: ' + data.split(b'Session: ')[1].split(b';')[0].decode() + '\r\n'
+                client.sendall((method + ' ' + url + ' RTSP/1.0\r\nCSeq: ' + str(cseq) + '\r\n' + headers +
+                                '\r\n').encode())
+                while data.count(b'RTSP/1.0 200 OK') <= cseq:
+                    chunk = client.recv(65536)
+                    if not chunk:
+                        raise TestFailure("test_vid: rtsp test failed, " + method + " request refused")
+                    data += chunk
+            try:
+                while len(data) < 256 * 1024:
+                    chunk = client.recv(65536)
+                    if not chunk:
+                        break
+                    data += chunk
+            except socket.timeout:
+                pass
+        p.communicate()
+    check_retcode(p.returncode, "test_vid: rtsp test")
+    if b'sprop-parameter-sets=' not in data:
+        raise TestFailure("test_vid: rtsp test failed, no SPS/PPS in the SDP")
+    rtp = data[data.find(b'\r\n\r\n', data.find(b'CSeq: 2\r\n')) + 4:]
+    if len(rtp) < 1024 or rtp[0:2] != b'$\x00' or rtp[4 + 12] & 0x1f != 7:
+        raise TestFailure("test_vid: rtsp test failed, stream doesn't start with the SPS")
+
+    # "shm test". Publish frames in shared memory, and check that a reader joining part way
+    # through gets frames from the next keyframe, and that the socket goes away afterwards.
+    print("    shm test")
+    socket_path = os.path.join(dir, 'shm.sock')
+    reader = os.path.join(dir, 'shm_read')
+    check_exists(reader, 'test_vid')
+    with open(logfile, 'w') as log:
+        p = subprocess.Popen([executable, '-t', '3000', '--inline', '-o', 'shm://' + socket_path],
+                             stdout = log, stderr = subprocess.STDOUT)
+        time.sleep(1.5)
+        retcode, time_taken = run_executable([reader, socket_path, output_h264, '20'], logfile + '.shm')
+        p.communicate()
+    check_retcode(p.returncode, "test_vid: shm test")
+    check_retcode(retcode, "test_vid: shm test")
+    check_size(output_h264, 1024, "test_vid: shm test")
+    with open(output_h264, 'rb') as f:
+        if f.read(5) != b'\x00\x00\x00\x01\x67':
+            raise TestFailure("test_vid: shm test failed, frames don't start at a keyframe")
+    if os.path.exists(socket_path):
+        raise TestFailure("test_vid: shm test failed, socket was left behind")
+
+    # "dmabuf test". Share the camera buffers, and check that a client can map and release them
+    # for as long as it likes.
+    print("    dmabuf test")
+    socket_path = os.path.join(dir, 'frames.sock')
+    frames = 0
+    with open(logfile, 'w') as log:
+        p = subprocess.Popen([executable, '-t', '3000', '-o', 'dmabuf://' + socket_path],
+                             stdout = log, stderr = subprocess.STDOUT)
+        time.sleep(1.5)
+        message_format = '<QIIqIIIIII4I'
+        fds = {}
+        with socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET) as client:
+            client.connect(socket_path)
+            client.settimeout(5)
+            start_time = timer()
+            while timer() - start_time < 1:
+                message, ancdata, flags, address = client.recvmsg(256, socket.CMSG_LEN(4 * 4))
+                if len(message) != struct.calcsize(message_format):
+                    raise TestFailure("test_vid: dmabuf test failed, bad frame message")
+                frame, sequence, buffer, timestamp, width, height, stride, pixel_format, num_planes, num_fds, \
+                    *plane_length = struct.unpack(message_format, message)
+                for cmsg_level, cmsg_type, data in ancdata:
+                    fds[buffer] = array.array('i', data[:num_fds * 4])
+                if buffer not in fds or width == 0 or height == 0:
+                    raise TestFailure("test_vid: dmabuf test failed, no buffer received")
+                with mmap.mmap(fds[buffer][0], plane_length[0], prot = mmap.PROT_READ) as image:
+                    image[stride * height // 2]
+                client.send(struct.pack('<Q', frame))
+                frames += 1
+        for buffer_fds in fds.values():
+            for fd in buffer_fds:
+                os.close(fd)
+        p.communicate()
+    check_retcode(p.returncode, "test_vid: dmabuf test")
+    if frames < 10:
+        raise TestFailure("test_vid: dmabuf test failed, only " + str(frames) + " frames received")
+
     # "circular test". Test circular buffer (really we should wait for it to wrap...)
     print("    circular test")
     retcode, time_taken = run_executable([executable, '-t', '2000', '--inline', '--circular',
@@ -286,6 +908,59 @@ def test_vid(dir):
     check_size(output_h264, 1024, "test_vid: timestamp test")
     check_timestamps(output_timestamps, "test_vid: timestamp test")
 
+    # "raw output test". Record h264 and the raw stream at the same time, to a flat file
+    # and as a DNG sequence.
+    print("    raw output test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '-o', output_h264,
+                                          '--raw-output', output_raw], logfile)
+    check_retcode(retcode, "test_vid: raw output test")
+    check_time(time_taken, 2, 6, "test_vid: raw output test")
+    check_size(output_h264, 1024, "test_vid: raw output test")
+    check_size(output_raw, 1024 * 1024, "test_vid: raw output test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '-o', output_h264,
+                                          '--raw-output', os.path.join(dir, 'raw%03d.dng')], logfile)
+    check_retcode(retcode, "test_vid: raw output test")
+    check_time(time_taken, 2, 8, "test_vid: raw output test")
+    check_size(output_h264, 1024, "test_vid: raw output test")
+    check_size(os.path.join(dir, 'raw000.dng'), 1024 * 1024, "test_vid: raw output test")
+    # A transport stream video output mustn't turn the raw file into a transport stream too,
+    # so it should hold nothing but whole frames.
+    output_ts = os.path.join(dir, 'test.ts')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '-o', output_ts,
+                                          '--raw-output', output_raw], logfile)
+    check_retcode(retcode, "test_vid: raw output test")
+    check_size(output_ts, 1024, "test_vid: raw output test")
+    with open(logfile) as f:
+        summary = re.search(r"Raw output: (\d+) frames written, \d+ dropped \(stride (\d+), height (\d+)\)", f.read())
+    if not summary:
+        raise TestFailure("test_vid: raw output test failed, no raw output summary in the log")
+    frames, stride, height = (int(n) for n in summary.groups())
+    if frames == 0 or os.path.getsize(output_raw) != frames * stride * height:
+        raise TestFailure("test_vid: raw output test failed, " + output_raw + " is not " + str(frames) +
+                          " whole frames")
+    # Raw frames can't go to an output that would wrap them in a container.
+    retcode, time_taken = run_executable([executable, '-t', '2000', '-o', output_h264,
+                                          '--raw-output', os.path.join(dir, 'raw.mp4')], logfile)
+    if retcode == 0:
+        raise TestFailure("test_vid: raw output test failed, an MP4 raw output was accepted")
+
+    # "snapshot test". Ask for a snapshot part way through a recording.
+    print("    snapshot test")
+    for size in ([], ['--snapshot-width', '1280', '--snapshot-height', '960']):
+        if os.path.isfile(output_snapshot):
+            os.remove(output_snapshot)
+        # A separate snapshot stream must not stop the video running at the requested rate.
+        retcode, time_taken = run_executable_with_signal(
+            [executable, '-t', '3000', '--signal', '-o', output_h264, '--snapshot', output_snapshot,
+             '--framerate', '20', '--save-pts', output_timestamps] + size,
+            logfile, 1.5, signal.SIGRTMIN)
+        check_retcode(retcode, "test_vid: snapshot test")
+        check_time(time_taken, 3, 6, "test_vid: snapshot test")
+        check_size(output_h264, 1024, "test_vid: snapshot test")
+        check_size(output_snapshot, 1024, "test_vid: snapshot test")
+        check_jpeg(output_snapshot, "test_vid: snapshot test")
+        check_frame_rate(output_timestamps, 20, "test_vid: snapshot test")
+
     print("libcamera-vid tests passed")
 
 def test_raw(dir):
@@ -304,6 +979,29 @@ def test_raw(dir):
     check_time(time_taken, 2, 8, "test_vid: raw test")
     check_size(output_raw, 1024, "test_vid: raw test")
 
+    # "raw dng test". Write each frame to its own DNG file.
+    print("    raw dng test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '-o', os.path.join(dir, 'raw%03d.dng')],
+                                         logfile)
+    check_retcode(retcode, "test_vid: raw dng test")
+    check_time(time_taken, 2, 8, "test_vid: raw dng test")
+    check_size(os.path.join(dir, 'raw000.dng'), 1024 * 1024, "test_vid: raw dng test")
+    check_size(os.path.join(dir, 'raw001.dng'), 1024 * 1024, "test_vid: raw dng test")
+
+    # "rice test". Record losslessly compressed raw frames, and check that they all decode.
+    print("    rice test")
+    output_rice = os.path.join(dir, 'test.rice')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'rice', '-o', output_rice],
+                                         logfile)
+    check_retcode(retcode, "test_vid: rice test")
+    check_time(time_taken, 2, 8, "test_vid: rice test")
+    check_size(output_rice, 1024, "test_vid: rice test")
+    decoder = os.path.join(dir, 'rice_decode')
+    check_exists(decoder, 'test_raw')
+    retcode, time_taken = run_executable([decoder, output_rice, output_raw], logfile)
+    check_retcode(retcode, "test_vid: rice test")
+    check_size(output_raw, os.path.getsize(output_rice), "test_vid: rice test")
+
     print("libcamera-raw tests passed")
 
 def test_all(apps, dir):